@@ -11,6 +11,10 @@
  * 5.) chatclient sends a message to chatserve on supplied host and port
  * 6.) \quit closes the connection to the server (and exits)
  *
+ * With -b (batch mode) there's no prompting at all: the handle comes from
+ * -h and every line of stdin (or -f file) is sent as fast as the server
+ * takes it, optionally capped at -r messages per second.
+ *
  * Other Requirements:
  * - Should be able to send up to 500 chars
  * - Must run on flip
@@ -27,15 +31,22 @@
  */
 
 #include "chatclient.h"
+#include "chatframe.h"
+#include "netconnect.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -47,6 +58,10 @@
 #define HANDSHAKE "HELLO"
 #define GOODBYE "\\quit"
 
+static int gVersion = 1;              // Negotiated protocol version, see chatframe.c
+static struct frameReader gReader;    // Receive buffer, kept from the handle exchange into the chat
+static struct frameQueue gQueue;      // Outbound messages
+
 int main( int argc, char *argv[] )
 {
   // Socket File Descriptor
@@ -55,8 +70,6 @@ int main( int argc, char *argv[] )
   struct addrinfo hints;
   // Will point to the results
   struct addrinfo *servinfo;
-  // Will point to the selected socket
-  struct addrinfo *p;
   // Return Value of socket()
   int returnValue;
   // Number of bytes in response
@@ -78,15 +91,51 @@ int main( int argc, char *argv[] )
   socklen_t fromlen;
 
 
+  // Batch mode settings
+  int batch = 0;
+  int inputFd = STDIN_FILENO;
+  double rate = 0;
+  struct batchStats stats;
+  int opt;
+
+  userHandle[0] = 0;
+  while ((opt = getopt(argc, argv, "h:bf:r:")) != -1) {
+    switch (opt) {
+      case 'h':
+        strncpy(userHandle, optarg, MAX_HANDLE_LENGTH-1);
+        userHandle[MAX_HANDLE_LENGTH-1] = 0;
+        break;
+      case 'b':
+        batch = 1;
+        break;
+      case 'f':
+        batch = 1;
+        if ((inputFd = open(optarg, O_RDONLY | O_CLOEXEC)) == -1) {
+          perror(optarg);
+          return 1;
+        }
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      default:
+        optind = argc + 1;
+    }
+  }
+
   // If the number of commandline arguments is wrong, barf
-  if (argc != 3) {
-    printf("Usage: chatclient <hostname> <port>");
+  if (argc - optind != 2 || (batch && userHandle[0] == 0)) {
+    printf("Usage: chatclient [-h handle] <hostname> <port>\n"
+           "       chatclient -h handle -b [-f file] [-r msgs/sec] <hostname> <port>\n");
     return(1);
   }
 
   // Copy the commandline args into named strings, just because
-  strncpy(hostname, argv[1], MAX_ARG_LENGTH);
-  strncpy(port, argv[2], MAX_ARG_LENGTH);
+  strncpy(hostname, argv[optind], MAX_ARG_LENGTH);
+  strncpy(port, argv[optind + 1], MAX_ARG_LENGTH);
+
+  // Sending to a server that hung up is an error to report, not a reason to die
+  signal(SIGPIPE, SIG_IGN);
 
   // Let's connect to the remote server
   printf("Connecting to %s:%s\n", hostname, port);
@@ -94,8 +143,8 @@ int main( int argc, char *argv[] )
   // Make sure the hints struct is empty
   memset(&hints, 0, sizeof hints);
 
-  // We want an IPv4 connection, and TCP DGRAM sockets
-  hints.ai_family = AF_INET;
+  // IPv4 or IPv6, whichever the name resolves to; TCP sockets
+  hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
   // Attempt to populate the servinfo struct for the supplied host and port
@@ -105,27 +154,11 @@ int main( int argc, char *argv[] )
      return 1;
   }
 
-  // getaddrinfo() returns a pointer to a linked list of one or more struct addrinfos
-  // Loop through the linked list until we successfully create a socket
-   for(p = servinfo; p != NULL; p = p->ai_next) {
-       // Returns a socket descriptor that we can use
-       if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-           perror("chatclient: invalid socket, retrying");
-           continue;
-       }
-       // Try to connect to it
-       if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-         close(sockfd);
-         perror("chatclient: connect failed");
-         continue;
-       }
-       // We have a valid connection.  Proceed.
-       break;
-   }
-
-   // If we didn't end up with a valid socket, object and exit
-   if (p == NULL) {
-       fprintf(stderr, "chatclient: failed to create socket\n");
+  // getaddrinfo() returns a linked list of one or more struct addrinfos.
+  // Race connects to them (see netconnect.c) so one dead address can't stall us.
+   if ((sockfd = connectFirst(servinfo, CONNECT_TIMEOUT_MS)) == -1) {
+       perror("chatclient: connect failed");
+       freeaddrinfo(servinfo);
        return 2;
    }
 
@@ -137,14 +170,33 @@ int main( int argc, char *argv[] )
      return 1;
    }
 
-   // Get the user's handle
-   getHandleFromKeyboard(userHandle);
+   // Get the user's handle, unless it was on the commandline
+   if (userHandle[0] == 0) {
+     getHandleFromKeyboard(userHandle);
+   }
 
    // Exchange Handles
    doHandleExchange(&sockfd, userHandle, remoteHandle);
 
+   // Batch mode: stream the input, report, and say goodbye
+   if (batch) {
+     int status = doBatch(&sockfd, inputFd, rate, &stats);
+     printBatchSummary(&stats);
+     if (status == 0) {
+       status = doGoodbye(&sockfd);
+     }
+     freeaddrinfo(servinfo);
+     close(sockfd);
+     return status == -1 || (stats.acking && stats.acked < stats.sent) ? 1 : 0;
+   }
+
    // Do the chat loop.
-   doChat(&sockfd, userHandle, remoteHandle);
+   // If the other side already left there's nobody to say goodbye to
+   if (doChat(&sockfd, userHandle, remoteHandle) != 0) {
+     freeaddrinfo(servinfo);
+     close(sockfd);
+     return 0;
+   }
 
    // End connection with server gracefully
    if (doGoodbye(&sockfd) != 0) {
@@ -177,7 +229,7 @@ void getHandleFromKeyboard(char* handle) {
     scanf("%s", &temp);
   }
   strncpy(handle, temp, MAX_HANDLE_LENGTH-1);
-  handle[MAX_HANDLE_LENGTH] = 0;
+  handle[MAX_HANDLE_LENGTH-1] = 0;
 
   if(DEBUG) {
     printf("getHandleFromKeyboard - Handle Received: %s\n");
@@ -193,15 +245,13 @@ int doGoodbye(int* sockfd) {
     printf("\ndoGoodbye - Say bye y'all\n");
   }
 
-  // Buffer for incoming data
-  char buf[MAX_RESPONSE_LENGTH];
-  // Number of returned bytes
-  int numbytes = 0;
   char goodbye[] = GOODBYE;
 
-  // Send Handshake to Server
-  if ((numbytes = send(*sockfd, goodbye, strlen(goodbye), 0)) == -1) {
-      perror("chatclient: handshake sendto() failed");
+  // Version 1 says \quit in-band, version 2 has a frame type for it
+  gQueue.version = gVersion;
+  frameQueuePush(&gQueue, FRAME_QUIT, goodbye, gVersion >= CHAT_VERSION ? 0 : strlen(goodbye));
+  if (frameQueueFlush(*sockfd, &gQueue) == -1) {
+      perror("chatclient: goodbye send() failed");
       close(*sockfd);
       exit(1);
   }
@@ -209,6 +259,7 @@ int doGoodbye(int* sockfd) {
   if(DEBUG) {
     printf("\ndoGoodbye - Bye Y'all\n");
   }
+  return 0;
 }
 
 // doHandshake(int* sockfd)
@@ -221,7 +272,8 @@ int doHandshake(int* sockfd) {
   // Number of returned bytes
   int numbytes = 0;
 
-  char handshake[] = HANDSHAKE;
+  // Offer the framed protocol.  Old servers only look for "HELLO" in here.
+  char handshake[] = HELLO_V2;
 
   if (DEBUG) {
     printf("doHandshake() - Sending Handshake \n");
@@ -250,10 +302,12 @@ int doHandshake(int* sockfd) {
     printf("doHandshake() - Handshake Received \n");
   }
 
-  // Confirm that the client returned "HELLO"
-  if (strcmp(handshake, buf) == 0) {
+  // "HELLO 2" means the server speaks framing too; plain "HELLO" is an old server
+  if (strcmp(HELLO_V2, buf) == 0 || strcmp(HANDSHAKE, buf) == 0) {
+    gVersion = strcmp(HELLO_V2, buf) == 0 ? CHAT_VERSION : 1;
+    gQueue.version = gVersion;
     if (DEBUG) {
-      printf("Handshake Successful \n");
+      printf("Handshake Successful, protocol version %d \n", gVersion);
     }
     return 0;
   } else {
@@ -281,7 +335,8 @@ int doHandleExchange(int* sockfd, char* userHandle, char* remoteHandle) {
   }
 
   // Send Handle to Server
-  if ((numbytes = send(*sockfd, userHandle, strlen(userHandle), 0)) == -1) {
+  frameQueuePush(&gQueue, FRAME_HANDLE, userHandle, strlen(userHandle));
+  if (frameQueueFlush(*sockfd, &gQueue) == -1) {
       perror("chatclient: doHandleExchange send() failed");
       close(*sockfd);
       exit(1);
@@ -291,165 +346,538 @@ int doHandleExchange(int* sockfd, char* userHandle, char* remoteHandle) {
     printf("doHandleExchange() - Listening for remote handle \n");
   }
 
-  // Validate the response
-  numbytes = 0;
   memset(&buf, 0, sizeof(buf));
-  if((numbytes = recv(*sockfd, buf, sizeof buf, 0)) == -1) {
-    perror("chatclient: doHandleExchange - recv() failed");
-    exit(1);
+
+  if (gVersion >= CHAT_VERSION) {
+    // Wait for the HANDLE frame.  Anything that arrives behind it stays in
+    // gReader for doChat() to print.
+    struct frame msg;
+    int status;
+    while ((status = frameNext(&gReader, &msg)) == 0) {
+      if ((numbytes = frameRead(*sockfd, &gReader)) <= 0) {
+        perror("chatclient: doHandleExchange - recv() failed");
+        exit(1);
+      }
+    }
+    if (status == -1 || msg.type != FRAME_HANDLE) {
+      fprintf(stderr, "chatclient: doHandleExchange - unexpected response\n");
+      exit(1);
+    }
+    memcpy(buf, msg.payload, msg.length < sizeof(buf) - 1 ? msg.length : sizeof(buf) - 1);
+  } else {
+    // Validate the response
+    if((numbytes = recv(*sockfd, buf, sizeof buf - 1, 0)) == -1) {
+      perror("chatclient: doHandleExchange - recv() failed");
+      exit(1);
+    }
   }
 
   // Truncate the remote user's handle to 10 chars
-  strncpy(remoteHandle, buf, 10);
-  remoteHandle[11] = 0;
+  strncpy(remoteHandle, buf, MAX_HANDLE_LENGTH-1);
+  remoteHandle[MAX_HANDLE_LENGTH-1] = 0;
 
   if(DEBUG) {
-    printf("doHandleExchange() - Handle Received: %s\n");
+    printf("doHandleExchange() - Handle Received: %s\n", remoteHandle);
   }
 
   return 0;
 }
 
-// Loop on the conversation until one side or the other supplies '\quit'
-void doChat(int* sockfd, char* userHandle, char* remoteHandle) {
+// doChat(int* sockfd, char* userHandle, char* remoteHandle)
+// Full-duplex conversation loop, until one side or the other supplies '\quit'
+//
+// poll() watches the keyboard and the socket at the same time, so incoming
+// messages are printed the moment they arrive instead of after the user's
+// next line.  The socket is non-blocking: typed lines go onto an outbound
+// queue that is drained whenever the socket is writable, so a slow peer
+// never stalls the keyboard.
+//
+// Returns 0 if the user quit, 1 if the remote side quit or hung up, -1 on error
 
-  // A buffer to store the user's keyboard input
-  // Max message length is 500 chars.  Overallocating a little to prevent overflow.
-  char keyboardInput[MAX_RESPONSE_LENGTH];
-  memset(&keyboardInput, 0, MAX_RESPONSE_LENGTH);
+int doChat(int* sockfd, char* userHandle, char* remoteHandle) {
 
-  // A buffer to store the next remote message
-  char msgBuffer[MAX_RESPONSE_LENGTH];
-  memset(&msgBuffer, 0, MAX_RESPONSE_LENGTH);
+  struct pollfd fds[2];
+  char lineBuffer[MAX_MESSAGE_LENGTH + 1];  // Keyboard input not yet terminated by a newline
+  size_t lineLength = 0;
+  int keyboardOpen = 1;
+  int quitting = 0;
+  int result = 0;
+
+  setNonBlocking(*sockfd, 1);
 
   printf("Now chatting with %s.  Type \\quit to exit.\n", remoteHandle);
+  showPrompt(userHandle);
 
-  while(1) {
-     // Prompt the user for a message
-     // Exit on '\quit'
-     getMessageFromKeyboard(keyboardInput, userHandle);
-     if (strcmp(keyboardInput, GOODBYE) == 0) {
-        return;
-     }
-     if (sendMessage(sockfd, keyboardInput) == -1) {
-       perror("\nchatclient: doChat - sendMessage() failed. Exiting.\n");
-       return;
-     }
-     if (strcmp(keyboardInput, "\\quit\n") == 0) {
-       return;
-     }
+  // Print anything that arrived along with the remote handle
+  if (gReader.length > 0 && readMessages(sockfd, userHandle) <= 0) {
+    setNonBlocking(*sockfd, 0);
+    return 1;
+  }
 
-     if (readMessage(sockfd, msgBuffer) == -1) {
-       perror("\nchatclient: doChat - readMessage() failed. Exiting.\n");
-       return;
-     }
-     if (strcmp(msgBuffer, "\\quit\n") == 0) {
-       return;
-     }
-     printf("%s", msgBuffer);
+  while (1) {
+
+    // Once the user has quit (or stdin ran out), finish sending what's queued and leave
+    if (quitting && gQueue.count == 0) {
+      break;
+    }
+
+    // Read the keyboard only while the queue can take what's typed; until
+    // then unqueued lines wait in lineBuffer
+    fds[0].fd = keyboardOpen && !quitting && gQueue.count < FRAME_QUEUE_SLOTS &&
+                lineLength < MAX_MESSAGE_LENGTH ? STDIN_FILENO : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = *sockfd;
+    fds[1].events = POLLIN | (gQueue.count > 0 ? POLLOUT : 0);
+
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("chatclient: doChat - poll() failed");
+      result = -1;
+      break;
+    }
+
+    // Incoming messages: render immediately, above the prompt
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      int status = readMessages(sockfd, userHandle);
+      if (status <= 0) {
+        result = status == 0 ? 1 : -1;
+        break;
+      }
+    }
+
+    // Outgoing messages: write as much of the queue as the socket will take
+    if (fds[1].revents & POLLOUT) {
+      if (frameQueueFlush(*sockfd, &gQueue) == -1) {
+        perror("\nchatclient: doChat - send() failed. Exiting.\n");
+        result = -1;
+        break;
+      }
+      if (lineLength > 0 && !quitting) {
+        lineLength = queueLines(lineBuffer, lineLength, &gQueue, &quitting, userHandle);
+        if (!keyboardOpen && lineLength == 0) {
+          quitting = 1;
+        }
+      }
+    }
+
+    // Keyboard input: split into lines and queue each one
+    if (fds[0].fd != -1 && (fds[0].revents & (POLLIN | POLLHUP))) {
+
+      ssize_t numbytes = read(STDIN_FILENO, lineBuffer + lineLength, MAX_MESSAGE_LENGTH - lineLength);
+      if (numbytes == -1 && errno == EINTR) {
+        continue;
+      }
+      if (numbytes <= 0) {
+        // End of input behaves like \quit once everything typed has been sent
+        keyboardOpen = 0;
+        numbytes = 0;
+        if (lineLength > 0) {
+          lineBuffer[lineLength++] = '\n';
+        }
+      }
+      lineLength += numbytes;
+      lineLength = queueLines(lineBuffer, lineLength, &gQueue, &quitting, userHandle);
+      if (!keyboardOpen && lineLength == 0) {
+        quitting = 1;
+      }
+
+      if (frameQueueFlush(*sockfd, &gQueue) == -1) {
+        perror("\nchatclient: doChat - send() failed. Exiting.\n");
+        result = -1;
+        break;
+      }
+    }
   }
-  return;
+
+  setNonBlocking(*sockfd, 0);
+  return result;
 }
 
-// getMessageFromKeyboard(char* handle)
-// Prompts the user for a message
+// doBatch(int* sockfd, int inputFd, double rate, struct batchStats* stats)
+// Sends every line of inputFd as a message, without prompting or echoing
+//
+// Lines are queued as fast as the outbound queue has room (or, with a rate,
+// no faster than rate per second) and written in writev() batches, so there's
+// no per-message round trip.  Every BATCH_PING_EVERY messages, and after the
+// last one, a PING carries the running count; the server's PONG means all of
+// those were handled.  Version 1 servers can't acknowledge anything.
+//
+// Returns 0 when the input is done, 1 if the remote side quit or hung up, -1 on error
+
+int doBatch(int* sockfd, int inputFd, double rate, struct batchStats* stats) {
+
+  static char input[BATCH_BUFFER];        // Input not yet sent
+  struct pollfd fds[2];
+  struct timespec start;
+  size_t inputLength = 0;
+  int inputOpen = 1;
+  int quitting = 0;
+  unsigned long long pinged = 0;         // Messages covered by the last PING
+  double nextSend = 0;                   // When the rate limit allows the next message
+  double ackDeadline = -1;
+  int nodelay = 1;
+  int result = 0;
+
+  memset(stats, 0, sizeof(struct batchStats));
+  stats->acking = gVersion >= CHAT_VERSION;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  setNonBlocking(*sockfd, 1);
+
+  // We do our own batching; don't let Nagle hold a PING back behind it
+  setsockopt(*sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  while (1) {
+
+    double now = secondsSince(&start);
+    int timeout = -1;
+
+    // Queue what the input, the queue and the rate limit allow (keeping a slot for a PING)
+    while (!quitting && gQueue.count < FRAME_QUEUE_SLOTS - 1 && (rate <= 0 || now >= nextSend)) {
+      size_t lineLength = nextBatchLine(input, inputLength, inputOpen, &quitting);
+      if (lineLength == 0) {
+        break;
+      }
+      if (lineLength > 1 || input[0] != '\n') {
+        frameQueuePush(&gQueue, FRAME_TEXT, input, lineLength);
+        stats->sent++;
+        if (rate > 0) {
+          // Don't let an idle input bank up a burst of more than a second
+          nextSend = (nextSend < now - 1 ? now : nextSend) + 1 / rate;
+        }
+      }
+      inputLength -= lineLength;
+      memmove(input, input + lineLength, inputLength);
+    }
+    if (quitting) {
+      inputOpen = 0;
+      inputLength = 0;
+    }
+
+    int drained = !inputOpen && inputLength == 0;
 
-void getMessageFromKeyboard(char* message, char* userHandle) {
+    if (stats->acking && stats->sent > pinged && gQueue.count < FRAME_QUEUE_SLOTS &&
+        (stats->sent - pinged >= BATCH_PING_EVERY || drained)) {
+      char count[32];
+      int length = snprintf(count, sizeof(count), "%llu", stats->sent);
+      frameQueuePush(&gQueue, FRAME_PING, count, length);
+      pinged = stats->sent;
+    }
 
-  // Allocate a much larger buffer than we need
-  // It can theoretically still overflow, but this is trivial homework code...
-  char temp[MAX_RESPONSE_LENGTH];
-  memset(&temp, 0, MAX_RESPONSE_LENGTH);
-  memset(message, 0, MAX_RESPONSE_LENGTH);
-  char c = 0;
-  int i = 0;
+    if (gQueue.count > 0 && frameQueueFlush(*sockfd, &gQueue) == -1) {
+      perror("chatclient: doBatch - send() failed");
+      result = -1;
+      break;
+    }
 
-  if(DEBUG) {
-    printf("getMessageFromKeyboard - Prompting for input\n");
-  }
+    // Done once everything's written and acknowledged (or we've waited long enough)
+    if (drained && gQueue.count == 0) {
+      if (stats->sentSeconds == 0) {
+        stats->sentSeconds = secondsSince(&start);
+        ackDeadline = stats->sentSeconds + BATCH_ACK_TIMEOUT;
+      }
+      now = secondsSince(&start);
+      if (!stats->acking || stats->acked >= stats->sent || now >= ackDeadline) {
+        break;
+      }
+      timeout = (int)((ackDeadline - now) * 1000) + 1;
+    } else if (gQueue.count < FRAME_QUEUE_SLOTS - 1 && inputLength > 0 && !quitting) {
+      // The queue drained with input still waiting: go again if there's a
+      // whole message to queue, or sleep out the rate limit.  A partial line
+      // waits in poll() for the rest of it.
+      if (rate <= 0 || nextSend <= now) {
+        if (inputLength >= MAX_MESSAGE_LENGTH || !inputOpen || memchr(input, '\n', inputLength) != NULL) {
+          continue;
+        }
+      } else {
+        timeout = (int)((nextSend - now) * 1000) + 1;
+      }
+    }
 
+    // Read more input only while there's room for it
+    fds[0].fd = inputOpen && inputLength < sizeof(input) ? inputFd : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = *sockfd;
+    fds[1].events = POLLIN | (gQueue.count > 0 ? POLLOUT : 0);
+
+    if (poll(fds, 2, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("chatclient: doBatch - poll() failed");
+      result = -1;
+      break;
+    }
 
-  printf("%s>",userHandle);
-  fflush(stdout);
-  // fgets technique for reading stdin from http://bit.ly/1GzJi38
-  fgets(temp, sizeof(temp), stdin);
-  while(strlen(temp) <= 1 || strlen(temp) > MAX_MESSAGE_LENGTH && temp != "") {
-
-    // HACK
-    // No matter what I do, I can't seem to get rid of the initial double-prompt.
-    // I've tried a bunch of techniques for flushing stdin, with zero success
-    // When I *can* eat the first character that causes the double prompt, then
-    // subsequent prompts wait for a keypress before prompting... ugh.
-    // I'm masking it in the UI, but you do need two character responses as a minimum.
-    if (strlen(temp) != 1) {
-      printf("%s>",userHandle);
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      int status = readBatchReplies(sockfd, stats, &start);
+      if (status <= 0) {
+        result = status == 0 ? 1 : -1;
+        break;
+      }
+    }
+
+    if (fds[0].fd != -1 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      ssize_t numbytes = read(inputFd, input + inputLength, sizeof(input) - inputLength);
+      if (numbytes == -1 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      if (numbytes <= 0) {
+        if (numbytes == -1) {
+          perror("chatclient: doBatch - read() failed");
+        }
+        inputOpen = 0;
+      } else {
+        inputLength += numbytes;
+      }
     }
-    // If fgets is null, just set our temp buffer to null and re-prompt
-    if (fgets(temp, sizeof(temp), stdin) == NULL) {
-      temp[0] = 0;
-    };
-    fflush(stdin);
   }
-  // Truncate input to 500 chars
-  strncpy(message, temp, sizeof(temp));
-  message[MAX_MESSAGE_LENGTH+1] = 0; // Null terminate string
 
-  if(DEBUG) {
-    printf("getMessageFromKeyboard - Message Received: %s\n", message);
+  stats->seconds = secondsSince(&start);
+  if (stats->sentSeconds == 0) {
+    stats->sentSeconds = stats->seconds;
   }
-  return;
+  setNonBlocking(*sockfd, 0);
+  return result;
 }
 
-// Reads message from remote server into buffer
+// nextBatchLine(char* input, size_t length, int inputOpen, int* quitting)
+// Finds the message at the front of input: a line, a MAX_MESSAGE_LENGTH
+// piece of a longer one, or whatever's left once the input has ended.
+// Sets *quitting on a \quit line.
+// Returns its length, or 0 if there's no whole message yet
 
-int readMessage(int* sockfd, char* buf) {
-
-  // Validate the response
-  int numbytes = 0;
-  char temp[MAX_RESPONSE_LENGTH] = "";
+size_t nextBatchLine(char* input, size_t length, int inputOpen, int* quitting) {
 
-  // Initialize these to 0
-  memset(&temp, 0, sizeof(temp));
+  char* newline = memchr(input, '\n', length < MAX_MESSAGE_LENGTH ? length : MAX_MESSAGE_LENGTH);
+  size_t goodbyeLength = strlen(GOODBYE);
+  size_t lineLength;
 
-  if(DEBUG) {
-    printf("\nreadMessage: Reading message from network.\n");
+  if (newline != NULL) {
+    lineLength = newline - input + 1;
+  } else if (length >= MAX_MESSAGE_LENGTH) {
+    lineLength = MAX_MESSAGE_LENGTH;
+  } else if (!inputOpen) {
+    lineLength = length;
+  } else {
+    return 0;
   }
 
-  if((numbytes = recv(*sockfd, temp, sizeof temp, 0)) == -1) {
-    perror("chatclient: readMessage - recv() failed\n");
-    return -1;
+  if (lineLength >= goodbyeLength && strncmp(input, GOODBYE, goodbyeLength) == 0 &&
+      (lineLength == goodbyeLength || input[goodbyeLength] == '\n' || input[goodbyeLength] == '\r')) {
+    *quitting = 1;
+    return 0;
   }
+  return lineLength;
+}
 
-  // The remote server closed the connection
-  if (numbytes == 0) {
-    if(DEBUG) {
-      printf("readMessage() - Message was 0 bytes.  Remote connection closed.\n");
+// readBatchReplies(int* sockfd, struct batchStats* stats, struct timespec* start)
+// Drains the socket, counting acknowledgements; chat traffic is ignored
+// Returns 1 to keep going, 0 if the remote side quit or closed, -1 on error
+
+int readBatchReplies(int* sockfd, struct batchStats* stats, struct timespec* start) {
+
+  struct frame msg;
+  int status;
+
+  while (1) {
+
+    while (gVersion >= CHAT_VERSION && (status = frameNext(&gReader, &msg)) != 0) {
+      if (status == -1) {
+        fprintf(stderr, "chatclient: readBatchReplies - corrupt frame from server\n");
+        return -1;
+      }
+      if (msg.type == FRAME_QUIT) {
+        fprintf(stderr, "chatclient: remote user has left the chat\n");
+        return 0;
+      }
+      if (msg.type == FRAME_PONG) {
+        char count[32];
+        size_t length = msg.length < sizeof(count) - 1 ? msg.length : sizeof(count) - 1;
+        memcpy(count, msg.payload, length);
+        count[length] = 0;
+        stats->acked = strtoull(count, NULL, 10);
+        stats->ackedSeconds = secondsSince(start);
+      }
+    }
+
+    ssize_t numbytes = frameRead(*sockfd, &gReader);
+    if (numbytes == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 1;
+      }
+      perror("chatclient: readBatchReplies - recv() failed");
+      return -1;
+    }
+    if (numbytes == 0) {
+      fprintf(stderr, "chatclient: connection closed by remote host\n");
+      return 0;
+    }
+    if (gVersion < CHAT_VERSION) {
+      gReader.start = gReader.length = 0;
     }
-    return 0;
   }
+}
 
-  strncpy(buf, temp, MAX_MESSAGE_LENGTH);
-  buf[MAX_MESSAGE_LENGTH+1] = 0; // Ensure the string is null terminated
-  if(DEBUG) {
-    printf("readMessage - Message Received: %s\n",buf);
+// printBatchSummary(struct batchStats* stats)
+// Reports batch throughput on stderr, out of the way of anything piped
+
+void printBatchSummary(struct batchStats* stats) {
+
+  fprintf(stderr, "chatclient: sent %llu messages in %.3fs (%.1f msg/s)\n", stats->sent,
+          stats->sentSeconds, stats->sentSeconds > 0 ? stats->sent / stats->sentSeconds : 0.0);
+  if (!stats->acking) {
+    fprintf(stderr, "chatclient: the server doesn't acknowledge messages (protocol version 1)\n");
+  } else {
+    fprintf(stderr, "chatclient: %llu acknowledged in %.3fs (%.1f msg/s)\n", stats->acked,
+            stats->ackedSeconds, stats->ackedSeconds > 0 ? stats->acked / stats->ackedSeconds : 0.0);
   }
-  return 1;
 }
 
-int sendMessage(int* sockfd, char* buf) {
-  int numbytes = 0;
+double secondsSince(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-  if(DEBUG) {
-    printf("sendMessage() - Preparing to send message. %s\n", buf);
+// queueLines(char* lines, size_t length, struct frameQueue* queue, int* quitting, char* userHandle)
+// Queues every complete line in lines that the queue has room for.  A line
+// that fills the whole buffer without a newline is sent as-is (messages are
+// capped at 500 chars anyway).
+// Sets *quitting when the user types \quit.
+// Returns the number of bytes of unfinished line left at the front of lines
+
+size_t queueLines(char* lines, size_t length, struct frameQueue* queue, int* quitting, char* userHandle) {
+
+  char* start = lines;
+  char* end = lines + length;
+  size_t goodbyeLength = strlen(GOODBYE);
+
+  while (!*quitting && start < end && queue->count < FRAME_QUEUE_SLOTS) {
+
+    char* newline = memchr(start, '\n', end - start);
+    size_t lineLength;
+
+    if (newline != NULL) {
+      lineLength = newline - start + 1;
+    } else if ((size_t)(end - start) >= MAX_MESSAGE_LENGTH) {
+      lineLength = end - start;
+    } else {
+      break;
+    }
+
+    if (lineLength >= goodbyeLength && strncmp(start, GOODBYE, goodbyeLength) == 0 &&
+        (lineLength == goodbyeLength || start[goodbyeLength] == '\n' || start[goodbyeLength] == '\r')) {
+      *quitting = 1;
+      return 0;
+    }
+
+    // Blank lines aren't worth sending
+    if ((lineLength > 1 || *start != '\n') && frameQueuePush(queue, FRAME_TEXT, start, lineLength) == -1) {
+      break;
+    }
+    start += lineLength;
+    showPrompt(userHandle);
+  }
+
+  memmove(lines, start, end - start);
+  return end - start;
+}
+
+// showPrompt(char* userHandle)
+// Prints the input prompt
+
+void showPrompt(char* userHandle) {
+  printf("%s> ", userHandle);
+  fflush(stdout);
+}
+
+// setNonBlocking(int fd, int enable)
+// Turns O_NONBLOCK on or off for fd
+
+int setNonBlocking(int fd, int enable) {
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return -1;
   }
+  flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(fd, F_SETFL, flags);
+}
+
+// readMessages(int* sockfd, char* userHandle)
+// Prints everything waiting on the socket, then redraws the prompt
+// Returns 1 to keep chatting, 0 if the remote side quit or closed, -1 on error
+
+int readMessages(int* sockfd, char* userHandle) {
+
+  struct frame msg;
+  int printed = 0;
+  int status;
+
+  while (1) {
+
+    // Version 2: print every complete frame already buffered
+    while (gVersion >= CHAT_VERSION && (status = frameNext(&gReader, &msg)) != 0) {
+      if (status == -1) {
+        fprintf(stderr, "\nchatclient: readMessages - corrupt frame from server\n");
+        return -1;
+      }
+      if (msg.type == FRAME_QUIT) {
+        printf("\nRemote user has left the chat.\n");
+        return 0;
+      }
+      if (msg.type != FRAME_TEXT) {
+        continue;
+      }
+      // Clear the prompt line, then print the message over it
+      if (!printed) {
+        printf("\r\033[K");
+        printed = 1;
+      }
+      fwrite(msg.payload, 1, msg.length, stdout);
+      if (msg.length == 0 || msg.payload[msg.length - 1] != '\n') {
+        putchar('\n');
+      }
+    }
+
+    ssize_t numbytes = frameRead(*sockfd, &gReader);
+
+    if (numbytes == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      perror("chatclient: readMessages - recv() failed");
+      return -1;
+    }
+
+    // The remote server closed the connection
+    if (numbytes == 0) {
+      if(DEBUG) {
+        printf("readMessages() - Remote connection closed.\n");
+      }
+      printf("\nConnection closed by remote host.\n");
+      return 0;
+    }
 
-  if ((numbytes = send(*sockfd, buf, strlen(buf), 0)) == -1) {
-    perror("chatclient: sendMessage() failed");
-    close(*sockfd);
-    return(-1);
+    // Version 1: whatever arrived is the message
+    if (gVersion < CHAT_VERSION) {
+      if (strncmp(gReader.buf, GOODBYE, strlen(GOODBYE)) == 0) {
+        printf("\nRemote user has left the chat.\n");
+        return 0;
+      }
+      if (!printed) {
+        printf("\r\033[K");
+        printed = 1;
+      }
+      fwrite(gReader.buf, 1, gReader.length, stdout);
+      gReader.start = gReader.length = 0;
+    }
   }
-  if(DEBUG) {
-    printf("sendMessage() - Message successfully sent.\n%s\n",buf);
+
+  if (printed) {
+    showPrompt(userHandle);
   }
-  return 0;
+  return 1;
 }
@@ -1,14 +1,40 @@
 #ifndef CHATCLIENT_H_ /* Include Guard */
 #define CHATCLIENT_H_
 
-void doChat(int* sockfd, char* userHandle, char* remoteHandle);
-void getMessageFromKeyboard(char* message, char* userHandle);
+#include <stddef.h>
+#include <time.h>
+
+#define BATCH_BUFFER 65536          // Batch mode input buffer
+#define BATCH_PING_EVERY 256        // Messages between acknowledgement requests
+#define BATCH_ACK_TIMEOUT 5         // Seconds to wait for the last acknowledgement
+
+struct frameQueue;
+
+// Batch mode results
+struct batchStats {
+  unsigned long long sent;
+  unsigned long long acked;
+  int acking;                       // The server answers PINGs (version 2)
+  double sentSeconds;               // Until the last message was written
+  double ackedSeconds;              // Until the last acknowledgement arrived
+  double seconds;
+};
+
+int doChat(int* sockfd, char* userHandle, char* remoteHandle);
+int doBatch(int* sockfd, int inputFd, double rate, struct batchStats* stats);
+size_t nextBatchLine(char* input, size_t length, int inputOpen, int* quitting);
+int readBatchReplies(int* sockfd, struct batchStats* stats, struct timespec* start);
+void printBatchSummary(struct batchStats* stats);
+double secondsSince(struct timespec* start);
 void getHandleFromKeyboard(char* handle);
+void showPrompt(char* userHandle);
 
-int readMessage(int* sockfd, char* buf);
-int sendMessage(int* sockfd, char* buf);
 int doGoodbye(int* sockfd);
 int doHandshake(int* sockfd);
 int doHandleExchange(int* sockfd, char* userHandle, char* remoteHandle);
 
+size_t queueLines(char* lines, size_t length, struct frameQueue* queue, int* quitting, char* userHandle);
+int readMessages(int* sockfd, char* userHandle);
+int setNonBlocking(int fd, int enable);
+
 #endif // CHATCLIENT_H_
@@ -0,0 +1,190 @@
+/*
+ * chatframe.c
+ * CS372_400_W2017 - Project 1
+ * Jeromie Clark <clarkje@oregonstate.edu>
+ *
+ * Chat framing shared by chatclient and chatserve
+ *
+ * The original protocol assumed one recv() was one message, which falls apart
+ * as soon as TCP coalesces or splits segments.  Version 2 frames every
+ * message with a length and a type:
+ *
+ *   u16 payload length (big-endian) | u8 type | payload
+ *
+ * The version is negotiated in the handshake: a v2 client says "HELLO 2".
+ * A v2 server answers "HELLO 2"; an old server answers "HELLO" and the client
+ * falls back to the unframed protocol.  Old clients still say plain "HELLO".
+ *
+ * Reading: frameRead() fills one reusable buffer, and frameNext() hands back
+ * every complete frame in it, so one recv() can deliver many messages.
+ * Writing: frames queue up in a fixed ring and go out together in one writev().
+ */
+
+#include "chatframe.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+void frameEncodeHeader(unsigned char* header, int type, size_t length) {
+  header[0] = (length >> 8) & 0xff;
+  header[1] = length & 0xff;
+  header[2] = type;
+}
+
+// frameRead(int fd, struct frameReader* reader)
+// Reads whatever's available into the reader's buffer
+// Returns bytes read, 0 if the peer closed, -1 on error (errno EAGAIN if nothing was ready)
+
+ssize_t frameRead(int fd, struct frameReader* reader) {
+
+  ssize_t numbytes;
+
+  // Slide the unparsed tail to the front to make room
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start, reader->length);
+    reader->start = 0;
+  }
+  if (reader->length == sizeof(reader->buf)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  do {
+    numbytes = recv(fd, reader->buf + reader->length, sizeof(reader->buf) - reader->length, 0);
+  } while (numbytes == -1 && errno == EINTR);
+
+  if (numbytes > 0) {
+    reader->length += numbytes;
+  }
+  return numbytes;
+}
+
+// frameParse(char* buf, size_t length, struct frame* out)
+// Decodes the frame at the start of buf, if it's all there
+// Returns the bytes it occupies, 0 if more bytes are needed, -1 if the stream is corrupt
+
+int frameParse(char* buf, size_t length, struct frame* out) {
+
+  unsigned char* p = (unsigned char*)buf;
+  size_t payloadLength;
+
+  if (length < FRAME_HEADER_LENGTH) {
+    return 0;
+  }
+  payloadLength = ((size_t)p[0] << 8) | p[1];
+  if (payloadLength > MAX_FRAME_PAYLOAD) {
+    return -1;
+  }
+  if (length < FRAME_HEADER_LENGTH + payloadLength) {
+    return 0;
+  }
+
+  out->type = p[2];
+  out->length = payloadLength;
+  out->payload = buf + FRAME_HEADER_LENGTH;
+  return FRAME_HEADER_LENGTH + payloadLength;
+}
+
+// frameNext(struct frameReader* reader, struct frame* out)
+// Pulls the next complete frame out of the reader's buffer
+// Returns 1 if out was filled, 0 if more bytes are needed, -1 if the stream is corrupt
+
+int frameNext(struct frameReader* reader, struct frame* out) {
+
+  int used = frameParse(reader->buf + reader->start, reader->length, out);
+
+  if (used <= 0) {
+    return used;
+  }
+  reader->start += used;
+  reader->length -= used;
+  return 1;
+}
+
+// frameQueuePush(struct frameQueue* queue, int type, const char* payload, size_t length)
+// Queues a frame without blocking.  In version 1 mode the payload is sent bare.
+// Returns 0 on success, -1 if the queue is full
+
+int frameQueuePush(struct frameQueue* queue, int type, const char* payload, size_t length) {
+
+  struct queuedFrame* slot;
+
+  if (queue->count == FRAME_QUEUE_SLOTS) {
+    return -1;
+  }
+  if (length > MAX_FRAME_PAYLOAD) {
+    length = MAX_FRAME_PAYLOAD;
+  }
+  slot = &queue->frames[(queue->head + queue->count) % FRAME_QUEUE_SLOTS];
+  frameEncodeHeader(slot->header, type, length);
+  memcpy(slot->payload, payload, length);
+  slot->length = length;
+  queue->count++;
+  return 0;
+}
+
+// frameQueueFlush(int fd, struct frameQueue* queue)
+// Writes queued frames, up to FRAME_BATCH_IOV at a time, each as a
+// header/payload pair of one writev()
+// Returns 0 on success (including a partial write), -1 on error
+
+int frameQueueFlush(int fd, struct frameQueue* queue) {
+
+  struct iovec iov[FRAME_BATCH_IOV * 2];
+  size_t headerLength = queue->version >= CHAT_VERSION ? FRAME_HEADER_LENGTH : 0;
+
+  while (queue->count > 0) {
+
+    int numIov = 0;
+    int i;
+    size_t skip = queue->offset;
+
+    for (i = 0; i < queue->count && i < FRAME_BATCH_IOV; i++) {
+      struct queuedFrame* slot = &queue->frames[(queue->head + i) % FRAME_QUEUE_SLOTS];
+
+      // The head frame may be partly written already
+      if (skip < headerLength) {
+        iov[numIov].iov_base = slot->header + skip;
+        iov[numIov].iov_len = headerLength - skip;
+        numIov++;
+        skip = 0;
+      } else {
+        skip -= headerLength;
+      }
+      if (slot->length > skip) {
+        iov[numIov].iov_base = slot->payload + skip;
+        iov[numIov].iov_len = slot->length - skip;
+        numIov++;
+      }
+      skip = 0;
+    }
+
+    ssize_t written = writev(fd, iov, numIov);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+
+    // Retire every frame that went out completely
+    written += queue->offset;
+    queue->offset = 0;
+    while (queue->count > 0) {
+      size_t frameLength = headerLength + queue->frames[queue->head].length;
+      if ((size_t)written < frameLength) {
+        queue->offset = written;
+        break;
+      }
+      written -= frameLength;
+      queue->head = (queue->head + 1) % FRAME_QUEUE_SLOTS;
+      queue->count--;
+    }
+  }
+  return 0;
+}
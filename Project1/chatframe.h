@@ -0,0 +1,62 @@
+#ifndef CHATFRAME_H_ /* Include Guard */
+#define CHATFRAME_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Wire format version 2: every message after the HELLO exchange is a frame
+//   u16 payload length (big-endian), u8 type, payload
+// Version 1 is the original unframed protocol, still spoken to old peers.
+#define CHAT_VERSION 2
+#define HELLO_V2 "HELLO 2"
+
+#define FRAME_HEADER_LENGTH 3
+#define MAX_FRAME_PAYLOAD 1024
+#define FRAME_READ_BUFFER 8192      // Receive buffer; many frames per recv()
+#define FRAME_QUEUE_SLOTS 128       // Frames a sender can hold while the socket is busy
+#define FRAME_BATCH_IOV 64          // Frames per writev()
+
+#define FRAME_RAW 0                 // Never on the wire: sent unframed to everyone (HELLO)
+#define FRAME_TEXT 1                // A chat line
+#define FRAME_HANDLE 2              // Handle exchange
+#define FRAME_QUIT 3                // Leaving
+#define FRAME_PING 4                // Asks the server to echo the payload back...
+#define FRAME_PONG 5                // ... once everything sent before it has been handled
+
+struct frame {
+  int type;
+  size_t length;
+  char* payload;                    // Points into the reader's buffer; valid until the next frameRead()
+};
+
+// Incremental parser state, reused for the life of the connection
+struct frameReader {
+  char buf[FRAME_READ_BUFFER];
+  size_t start;                     // First unparsed byte
+  size_t length;                    // Unparsed bytes
+};
+
+struct queuedFrame {
+  unsigned char header[FRAME_HEADER_LENGTH];
+  size_t length;
+  char payload[MAX_FRAME_PAYLOAD];
+};
+
+// Outbound frames waiting for the socket
+struct frameQueue {
+  struct queuedFrame frames[FRAME_QUEUE_SLOTS];
+  int version;                      // 1 sends payloads bare, 2 sends frames
+  int head;
+  int count;
+  size_t offset;                    // Bytes of the head frame already written
+};
+
+void frameEncodeHeader(unsigned char* header, int type, size_t length);
+ssize_t frameRead(int fd, struct frameReader* reader);
+int frameParse(char* buf, size_t length, struct frame* out);
+int frameNext(struct frameReader* reader, struct frame* out);
+
+int frameQueuePush(struct frameQueue* queue, int type, const char* payload, size_t length);
+int frameQueueFlush(int fd, struct frameQueue* queue);
+
+#endif // CHATFRAME_H_
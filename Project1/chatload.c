@@ -0,0 +1,540 @@
+/*
+ * chatload.c
+ * CS372_400_W2017 - Project 1
+ * Jeromie Clark <clarkje@oregonstate.edu>
+ *
+ * Load generator for chatserve
+ * 1.) Opens -c simulated clients, each doing chatclient's handshake:
+ *     "HELLO 2" <-> "HELLO 2", then handle <-> handle (see doHandshake()
+ *     and doHandleExchange())
+ * 2.) Optionally splits them into rooms of -g with "\join"
+ * 3.) -s of them send timestamped messages at -r per second for -d seconds
+ * 4.) Every client times the messages it receives, and a report of send and
+ *     delivery throughput and delivery latency percentiles is printed
+ *
+ * Everything runs on one thread and one epoll set.  Senders and receivers
+ * share a clock (CLOCK_MONOTONIC on the same host), so a message's latency is
+ * just "now" minus the timestamp in it.  Latencies go into a fixed-size
+ * reservoir sample so long runs don't grow without bound.
+ *
+ * "make loadtest" runs it against a fresh chatserve on localhost.
+ */
+
+#define _GNU_SOURCE
+#include "chatload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEBUG 0
+
+static char gTag[32];                 // "LT<pid> ", so old runs in the server's history don't count
+
+int main(int argc, char *argv[])
+{
+  struct loadOptions options;
+  struct loadStats stats;
+  struct loadClient* clients;
+  struct epoll_event events[MAX_LOAD_EVENTS];
+  struct addrinfo hints, *addr;
+  int epollFd, started = 0, inFlight = 0, numEvents, i, status;
+  int64_t now, deadline, runStart, runEnd, interval;
+  int* members;
+
+  parseCommandlineArgs(argc, argv, &options);
+  snprintf(gTag, sizeof(gTag), LOAD_TAG "%d ", (int)getpid());
+  signal(SIGPIPE, SIG_IGN);
+  raiseFileLimit();
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((status = getaddrinfo(options.host, options.port, &hints, &addr)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    return 1;
+  }
+
+  memset(&stats, 0, sizeof stats);
+  clients = calloc(options.clients, sizeof(struct loadClient));
+  members = calloc(options.clients + 1, sizeof(int));
+  stats.samples = malloc(MAX_SAMPLES * sizeof(int64_t));
+  if (clients == NULL || members == NULL || stats.samples == NULL ||
+      (epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("chatload");
+    return 1;
+  }
+
+  // Spread the senders evenly, so with rooms they land in different ones
+  for (i = 0; i < options.clients; i++) {
+    clients[i].fd = -1;
+    clients[i].id = i;
+    clients[i].room = options.roomSize > 0 ? i / options.roomSize : -1;
+    clients[i].sender = options.senders > 0 && i % (options.clients / options.senders) == 0 &&
+                        i / (options.clients / options.senders) < options.senders;
+  }
+
+  printf("chatload: connecting %d clients to %s:%s\n", options.clients, options.host, options.port);
+
+  // Connect and handshake, a bounded number at a time so the listen queue keeps up
+  deadline = nowNanos() + (int64_t)CONNECT_TIMEOUT * 1000000000;
+  while (stats.connected + stats.failed < options.clients && nowNanos() < deadline) {
+    while (started < options.clients && inFlight < MAX_PENDING_CONNECTS) {
+      if (startConnect(&clients[started], addr, epollFd) == 0) {
+        inFlight++;
+      } else {
+        stats.failed++;
+      }
+      started++;
+    }
+
+    numEvents = epoll_wait(epollFd, events, MAX_LOAD_EVENTS, 100);
+    for (i = 0; i < numEvents; i++) {
+      struct loadClient* client = events[i].data.ptr;
+      if (client->state == LOAD_READY) {
+        readDeliveries(client, &stats);
+        continue;
+      }
+      if (client->state == LOAD_CLOSED) {
+        continue;
+      }
+      status = advanceHandshake(client, epollFd);
+      if (status != 0) {
+        inFlight--;
+        if (status == 1) {
+          stats.connected++;
+        } else {
+          closeClient(client, &stats);
+          stats.failed++;
+        }
+      }
+    }
+  }
+  freeaddrinfo(addr);
+
+  for (i = 0; i < options.clients; i++) {
+    if (clients[i].state != LOAD_READY && clients[i].state != LOAD_CLOSED) {
+      closeClient(&clients[i], &stats);
+      stats.failed++;
+    }
+  }
+  if (stats.connected == 0) {
+    fprintf(stderr, "chatload: no clients got through the handshake\n");
+    return 1;
+  }
+
+  // Let the joins settle and the notices drain before the clock starts
+  deadline = nowNanos() + 500000000;
+  while (nowNanos() < deadline) {
+    numEvents = epoll_wait(epollFd, events, MAX_LOAD_EVENTS, 50);
+    for (i = 0; i < numEvents; i++) {
+      readDeliveries(events[i].data.ptr, &stats);
+    }
+  }
+  stats.dropped = 0;
+
+  // Each message reaches everyone else in the sender's room
+  for (i = 0; i < options.clients; i++) {
+    if (clients[i].state == LOAD_READY) {
+      members[clients[i].room + 1]++;
+    }
+  }
+  interval = (int64_t)(1e9 / options.rate);
+  runStart = nowNanos();
+  runEnd = runStart + (int64_t)options.seconds * 1000000000;
+  for (i = 0; i < options.clients; i++) {
+    clients[i].fanout = members[clients[i].room + 1] - 1;
+    clients[i].nextSend = runStart + interval * i / options.clients;
+  }
+
+  printf("chatload: %d connected, %d failed; %d senders at %.0f msg/s for %ds\n",
+         stats.connected, stats.failed, options.senders, options.rate, options.seconds);
+
+  // Send until runEnd, then wait for the stragglers
+  while ((now = nowNanos()) < runEnd + (int64_t)DRAIN_SECONDS * 1000000000) {
+    if (now >= runEnd && stats.delivered >= stats.expected) {
+      break;
+    }
+    if (now < runEnd) {
+      sendDue(clients, &options, &stats, now);
+    }
+    numEvents = epoll_wait(epollFd, events, MAX_LOAD_EVENTS, now < runEnd ? 1 : 50);
+    for (i = 0; i < numEvents; i++) {
+      readDeliveries(events[i].data.ptr, &stats);
+    }
+  }
+
+  printReport(&stats, (double)(runEnd - runStart) / 1e9);
+  return stats.connected > 0 ? 0 : 1;
+}
+
+// parseCommandlineArgs(int argc, char* argv[], struct loadOptions* options)
+// chatload [-c clients] [-s senders] [-r rate] [-d seconds] [-g room_size] <host> <port>
+
+int parseCommandlineArgs(int argc, char* argv[], struct loadOptions* options) {
+
+  int opt;
+
+  memset(options, 0, sizeof(struct loadOptions));
+  options->clients = DEFAULT_LOAD_CLIENTS;
+  options->senders = DEFAULT_LOAD_SENDERS;
+  options->rate = DEFAULT_LOAD_RATE;
+  options->seconds = DEFAULT_LOAD_SECONDS;
+
+  while ((opt = getopt(argc, argv, "c:s:r:d:g:")) != -1) {
+    switch (opt) {
+      case 'c':
+        options->clients = atoi(optarg);
+        break;
+      case 's':
+        options->senders = atoi(optarg);
+        break;
+      case 'r':
+        options->rate = atof(optarg);
+        break;
+      case 'd':
+        options->seconds = atoi(optarg);
+        break;
+      case 'g':
+        options->roomSize = atoi(optarg);
+        break;
+      default:
+        optind = argc + 1;
+    }
+  }
+
+  if (argc - optind != 2 || options->clients <= 0 || options->senders < 0 ||
+      options->senders > options->clients || options->rate <= 0 || options->seconds <= 0 ||
+      options->roomSize < 0) {
+    printf("usage: chatload [-c clients] [-s senders] [-r msgs/sec/sender] [-d seconds] [-g room_size] <host> <port>\n");
+    exit(1);
+  }
+  options->host = argv[optind];
+  options->port = argv[optind + 1];
+  return 0;
+}
+
+// raiseFileLimit()
+// Every simulated client is a descriptor; lift the soft limit as far as we're allowed
+
+void raiseFileLimit(void) {
+
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+int64_t nowNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// startConnect(struct loadClient* client, struct addrinfo* addr, int epollFd)
+// Starts a non-blocking connect; epoll reports writability when it's done
+// Returns 0 on success, -1 on error
+
+int startConnect(struct loadClient* client, struct addrinfo* addr, int epollFd) {
+
+  struct epoll_event ev;
+
+  client->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+  if (client->fd == -1) {
+    client->state = LOAD_CLOSED;
+    return -1;
+  }
+  if (connect(client->fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS) {
+    close(client->fd);
+    client->fd = -1;
+    client->state = LOAD_CLOSED;
+    return -1;
+  }
+
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLOUT;
+  ev.data.ptr = client;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, client->fd, &ev) == -1) {
+    close(client->fd);
+    client->fd = -1;
+    client->state = LOAD_CLOSED;
+    return -1;
+  }
+  client->state = LOAD_CONNECTING;
+  return 0;
+}
+
+// advanceHandshake(struct loadClient* client, int epollFd)
+// Moves a client one step through chatclient's handshake
+// Returns 1 once it's chatting, 0 if it's still waiting, -1 on failure
+
+int advanceHandshake(struct loadClient* client, int epollFd) {
+
+  struct epoll_event ev;
+  struct frame msg;
+  char handle[MAX_HANDLE_LENGTH];
+  int error = 0;
+  socklen_t errorLength = sizeof(error);
+  ssize_t numbytes;
+
+  if (client->state == LOAD_CONNECTING) {
+    if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == -1 || error != 0) {
+      return -1;
+    }
+    if (send(client->fd, HELLO_V2, strlen(HELLO_V2), MSG_NOSIGNAL) != (ssize_t)strlen(HELLO_V2)) {
+      return -1;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &ev);
+    client->state = LOAD_HELLO;
+    return 0;
+  }
+
+  while ((numbytes = frameRead(client->fd, &client->reader)) > 0) {
+
+    // The server's HELLO is bare; everything after it is framed
+    if (client->state == LOAD_HELLO) {
+      size_t helloLength = strlen(HELLO_V2);
+      if (client->reader.length < helloLength) {
+        continue;
+      }
+      if (memcmp(client->reader.buf + client->reader.start, HELLO_V2, helloLength) != 0) {
+        fprintf(stderr, "chatload: server doesn't speak the framed protocol\n");
+        return -1;
+      }
+      client->reader.start += helloLength;
+      client->reader.length -= helloLength;
+
+      snprintf(handle, sizeof(handle), "l%d", client->id);
+      if (sendFrame(client, FRAME_HANDLE, handle, strlen(handle)) != 1) {
+        return -1;
+      }
+      client->state = LOAD_HANDLE;
+    }
+
+    while (client->state == LOAD_HANDLE && frameNext(&client->reader, &msg) == 1) {
+      if (msg.type != FRAME_HANDLE) {
+        continue;
+      }
+      if (client->room >= 0) {
+        char join[64];
+        int length = snprintf(join, sizeof(join), "\\join " LOAD_ROOM "%d\n", client->room);
+        if (sendFrame(client, FRAME_TEXT, join, length) != 1) {
+          return -1;
+        }
+      }
+      client->state = LOAD_READY;
+      return 1;
+    }
+  }
+
+  if (numbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    return -1;
+  }
+  return 0;
+}
+
+// readDeliveries(struct loadClient* client, struct loadStats* stats)
+// Reads everything waiting for a client and times each of our messages in it
+
+void readDeliveries(struct loadClient* client, struct loadStats* stats) {
+
+  struct frame msg;
+  ssize_t numbytes;
+  int status;
+
+  if (client->state == LOAD_CLOSED) {
+    return;
+  }
+
+  while ((numbytes = frameRead(client->fd, &client->reader)) > 0) {
+    int64_t now = nowNanos();
+
+    while ((status = frameNext(&client->reader, &msg)) == 1) {
+      char text[MAX_FRAME_PAYLOAD + 1];
+      char* body;
+      unsigned long long seq;
+      long long sentAt;
+
+      if (msg.type != FRAME_TEXT) {
+        continue;
+      }
+
+      // "l12: LT<pid> <seq> <sent ns>"
+      memcpy(text, msg.payload, msg.length);
+      text[msg.length] = '\0';
+      if ((body = strstr(text, ": ")) == NULL || strncmp(body + 2, gTag, strlen(gTag)) != 0) {
+        continue;
+      }
+      if (sscanf(body + 2 + strlen(gTag), "%llu %lld", &seq, &sentAt) == 2) {
+        stats->delivered++;
+        recordLatency(stats, now - sentAt);
+      }
+    }
+    if (status == -1) {
+      closeClient(client, stats);
+      return;
+    }
+  }
+
+  if (numbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    closeClient(client, stats);
+  }
+}
+
+// sendFrame(struct loadClient* client, int type, const char* payload, size_t length)
+// Sends one frame without blocking.  A partial write is finished before the next one.
+// Returns 1 if it was sent (or queued behind a partial write), 0 if the socket was full, -1 on error
+
+int sendFrame(struct loadClient* client, int type, const char* payload, size_t length) {
+
+  char buf[FRAME_HEADER_LENGTH + MAX_FRAME_PAYLOAD];
+  ssize_t written;
+
+  if (client->pendingLength > 0) {
+    written = send(client->fd, client->pending, client->pendingLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    client->pendingLength -= written;
+    memmove(client->pending, client->pending + written, client->pendingLength);
+    if (client->pendingLength > 0) {
+      return 0;
+    }
+  }
+
+  frameEncodeHeader((unsigned char*)buf, type, length);
+  memcpy(buf + FRAME_HEADER_LENGTH, payload, length);
+  length += FRAME_HEADER_LENGTH;
+
+  written = send(client->fd, buf, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (written == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+  if ((size_t)written < length) {
+    if (length - written > sizeof(client->pending)) {
+      return -1;
+    }
+    client->pendingLength = length - written;
+    memcpy(client->pending, buf + written, client->pendingLength);
+  }
+  return 1;
+}
+
+// sendDue(struct loadClient* clients, struct loadOptions* options, struct loadStats* stats, int64_t now)
+// Sends every message whose time has come
+
+void sendDue(struct loadClient* clients, struct loadOptions* options, struct loadStats* stats, int64_t now) {
+
+  int64_t interval = (int64_t)(1e9 / options->rate);
+  char text[64];
+  int i;
+
+  for (i = 0; i < options->clients; i++) {
+    struct loadClient* client = &clients[i];
+
+    while (client->sender && client->state == LOAD_READY && client->nextSend <= now) {
+      int length = snprintf(text, sizeof(text), "%s%llu %lld\n", gTag,
+                            (unsigned long long)stats->sent, (long long)nowNanos());
+      int status = sendFrame(client, FRAME_TEXT, text, length);
+
+      if (status == 1) {
+        stats->sent++;
+        stats->expected += client->fanout;
+      } else if (status == 0) {
+        stats->blocked++;
+      } else {
+        closeClient(client, stats);
+      }
+      client->nextSend += interval;
+    }
+  }
+}
+
+// closeClient(struct loadClient* client, struct loadStats* stats)
+// Hangs up; a client that was chatting counts as dropped
+
+void closeClient(struct loadClient* client, struct loadStats* stats) {
+
+  if (client->state == LOAD_READY) {
+    stats->dropped++;
+  }
+  if (client->fd != -1) {
+    close(client->fd);   // Also takes it out of the epoll set
+    client->fd = -1;
+  }
+  client->state = LOAD_CLOSED;
+}
+
+// recordLatency(struct loadStats* stats, int64_t latency)
+// Reservoir sampling: every latency seen has the same chance of being kept
+// The maximum is kept apart, since the sample would understate the tail
+
+void recordLatency(struct loadStats* stats, int64_t latency) {
+
+  stats->seen++;
+  if (latency > stats->maxLatency) {
+    stats->maxLatency = latency;
+  }
+  if (stats->numSamples < MAX_SAMPLES) {
+    stats->samples[stats->numSamples++] = latency;
+  } else {
+    uint64_t slot = (((uint64_t)random() << 31) | random()) % stats->seen;
+    if (slot < MAX_SAMPLES) {
+      stats->samples[slot] = latency;
+    }
+  }
+}
+
+static int compareLatency(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static double percentileMillis(struct loadStats* stats, double percentile) {
+  size_t i = (size_t)(percentile / 100.0 * (stats->numSamples - 1) + 0.5);
+  return stats->samples[i] / 1e6;
+}
+
+// printReport(struct loadStats* stats, double elapsed)
+// Summarizes the run
+
+void printReport(struct loadStats* stats, double elapsed) {
+
+  printf("\n");
+  printf("  sent       %12llu msgs  %12.1f msg/s", (unsigned long long)stats->sent, stats->sent / elapsed);
+  if (stats->blocked > 0) {
+    printf("  (%llu skipped, socket full)", (unsigned long long)stats->blocked);
+  }
+  printf("\n");
+  printf("  delivered  %12llu msgs  %12.1f msg/s  (%.2f%% of %llu expected)\n",
+         (unsigned long long)stats->delivered, stats->delivered / elapsed,
+         stats->expected ? 100.0 * stats->delivered / stats->expected : 100.0,
+         (unsigned long long)stats->expected);
+  if (stats->dropped > 0) {
+    printf("  dropped    %12d clients\n", stats->dropped);
+  }
+
+  if (stats->numSamples == 0) {
+    printf("  latency    no samples\n");
+    return;
+  }
+  qsort(stats->samples, stats->numSamples, sizeof(int64_t), compareLatency);
+  printf("  latency    p50 %.3fms  p90 %.3fms  p99 %.3fms  p99.9 %.3fms  max %.3fms\n",
+         percentileMillis(stats, 50), percentileMillis(stats, 90), percentileMillis(stats, 99),
+         percentileMillis(stats, 99.9), stats->maxLatency / 1e6);
+}
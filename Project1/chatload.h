@@ -0,0 +1,80 @@
+#ifndef CHATLOAD_H_ /* Include Guard */
+#define CHATLOAD_H_
+
+#include <stdint.h>
+#include "chatframe.h"
+
+struct addrinfo;
+
+#define MAX_HANDLE_LENGTH 11
+#define LOAD_TAG "LT"               // Marks our messages: "LT<pid> <seq> <sent ns>"
+#define LOAD_ROOM "load"            // Rooms are load0, load1, ...
+
+#define DEFAULT_LOAD_CLIENTS 1000
+#define DEFAULT_LOAD_SENDERS 10
+#define DEFAULT_LOAD_RATE 100       // Messages per second per sender
+#define DEFAULT_LOAD_SECONDS 10
+#define CONNECT_TIMEOUT 10          // Seconds to get everyone through the handshake
+#define DRAIN_SECONDS 2             // Seconds to wait for stragglers after the last send
+#define MAX_PENDING_CONNECTS 256    // Handshakes in flight at once
+#define MAX_LOAD_EVENTS 512
+#define MAX_SAMPLES (1 << 20)       // Latency reservoir size
+
+#define LOAD_CONNECTING 0
+#define LOAD_HELLO 1                // Waiting for "HELLO 2"
+#define LOAD_HANDLE 2               // Waiting for the server's handle
+#define LOAD_READY 3
+#define LOAD_CLOSED 4
+
+struct loadOptions {
+  const char* host;
+  const char* port;
+  int clients;
+  int senders;
+  int roomSize;                     // Clients per room; 0 puts everyone in the lobby
+  double rate;
+  int seconds;
+};
+
+// One simulated chatclient
+struct loadClient {
+  int fd;
+  int id;
+  int state;                        // LOAD_*
+  int sender;
+  int room;                         // -1 for the lobby
+  int fanout;                       // Deliveries each message should produce
+  int64_t nextSend;                 // When the next message is due (sender only)
+  char pending[64];                 // Unsent tail of a message the socket didn't take
+  size_t pendingLength;
+  struct frameReader reader;
+};
+
+struct loadStats {
+  int connected;
+  int failed;
+  int dropped;                      // Disconnected by the server mid-run
+  uint64_t sent;
+  uint64_t blocked;                 // Sends skipped because the socket was full
+  uint64_t expected;                // Deliveries the sends should produce
+  uint64_t delivered;
+  uint64_t seen;                    // Latencies offered to the reservoir
+  int64_t maxLatency;               // Worst of them, sampled or not
+  int64_t* samples;
+  size_t numSamples;
+};
+
+int parseCommandlineArgs(int argc, char* argv[], struct loadOptions* options);
+void raiseFileLimit(void);
+int64_t nowNanos(void);
+
+int startConnect(struct loadClient* client, struct addrinfo* addr, int epollFd);
+int advanceHandshake(struct loadClient* client, int epollFd);
+void readDeliveries(struct loadClient* client, struct loadStats* stats);
+int sendFrame(struct loadClient* client, int type, const char* payload, size_t length);
+void sendDue(struct loadClient* clients, struct loadOptions* options, struct loadStats* stats, int64_t now);
+void closeClient(struct loadClient* client, struct loadStats* stats);
+void recordLatency(struct loadStats* stats, int64_t latency);
+void printReport(struct loadStats* stats, double elapsed);
+
+#endif // CHATLOAD_H_
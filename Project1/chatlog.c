@@ -0,0 +1,503 @@
+/*
+ * chatlog.c
+ * CS372_400_W2017 - Project 1
+ * Jeromie Clark <clarkje@oregonstate.edu>
+ *
+ * Persistent chat history for chatserve
+ *
+ * The log is a directory of append-only segment files named after the
+ * sequence number of their first record.  The newest segment is
+ * preallocated and mapped; appending a message is a memcpy() into the
+ * mapping.  Nothing is synced per message: logSync() pushes everything
+ * appended since the last sync out with one msync(), every LOG_SYNC_MILLIS
+ * or LOG_SYNC_RECORDS, whichever comes first (group commit).
+ *
+ * Every record points back at the previous record in its room, and the log
+ * keeps each room's newest record in a hash table, so "the last N" and
+ * "since time T" follow the room's own chain: the cost is the messages
+ * replayed, however big the log is or however quiet the room.  Replayed
+ * records are never copied: logReplay() hands back pointers into the
+ * mappings, which chatserve queues and writev()s straight to the socket.
+ *
+ * When a segment fills it's sealed (trimmed to what it holds) and a new one
+ * is started.  Old segments are deleted once the log outgrows its byte
+ * budget or they age out.  A segment that's still being replayed from stays
+ * mapped until the last queued message lets go of it.
+ */
+
+#define _GNU_SOURCE
+#include "chatlog.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define LOG_RECORD_BYTES(roomLength, length) LOG_ALIGN(sizeof(struct logRecord) + (roomLength) + (length))
+
+static int64_t nowNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void segmentPath(struct chatLog* log, uint64_t firstSeq, char* path, size_t size) {
+  snprintf(path, size, "%s/%020llu.log", log->dir, (unsigned long long)firstSeq);
+}
+
+static unsigned int hashRoom(const char* name, size_t length) {
+  unsigned int hash = 5381;
+  while (length-- > 0) {
+    hash = hash * 33 + (unsigned char)*name++;
+  }
+  return hash % LOG_ROOM_BUCKETS;
+}
+
+// findRoom(struct chatLog* log, const char* name, size_t length, int create)
+// Looks up a room's chain head, adding an empty one if create is set
+// Returns the room, or NULL if it isn't there (or can't be added)
+
+static struct logRoom* findRoom(struct chatLog* log, const char* name, size_t length, int create) {
+
+  struct logRoom** bucket = &log->rooms[hashRoom(name, length)];
+  struct logRoom* room;
+
+  for (room = *bucket; room != NULL; room = room->next) {
+    if (room->nameLength == length && memcmp(room->name, name, length) == 0) {
+      return room;
+    }
+  }
+  if (!create || (room = calloc(1, sizeof(struct logRoom) + length)) == NULL) {
+    return NULL;
+  }
+  memcpy(room->name, name, length);
+  room->nameLength = length;
+  room->next = *bucket;
+  *bucket = room;
+  return room;
+}
+
+// Makes rec, at offset in its segment, the newest record of its room
+static void pushRoom(struct chatLog* log, struct logRecord* rec, size_t offset) {
+
+  struct logRoom* room = findRoom(log, (char*)(rec + 1), rec->roomLength, 1);
+
+  if (room != NULL) {
+    room->lastSeq = rec->seq;
+    room->lastOffset = offset;
+  }
+}
+
+// forgetRooms(struct chatLog* log, uint64_t beforeSeq)
+// Drops the rooms whose newest record is older than beforeSeq (or all of them)
+
+static void forgetRooms(struct chatLog* log, uint64_t beforeSeq) {
+
+  int i;
+
+  for (i = 0; i < LOG_ROOM_BUCKETS; i++) {
+    struct logRoom** link = &log->rooms[i];
+    while (*link != NULL) {
+      struct logRoom* room = *link;
+      if (room->lastSeq < beforeSeq) {
+        *link = room->next;
+        free(room);
+      } else {
+        link = &room->next;
+      }
+    }
+  }
+}
+
+// Links seg in as the newest segment; the log holds the first reference
+static void pushSegment(struct chatLog* log, struct logSegment* seg) {
+  seg->refs = 1;
+  seg->older = log->newest;
+  seg->newer = NULL;
+  if (log->newest != NULL) {
+    log->newest->newer = seg;
+  } else {
+    log->oldest = seg;
+  }
+  log->newest = seg;
+  log->totalBytes += seg->used;
+}
+
+// loadSegment(struct chatLog* log, const char* name)
+// Maps an existing segment read-only and finds each room's newest record in it
+// Returns 0 on success, -1 if it's unusable (and has been skipped)
+
+static int loadSegment(struct chatLog* log, const char* name) {
+
+  char path[4096];
+  struct stat info;
+  struct logSegment* seg;
+  size_t offset;
+
+  snprintf(path, sizeof(path), "%s/%s", log->dir, name);
+  if ((seg = calloc(1, sizeof(struct logSegment))) == NULL) {
+    return -1;
+  }
+  if ((seg->fd = open(path, O_RDWR | O_CLOEXEC)) == -1 || fstat(seg->fd, &info) == -1 ||
+      info.st_size < LOG_HEADER_BYTES) {
+    goto fail;
+  }
+  seg->capacity = info.st_size;
+  seg->base = mmap(NULL, seg->capacity, PROT_READ, MAP_SHARED, seg->fd, 0);
+  if (seg->base == MAP_FAILED || memcmp(seg->base, LOG_MAGIC, 8) != 0) {
+    goto fail;
+  }
+  memcpy(&seg->firstSeq, seg->base + 8, sizeof(uint64_t));
+
+  // Walk the records up to the first empty (or torn) one
+  offset = LOG_HEADER_BYTES;
+  while (offset + sizeof(struct logRecord) <= seg->capacity) {
+    struct logRecord* rec = (struct logRecord*)(seg->base + offset);
+    size_t size = LOG_RECORD_BYTES(rec->roomLength, rec->length);
+    if (rec->length == 0 || size > seg->capacity - offset) {
+      break;
+    }
+    pushRoom(log, rec, offset);
+    seg->lastTime = rec->timestamp;
+    if (rec->seq >= log->nextSeq) {
+      log->nextSeq = rec->seq + 1;
+    }
+    offset += size;
+  }
+  if (offset == LOG_HEADER_BYTES) {
+    // Nothing was ever committed to it; a new segment may want the name
+    munmap(seg->base, seg->capacity);
+    close(seg->fd);
+    unlink(path);
+    free(seg);
+    return -1;
+  }
+  seg->used = seg->synced = offset;
+  seg->sealed = 1;
+  if (seg->used < seg->capacity) {
+    ftruncate(seg->fd, seg->used);   // Left preallocated by a crash
+  }
+  if (seg->lastTime > log->lastTime) {
+    log->lastTime = seg->lastTime;
+  }
+  pushSegment(log, seg);
+  return 0;
+
+fail:
+  fprintf(stderr, "chatserve: skipping history segment %s\n", path);
+  if (seg->base != NULL && seg->base != MAP_FAILED) {
+    munmap(seg->base, seg->capacity);
+  }
+  if (seg->fd != -1) {
+    close(seg->fd);
+  }
+  free(seg);
+  return -1;
+}
+
+static int isSegmentName(const struct dirent* entry) {
+  size_t length = strlen(entry->d_name);
+  return length == 24 && strcmp(entry->d_name + 20, ".log") == 0;
+}
+
+// logOpen(struct chatLog* log, const char* dir, size_t retainBytes, time_t retainSeconds)
+// Opens (creating if needed) the history in dir and recovers its segments
+// Returns 0 on success, -1 on error
+
+int logOpen(struct chatLog* log, const char* dir, size_t retainBytes, time_t retainSeconds) {
+
+  struct dirent** names;
+  int numNames, i;
+
+  memset(log, 0, sizeof(struct chatLog));
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    return -1;
+  }
+  if ((log->dir = strdup(dir)) == NULL) {
+    return -1;
+  }
+  log->retainBytes = retainBytes;
+  log->retainSeconds = retainSeconds;
+  log->nextSeq = 1;
+
+  // Keep at least a few segments' worth of history inside the budget
+  log->segmentBytes = LOG_SEGMENT_BYTES;
+  while (log->segmentBytes > LOG_MIN_SEGMENT_BYTES && log->segmentBytes * 4 > retainBytes) {
+    log->segmentBytes /= 2;
+  }
+
+  // Zero-padded names sort in sequence order
+  if ((numNames = scandir(dir, &names, isSegmentName, alphasort)) == -1) {
+    free(log->dir);
+    return -1;
+  }
+  for (i = 0; i < numNames; i++) {
+    loadSegment(log, names[i]->d_name);
+    free(names[i]);
+  }
+  free(names);
+
+  log->lastSync = nowNanos();
+  return 0;
+}
+
+// logClose(struct chatLog* log)
+// Syncs and unmaps everything
+
+void logClose(struct chatLog* log) {
+
+  logSync(log);
+  while (log->oldest != NULL) {
+    struct logSegment* seg = log->oldest;
+    log->oldest = seg->newer;
+    logRelease(seg);
+  }
+  log->newest = NULL;
+  forgetRooms(log, UINT64_MAX);
+  free(log->dir);
+  log->dir = NULL;
+}
+
+void logHold(struct logSegment* segment) {
+  segment->refs++;
+}
+
+void logRelease(struct logSegment* segment) {
+  if (segment != NULL && --segment->refs == 0) {
+    munmap(segment->base, segment->capacity);
+    close(segment->fd);
+    free(segment);
+  }
+}
+
+// syncSegment(struct logSegment* seg)
+// msync()s the pages appended since the last sync
+
+static void syncSegment(struct logSegment* seg) {
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t start = seg->synced & ~(size_t)(pageSize - 1);
+
+  if (seg->used > seg->synced) {
+    msync(seg->base + start, seg->used - start, MS_SYNC);
+    seg->synced = seg->used;
+  }
+}
+
+// retain(struct chatLog* log)
+// Deletes the oldest segments while the log is over budget or they've aged out
+// The newest segment always stays.
+
+static void retain(struct chatLog* log) {
+
+  int64_t cutoff = log->retainSeconds > 0 ? nowNanos() - (int64_t)log->retainSeconds * 1000000000 : 0;
+  char path[4096];
+  int deleted = 0;
+
+  while (log->oldest != NULL && log->oldest != log->newest &&
+         (log->totalBytes > log->retainBytes || log->oldest->lastTime < cutoff)) {
+    struct logSegment* seg = log->oldest;
+
+    segmentPath(log, seg->firstSeq, path, sizeof(path));
+    unlink(path);
+    log->totalBytes -= seg->used;
+    log->oldest = seg->newer;
+    log->oldest->older = NULL;
+    logRelease(seg);
+    deleted = 1;
+  }
+
+  // Rooms with nothing left in the log
+  if (deleted) {
+    forgetRooms(log, log->oldest->firstSeq);
+  }
+}
+
+// roll(struct chatLog* log)
+// Seals the current segment and starts a new, preallocated one
+// Returns 0 on success, -1 on error
+
+static int roll(struct chatLog* log) {
+
+  struct logSegment* seg = log->newest;
+  char path[4096];
+  int status;
+
+  if (seg != NULL && !seg->sealed) {
+    syncSegment(seg);
+    ftruncate(seg->fd, seg->used);
+    seg->sealed = 1;
+  }
+
+  if ((seg = calloc(1, sizeof(struct logSegment))) == NULL) {
+    return -1;
+  }
+  seg->firstSeq = log->nextSeq;
+  seg->capacity = log->segmentBytes;
+  segmentPath(log, seg->firstSeq, path, sizeof(path));
+
+  if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+    free(seg);
+    return -1;
+  }
+
+  // Reserve the blocks up front: running out of disk under a mapping is SIGBUS
+  status = posix_fallocate(seg->fd, 0, seg->capacity);
+  if (status == EOPNOTSUPP || status == EINVAL) {
+    status = ftruncate(seg->fd, seg->capacity) == -1 ? errno : 0;
+  }
+  if (status != 0 ||
+      (seg->base = mmap(NULL, seg->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0)) == MAP_FAILED) {
+    close(seg->fd);
+    unlink(path);
+    free(seg);
+    return -1;
+  }
+  madvise(seg->base, seg->capacity, MADV_SEQUENTIAL);
+
+  memcpy(seg->base, LOG_MAGIC, 8);
+  memcpy(seg->base + 8, &seg->firstSeq, sizeof(uint64_t));
+  seg->used = LOG_HEADER_BYTES;
+
+  pushSegment(log, seg);
+  retain(log);
+  return 0;
+}
+
+// logAppend(struct chatLog* log, const char* room, const char* frame, size_t length)
+// Appends one message (a whole frame, header included) to the history of room
+// Returns 0 on success, -1 on error
+
+int logAppend(struct chatLog* log, const char* room, const char* frame, size_t length) {
+
+  size_t roomLength = strlen(room);
+  size_t size = LOG_RECORD_BYTES(roomLength, length);
+  struct logSegment* seg = log->newest;
+  struct logRecord* rec;
+  struct logRoom* head;
+  int64_t now = nowNanos();
+
+  if (length == 0 || size > log->segmentBytes - LOG_HEADER_BYTES) {
+    return -1;
+  }
+  if (seg == NULL || seg->sealed || size > seg->capacity - seg->used) {
+    if (roll(log) == -1) {
+      return -1;
+    }
+    seg = log->newest;
+  }
+  if ((head = findRoom(log, room, roomLength, 1)) == NULL) {
+    return -1;
+  }
+
+  // Keep timestamps in order even if the clock steps back
+  if (now < log->lastTime) {
+    now = log->lastTime;
+  }
+
+  rec = (struct logRecord*)(seg->base + seg->used);
+  rec->roomLength = roomLength;
+  rec->reserved = 0;
+  rec->seq = log->nextSeq;
+  rec->timestamp = now;
+  rec->prevSeq = head->lastSeq;
+  rec->prevOffset = head->lastOffset;
+  memcpy((char*)(rec + 1), room, roomLength);
+  memcpy((char*)(rec + 1) + roomLength, frame, length);
+  rec->length = length;
+
+  head->lastSeq = rec->seq;
+  head->lastOffset = seg->used;
+  seg->lastTime = log->lastTime = now;
+  seg->used += size;
+  log->totalBytes += size;
+  log->nextSeq++;
+
+  if (++log->pending >= LOG_SYNC_RECORDS) {
+    logSync(log);
+  }
+  return 0;
+}
+
+// logSync(struct chatLog* log)
+// Group commit: everything appended since the last call goes to disk together
+
+void logSync(struct chatLog* log) {
+
+  if (log->newest != NULL) {
+    syncSegment(log->newest);
+  }
+  log->pending = 0;
+  log->lastSync = nowNanos();
+  retain(log);
+}
+
+// logSyncTimeout(struct chatLog* log)
+// Returns milliseconds until logSync() is due, or -1 if nothing's waiting
+
+int logSyncTimeout(struct chatLog* log) {
+
+  int64_t elapsed;
+
+  if (log->pending == 0) {
+    return -1;
+  }
+  elapsed = (nowNanos() - log->lastSync) / 1000000;
+  return elapsed >= LOG_SYNC_MILLIS ? 0 : (int)(LOG_SYNC_MILLIS - elapsed);
+}
+
+// logReplay(struct chatLog* log, const char* room, size_t count, int64_t since, struct logEntry* out, size_t max)
+// Finds room's messages: the last count of them, or (since >= 0) the last
+// count written at or after since, in nanoseconds.  At most max are returned.
+// Returns the number of entries filled in, oldest first
+
+size_t logReplay(struct chatLog* log, const char* room, size_t count, int64_t since, struct logEntry* out, size_t max) {
+
+  size_t want = count < max ? count : max;
+  struct logSegment* seg = log->newest;
+  struct logRoom* head;
+  struct logEntry swap;
+  uint64_t seq;
+  size_t offset, found = 0, i;
+
+  if (want == 0 || (head = findRoom(log, room, strlen(room), 0)) == NULL) {
+    return 0;
+  }
+
+  // Follow the room's chain back from its newest record.  It ends at the
+  // room's first record, or where retention (or a lost segment) cut it.
+  for (seq = head->lastSeq, offset = head->lastOffset; seq != 0 && found < want;) {
+    struct logRecord* rec;
+
+    while (seg != NULL && seg->firstSeq > seq) {
+      seg = seg->older;
+    }
+    if (seg == NULL || offset + sizeof(struct logRecord) > seg->used) {
+      break;
+    }
+    rec = (struct logRecord*)(seg->base + offset);
+    if (rec->seq != seq || rec->timestamp < since) {
+      break;
+    }
+    out[found].segment = seg;
+    out[found].frame = (char*)(rec + 1) + rec->roomLength;
+    out[found].length = rec->length;
+    found++;
+    seq = rec->prevSeq;
+    offset = rec->prevOffset;
+  }
+
+  // Found newest first; the oldest goes first
+  for (i = 0; i < found / 2; i++) {
+    swap = out[i];
+    out[i] = out[found - 1 - i];
+    out[found - 1 - i] = swap;
+  }
+  return found;
+}
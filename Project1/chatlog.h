@@ -0,0 +1,87 @@
+#ifndef CHATLOG_H_ /* Include Guard */
+#define CHATLOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_MAGIC "CHATLOG2"
+#define LOG_HEADER_BYTES 16           // Magic + first sequence number
+#define LOG_SEGMENT_BYTES (8 << 20)   // Preallocated size of each segment file
+#define LOG_MIN_SEGMENT_BYTES (64 << 10)
+#define LOG_SYNC_MILLIS 50            // Group commit interval
+#define LOG_SYNC_RECORDS 1024         // ... or sooner, once this many are waiting
+#define DEFAULT_RETAIN_BYTES (256 << 20)
+#define LOG_ROOM_BUCKETS 1024         // Room hash table size
+
+// On disk, after the segment header, records are laid end to end:
+//   record header | room name | frame (header + payload) | pad to 8 bytes
+// length is written last, so a zero length marks the end of the segment.
+// Each record points back at the previous one in its room, so a room's
+// history can be walked newest first without reading anyone else's.
+struct logRecord {
+  uint32_t length;                    // Frame bytes
+  uint16_t roomLength;
+  uint16_t reserved;
+  uint64_t seq;
+  int64_t timestamp;                  // Nanoseconds since the epoch
+  uint64_t prevSeq;                   // The room's previous record, 0 = none
+  uint64_t prevOffset;                // ... and where it starts in its segment
+};
+
+// Where a room's newest record is: the head of its chain
+struct logRoom {
+  uint64_t lastSeq;
+  size_t lastOffset;
+  struct logRoom* next;               // Hash chain
+  size_t nameLength;
+  char name[];
+};
+
+// One mapped segment file
+struct logSegment {
+  int fd;
+  int refs;                           // The log's, plus one per replayed message still queued
+  int sealed;                         // Full (or recovered at startup); no more appends
+  char* base;
+  size_t capacity;                    // Bytes mapped
+  size_t used;                        // Bytes of header and records
+  size_t synced;                      // Bytes known to be on disk
+  uint64_t firstSeq;
+  int64_t lastTime;
+  struct logSegment* older;
+  struct logSegment* newer;
+};
+
+struct chatLog {
+  char* dir;
+  size_t segmentBytes;
+  size_t retainBytes;                 // Oldest segments go once the log is bigger than this...
+  time_t retainSeconds;               // ... or once they're older than this (0: forever)
+  size_t totalBytes;
+  uint64_t nextSeq;
+  int64_t lastTime;
+  size_t pending;                     // Records appended since the last sync
+  int64_t lastSync;
+  struct logSegment* oldest;
+  struct logSegment* newest;
+  struct logRoom* rooms[LOG_ROOM_BUCKETS];
+};
+
+// A record found by logReplay(); frame points into the segment's mapping
+struct logEntry {
+  struct logSegment* segment;
+  char* frame;
+  size_t length;
+};
+
+int logOpen(struct chatLog* log, const char* dir, size_t retainBytes, time_t retainSeconds);
+void logClose(struct chatLog* log);
+int logAppend(struct chatLog* log, const char* room, const char* frame, size_t length);
+size_t logReplay(struct chatLog* log, const char* room, size_t count, int64_t since, struct logEntry* out, size_t max);
+void logSync(struct chatLog* log);
+int logSyncTimeout(struct chatLog* log);
+void logHold(struct logSegment* segment);
+void logRelease(struct logSegment* segment);
+
+#endif // CHATLOG_H_
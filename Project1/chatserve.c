@@ -0,0 +1,942 @@
+/*
+ * chatserve.c
+ * CS372_400_W2017 - Project 1
+ * Jeromie Clark <clarkje@oregonstate.edu>
+ *
+ * Chat hub for chatclient
+ * 1.) Listens on the port supplied on the commandline
+ * 2.) Speaks chatclient's handshake: HELLO <-> HELLO, then the client's
+ *     handle <-> our handle
+ * 3.) Relays every line a client sends, as "handle: line", to everyone else
+ *     in the same room.  Everybody starts in "lobby"; "\join <room>" moves.
+ * 4.) "\quit" (or hanging up) leaves
+ *
+ * Clients that offer "HELLO 2" get the framed protocol from chatframe.c;
+ * old clients keep the unframed one.  Each message is stored as a frame and
+ * version 1 clients are simply sent the payload without the header.
+ *
+ * One thread, one epoll reactor.  Each relayed line is stored once and
+ * referenced from every recipient's outbound queue; queues are written with
+ * writev() once per loop pass, so a busy room costs one syscall per client
+ * per pass instead of one per message.  A client that falls more than
+ * DEFAULT_QUEUE_BYTES behind is disconnected, so memory stays bounded by
+ * max clients x queue cap no matter how slow the readers are.
+ *
+ * With -H, every relayed line is also appended to the history log in
+ * chatlog.c, and joining a room replays its recent past straight out of
+ * the log's mappings.  "\history [n]" and "\since <unix time>" ask for more.
+ *
+ * Replaces the forking chatserve.py.
+ *
+ * Listener setup is modeled on:
+ * http://beej.us/guide/bgnet/output/html/singlepage/bgnet.html
+ */
+
+#define _GNU_SOURCE
+#include "chatserve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define DEBUG 0
+#define BACKLOG 1024
+
+static struct chatConn* gClosed = NULL;   // Connections closed this pass, freed after it
+static struct chatLog gLog;
+static char* gHistoryDir = NULL;
+static size_t gRetainBytes = DEFAULT_RETAIN_BYTES;
+static time_t gRetainSeconds = 0;
+
+int main(int argc, char *argv[])
+{
+  struct chatServer server;
+  char port[16];
+
+  parseCommandlineArgs(argc, argv, &server);
+  snprintf(port, sizeof(port), "%s", argv[argc - 1]);
+
+  // A client hanging up mid-write shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+  raiseFileLimit();
+
+  if ((server.listenFd = openListener(port)) == -1) {
+    fprintf(stderr, "chatserve: unable to listen on port %s\n", port);
+    return 1;
+  }
+
+  if (gHistoryDir != NULL) {
+    if (logOpen(&gLog, gHistoryDir, gRetainBytes, gRetainSeconds) == -1) {
+      fprintf(stderr, "chatserve: unable to open history in %s\n", gHistoryDir);
+      return 1;
+    }
+    server.log = &gLog;
+    printf("chatserve: history in %s (%llu messages so far)\n", gHistoryDir, (unsigned long long)gLog.nextSeq - 1);
+  }
+
+  printf("chatserve: listening on port %s (max %d clients)\n", port, server.maxClients);
+  printf("== Press Ctrl-C To Exit Server ==\n");
+
+  runServer(&server);
+  return 0;
+}
+
+// parseCommandlineArgs(int argc, char* argv[], struct chatServer* server)
+// chatserve [-m <max_clients>] [-q <queue_bytes>]
+//           [-H <history_dir> [-n <replay>] [-R <retain_bytes>] [-A <retain_seconds>]] <port>
+
+int parseCommandlineArgs(int argc, char* argv[], struct chatServer* server) {
+
+  int opt;
+
+  memset(server, 0, sizeof(struct chatServer));
+  server->maxClients = DEFAULT_MAX_CLIENTS;
+  server->queueBytes = DEFAULT_QUEUE_BYTES;
+  server->replayCount = DEFAULT_REPLAY;
+
+  while ((opt = getopt(argc, argv, "m:q:H:n:R:A:")) != -1) {
+    switch (opt) {
+      case 'm':
+        server->maxClients = atoi(optarg);
+        break;
+      case 'q':
+        server->queueBytes = strtoul(optarg, NULL, 10);
+        break;
+      case 'H':
+        gHistoryDir = optarg;
+        break;
+      case 'n':
+        server->replayCount = strtoul(optarg, NULL, 10);
+        break;
+      case 'R':
+        gRetainBytes = strtoull(optarg, NULL, 10);
+        break;
+      case 'A':
+        gRetainSeconds = strtol(optarg, NULL, 10);
+        break;
+      default:
+        optind = argc + 1;
+    }
+  }
+
+  if (argc - optind != 1 || server->maxClients <= 0 || server->queueBytes < MAX_LINE_LENGTH) {
+    printf("usage: chatserve [-m <max_clients>] [-q <queue_bytes>]\n"
+           "                 [-H <history_dir> [-n <replay>] [-R <retain_bytes>] [-A <retain_seconds>]] <port>\n");
+    exit(1);
+  }
+  return 0;
+}
+
+// raiseFileLimit()
+// Every client is a descriptor; lift the soft limit as far as we're allowed
+
+void raiseFileLimit(void) {
+
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// openListener(const char* port)
+// Binds a non-blocking listening socket on port, IPv4 and IPv6
+// Returns the descriptor, or -1 on error
+
+int openListener(const char* port) {
+
+  struct addrinfo hints, *result, *rp;
+  int fd = -1;
+  int yes = 1;
+  int no = 0;
+  int status, pass;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if ((status = getaddrinfo(NULL, port, &hints, &result)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    return -1;
+  }
+
+  // The IPv6 wildcard goes first: with V6ONLY off it takes IPv4 clients too
+  for (pass = 0; pass < 2 && fd == -1; pass++) {
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+      if ((rp->ai_family == AF_INET6) != (pass == 0)) {
+        continue;
+      }
+      fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+      if (fd == -1) {
+        continue;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      if (rp->ai_family == AF_INET6) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+      }
+      if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0 && listen(fd, BACKLOG) == 0) {
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(result);
+  return fd;
+}
+
+// runServer(struct chatServer* server)
+// The reactor: wait for events, handle them, then flush every queue touched
+
+void runServer(struct chatServer* server) {
+
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event ev;
+  int numEvents, i;
+
+  if ((server->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("chatserve: epoll_create1");
+    exit(1);
+  }
+
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;     // NULL marks the listener
+  if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &ev) == -1) {
+    perror("chatserve: epoll_ctl");
+    exit(1);
+  }
+
+  while (1) {
+
+    // Wake up in time for the history's next group commit
+    int timeout = server->log != NULL ? logSyncTimeout(server->log) : -1;
+
+    numEvents = epoll_wait(server->epollFd, events, MAX_EVENTS, timeout);
+    if (numEvents == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("chatserve: epoll_wait");
+      exit(1);
+    }
+
+    for (i = 0; i < numEvents; i++) {
+      struct chatConn* conn = events[i].data.ptr;
+
+      if (conn == NULL) {
+        acceptClients(server);
+        continue;
+      }
+      if (conn->fd == -1) {
+        continue;   // Closed earlier in this pass
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        handleReadable(server, conn);
+      }
+      if (conn->fd != -1 && (events[i].events & EPOLLOUT) && !conn->dirty) {
+        conn->dirty = 1;
+        conn->nextDirty = server->dirtyList;
+        server->dirtyList = conn;
+      }
+    }
+
+    // One writev() per client with pending output
+    flushDirty(server);
+
+    if (server->log != NULL && logSyncTimeout(server->log) == 0) {
+      logSync(server->log);
+    }
+
+    // Now nothing can still point at the connections we closed
+    while (gClosed != NULL) {
+      struct chatConn* next = gClosed->nextDirty;
+      free(gClosed);
+      gClosed = next;
+    }
+  }
+}
+
+// acceptClients(struct chatServer* server)
+// Accepts every pending connection
+
+void acceptClients(struct chatServer* server) {
+
+  struct epoll_event ev;
+
+  while (1) {
+    int fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("chatserve: accept");
+      }
+      return;
+    }
+
+    if (server->numClients >= server->maxClients) {
+      close(fd);
+      continue;
+    }
+
+    struct chatConn* conn = calloc(1, sizeof(struct chatConn));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->state = CONN_HELLO;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+    server->numClients++;
+
+    if (DEBUG) {
+      printf("acceptClients() - client %d connected (%d total)\n", fd, server->numClients);
+    }
+  }
+}
+
+// closeConn(struct chatServer* server, struct chatConn* conn)
+// Drops a client.  The struct itself is freed at the end of the loop pass.
+
+void closeConn(struct chatServer* server, struct chatConn* conn) {
+
+  struct outItem* item;
+
+  if (conn->fd == -1) {
+    return;
+  }
+
+  if (conn->state == CONN_CHAT && conn->room != NULL) {
+    char notice[MAX_HANDLE_LENGTH + 32];
+    struct chatRoom* room = conn->room;
+    int length = snprintf(notice, sizeof(notice), "* %s has left\n", conn->handle);
+    if (leaveRoom(server, conn)) {
+      broadcast(server, room, NULL, newMessage(FRAME_TEXT, notice, length));
+    }
+  } else {
+    leaveRoom(server, conn);
+  }
+
+  // epoll forgets the descriptor when it's closed
+  close(conn->fd);
+  conn->fd = -1;
+  server->numClients--;
+
+  while ((item = conn->outHead) != NULL) {
+    conn->outHead = item->next;
+    releaseMessage(item->msg);
+    item->next = server->freeItems;
+    server->freeItems = item;
+  }
+  conn->outTail = NULL;
+  conn->outBytes = 0;
+
+  // If it's on the flush list, flushDirty() frees it; otherwise we queue it
+  if (!conn->dirty) {
+    conn->nextDirty = gClosed;
+    gClosed = conn;
+  }
+}
+
+// handleReadable(struct chatServer* server, struct chatConn* conn)
+// Reads everything the client has sent and acts on each complete line
+
+void handleReadable(struct chatServer* server, struct chatConn* conn) {
+
+  while (conn->fd != -1) {
+    ssize_t numbytes = recv(conn->fd, conn->inBuf + conn->inLength, sizeof(conn->inBuf) - conn->inLength, 0);
+
+    if (numbytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        closeConn(server, conn);
+      }
+      return;
+    }
+    if (numbytes == 0) {
+      closeConn(server, conn);
+      return;
+    }
+    conn->inLength += numbytes;
+
+    // chatclient sends HELLO (and, unframed, its handle) with no terminator
+    // and waits for our reply, so during the handshake one read is one message
+    if (conn->state == CONN_HELLO || (conn->state == CONN_HANDLE && conn->version < CHAT_VERSION)) {
+      handleLine(server, conn, conn->inBuf, conn->inLength);
+      conn->inLength = 0;
+      continue;
+    }
+
+    if (conn->version >= CHAT_VERSION) {
+      handleFrames(server, conn);
+    } else {
+      handleLines(server, conn);
+    }
+  }
+}
+
+// handleFrames(struct chatServer* server, struct chatConn* conn)
+// Acts on every complete frame in conn's buffer (version 2)
+
+void handleFrames(struct chatServer* server, struct chatConn* conn) {
+
+  struct frame msg;
+  size_t pos = 0;
+  int used;
+
+  while (conn->fd != -1 && (used = frameParse(conn->inBuf + pos, conn->inLength - pos, &msg)) > 0) {
+    pos += used;
+
+    if (msg.type == FRAME_QUIT) {
+      closeConn(server, conn);
+    } else if (msg.type == FRAME_PING && conn->state == CONN_CHAT) {
+      // Frames are handled in order, so this acknowledges everything before it
+      queueText(server, conn, FRAME_PONG, msg.payload, msg.length);
+    } else if ((msg.type == FRAME_HANDLE && conn->state == CONN_HANDLE) ||
+               (msg.type == FRAME_TEXT && conn->state == CONN_CHAT)) {
+      handleLine(server, conn, msg.payload, msg.length < MAX_LINE_LENGTH ? msg.length : MAX_LINE_LENGTH);
+    }
+  }
+  if (conn->fd == -1) {
+    return;
+  }
+  if (used == -1) {
+    closeConn(server, conn);
+    return;
+  }
+  conn->inLength -= pos;
+  memmove(conn->inBuf, conn->inBuf + pos, conn->inLength);
+}
+
+// handleLines(struct chatServer* server, struct chatConn* conn)
+// Acts on every complete line in conn's buffer (version 1)
+// Lines end in '\n'; a line that fills MAX_LINE_LENGTH is relayed as-is.
+
+void handleLines(struct chatServer* server, struct chatConn* conn) {
+
+  char* start = conn->inBuf;
+  char* end = conn->inBuf + conn->inLength;
+  char* newline;
+
+  while (conn->fd != -1 && (newline = memchr(start, '\n', end - start)) != NULL) {
+    handleLine(server, conn, start, newline - start + 1);
+    start = newline + 1;
+  }
+  if (conn->fd == -1) {
+    return;
+  }
+  if (start == conn->inBuf && conn->inLength >= MAX_LINE_LENGTH) {
+    handleLine(server, conn, start, MAX_LINE_LENGTH);
+    start += MAX_LINE_LENGTH;
+  }
+  conn->inLength = end - start;
+  memmove(conn->inBuf, start, conn->inLength);
+}
+
+// handleLine(struct chatServer* server, struct chatConn* conn, char* line, size_t length)
+// Acts on one message from a client according to where it is in the session
+
+void handleLine(struct chatServer* server, struct chatConn* conn, char* line, size_t length) {
+
+  char text[MAX_LINE_LENGTH + 1];
+  size_t i;
+
+  if (length > MAX_LINE_LENGTH) {
+    length = MAX_LINE_LENGTH;
+  }
+  memcpy(text, line, length);
+  text[length] = '\0';
+
+  switch (conn->state) {
+
+    case CONN_HELLO:
+      // Just wait until the client says HELLO, then say it back.
+      // "HELLO 2" asks for framing, which we speak; plain "HELLO" doesn't.
+      if (strstr(text, HANDSHAKE) != NULL) {
+        conn->version = strstr(text, HELLO_V2) != NULL ? CHAT_VERSION : 1;
+        if (conn->version >= CHAT_VERSION) {
+          queueText(server, conn, FRAME_RAW, HELLO_V2, strlen(HELLO_V2));
+        } else {
+          queueText(server, conn, FRAME_RAW, HANDSHAKE, strlen(HANDSHAKE));
+        }
+        conn->state = CONN_HANDLE;
+      }
+      return;
+
+    case CONN_HANDLE:
+      // The next message is the handle.  Keep it printable and short.
+      for (i = 0; i < length && i < MAX_HANDLE_LENGTH - 1 && text[i] > ' '; i++) {
+        conn->handle[i] = text[i];
+      }
+      conn->handle[i] = '\0';
+      if (i == 0) {
+        strcpy(conn->handle, "anon");
+      }
+      queueText(server, conn, FRAME_HANDLE, SERVER_HANDLE, strlen(SERVER_HANDLE));
+      conn->state = CONN_CHAT;
+      joinRoom(server, conn, DEFAULT_ROOM);
+      return;
+
+    case CONN_CHAT:
+      if (strncmp(text, GOODBYE, strlen(GOODBYE)) == 0) {
+        closeConn(server, conn);
+        return;
+      }
+
+      // \history [count] and \since <unix time>
+      if (strncmp(text, HISTORY_COMMAND, strlen(HISTORY_COMMAND)) == 0) {
+        long count = strtol(text + strlen(HISTORY_COMMAND), NULL, 10);
+        replayHistory(server, conn, count > 0 ? (size_t)count : server->replayCount, -1);
+        return;
+      }
+      if (strncmp(text, SINCE_COMMAND " ", strlen(SINCE_COMMAND) + 1) == 0) {
+        long long since = strtoll(text + strlen(SINCE_COMMAND) + 1, NULL, 10);
+        replayHistory(server, conn, MAX_REPLAY, since > 0 ? since * 1000000000LL : 0);
+        return;
+      }
+
+      // \join <room>
+      if (strncmp(text, JOIN_COMMAND " ", strlen(JOIN_COMMAND) + 1) == 0) {
+        char room[MAX_ROOM_LENGTH + 1];
+        char* name = text + strlen(JOIN_COMMAND) + 1;
+        for (i = 0; i < MAX_ROOM_LENGTH && name[i] > ' '; i++) {
+          room[i] = name[i];
+        }
+        room[i] = '\0';
+        if (i > 0) {
+          joinRoom(server, conn, room);
+        }
+        return;
+      }
+
+      if (length > MAX_MESSAGE_LENGTH) {
+        length = MAX_MESSAGE_LENGTH;
+      }
+      if (length == 0 || conn->room == NULL) {
+        return;
+      }
+      if (text[length - 1] != '\n') {
+        text[length++] = '\n';
+      }
+
+      // "handle: message", stored once and shared by every recipient
+      {
+        char relay[MAX_HANDLE_LENGTH + 2 + MAX_LINE_LENGTH + 1];
+        int prefix = snprintf(relay, sizeof(relay), "%s: ", conn->handle);
+        struct chatMessage* msg;
+        memcpy(relay + prefix, text, length);
+        msg = newMessage(FRAME_TEXT, relay, prefix + length);
+        if (msg != NULL && server->log != NULL) {
+          logAppend(server->log, conn->room->name, msg->frame, FRAME_HEADER_LENGTH + msg->length);
+        }
+        broadcast(server, conn->room, conn, msg);
+      }
+      return;
+  }
+}
+
+static unsigned int hashRoom(const char* name) {
+  unsigned int hash = 5381;
+  while (*name) {
+    hash = hash * 33 + (unsigned char)*name++;
+  }
+  return hash % ROOM_BUCKETS;
+}
+
+// joinRoom(struct chatServer* server, struct chatConn* conn, const char* name)
+// Moves conn into the named room, creating it if needed
+
+void joinRoom(struct chatServer* server, struct chatConn* conn, const char* name) {
+
+  unsigned int bucket = hashRoom(name);
+  struct chatRoom* room;
+  char notice[MAX_HANDLE_LENGTH + MAX_ROOM_LENGTH + 32];
+  int length;
+
+  leaveRoom(server, conn);
+
+  for (room = server->rooms[bucket]; room != NULL; room = room->next) {
+    if (strcmp(room->name, name) == 0) {
+      break;
+    }
+  }
+  if (room == NULL) {
+    if ((room = calloc(1, sizeof(struct chatRoom))) == NULL) {
+      return;
+    }
+    snprintf(room->name, sizeof(room->name), "%s", name);
+    room->next = server->rooms[bucket];
+    server->rooms[bucket] = room;
+  }
+
+  conn->room = room;
+  conn->roomPrev = NULL;
+  conn->roomNext = room->members;
+  if (room->members != NULL) {
+    room->members->roomPrev = conn;
+  }
+  room->members = conn;
+  room->numMembers++;
+
+  // Catch up on what was said before announcing ourselves
+  replayHistory(server, conn, server->replayCount, -1);
+
+  // A version 1 client can't tell the notice from the handle reply just
+  // before it, so only framed clients get their own
+  length = snprintf(notice, sizeof(notice), "* %s has joined %s\n", conn->handle, room->name);
+  broadcast(server, room, conn, newMessage(FRAME_TEXT, notice, length));
+  if (conn->version >= CHAT_VERSION) {
+    queueText(server, conn, FRAME_TEXT, notice, length);
+  }
+}
+
+// leaveRoom(struct chatServer* server, struct chatConn* conn)
+// Takes conn out of its room, freeing the room if it's now empty
+// Returns 1 if the room is still there, 0 if it was freed or conn wasn't in one
+
+int leaveRoom(struct chatServer* server, struct chatConn* conn) {
+
+  struct chatRoom* room = conn->room;
+  struct chatRoom** link;
+
+  if (room == NULL) {
+    return 0;
+  }
+
+  if (conn->roomPrev != NULL) {
+    conn->roomPrev->roomNext = conn->roomNext;
+  } else {
+    room->members = conn->roomNext;
+  }
+  if (conn->roomNext != NULL) {
+    conn->roomNext->roomPrev = conn->roomPrev;
+  }
+  conn->room = NULL;
+  conn->roomPrev = conn->roomNext = NULL;
+
+  if (--room->numMembers == 0) {
+    for (link = &server->rooms[hashRoom(room->name)]; *link != NULL; link = &(*link)->next) {
+      if (*link == room) {
+        *link = room->next;
+        break;
+      }
+    }
+    free(room);
+    return 0;
+  }
+  return 1;
+}
+
+// newMessage(int type, const char* data, size_t length)
+// Allocates a shareable message, frame header included.  The caller's
+// reference is handed to broadcast()/enqueue(), which drop it when every
+// recipient is done.
+
+struct chatMessage* newMessage(int type, const char* data, size_t length) {
+
+  struct chatMessage* msg;
+
+  if (length > MAX_FRAME_PAYLOAD) {
+    length = MAX_FRAME_PAYLOAD;
+  }
+  if ((msg = malloc(sizeof(struct chatMessage) + FRAME_HEADER_LENGTH + length)) == NULL) {
+    return NULL;
+  }
+  msg->refs = 1;
+  msg->type = type;
+  msg->length = length;
+  msg->frame = msg->data;
+  msg->segment = NULL;
+  frameEncodeHeader((unsigned char*)msg->data, type, length);
+  memcpy(msg->data + FRAME_HEADER_LENGTH, data, length);
+  return msg;
+}
+
+// historyMessage(struct logEntry* entry)
+// Wraps a logged frame without copying it; the message keeps its segment mapped
+
+struct chatMessage* historyMessage(struct logEntry* entry) {
+
+  struct chatMessage* msg = malloc(sizeof(struct chatMessage));
+
+  if (msg == NULL) {
+    return NULL;
+  }
+  msg->refs = 1;
+  msg->type = (unsigned char)entry->frame[2];
+  msg->length = entry->length - FRAME_HEADER_LENGTH;
+  msg->frame = entry->frame;
+  msg->segment = entry->segment;
+  logHold(entry->segment);
+  return msg;
+}
+
+// replayHistory(struct chatServer* server, struct chatConn* conn, size_t count, int64_t since)
+// Queues conn's room's last count messages (or those since a time, in ns)
+// The burst is trimmed, oldest first, to half the client's queue cap so
+// catching up can't get it disconnected.
+
+void replayHistory(struct chatServer* server, struct chatConn* conn, size_t count, int64_t since) {
+
+  struct logEntry entries[MAX_REPLAY];
+  size_t found, first, bytes = 0;
+
+  if (server->log == NULL || conn->room == NULL) {
+    return;
+  }
+  found = logReplay(server->log, conn->room->name, count, since, entries, MAX_REPLAY);
+
+  for (first = found; first > 0; first--) {
+    size_t length = entries[first - 1].length - (conn->version < CHAT_VERSION ? FRAME_HEADER_LENGTH : 0);
+    if (conn->outBytes + bytes + length > server->queueBytes / 2) {
+      break;
+    }
+    bytes += length;
+  }
+
+  for (; first < found && conn->fd != -1; first++) {
+    struct chatMessage* msg = historyMessage(&entries[first]);
+    if (msg != NULL) {
+      enqueue(server, conn, msg);
+      releaseMessage(msg);
+    }
+  }
+}
+
+// wireBytes(struct chatConn* conn, struct chatMessage* msg, char** data, size_t* length)
+// What msg looks like on conn's wire: the whole frame for version 2,
+// just the payload for version 1 (and for raw handshake replies)
+
+void wireBytes(struct chatConn* conn, struct chatMessage* msg, char** data, size_t* length) {
+
+  if (msg->type == FRAME_RAW || conn->version < CHAT_VERSION) {
+    *data = msg->frame + FRAME_HEADER_LENGTH;
+    *length = msg->length;
+  } else {
+    *data = msg->frame;
+    *length = FRAME_HEADER_LENGTH + msg->length;
+  }
+}
+
+void releaseMessage(struct chatMessage* msg) {
+  if (msg != NULL && --msg->refs == 0) {
+    logRelease(msg->segment);
+    free(msg);
+  }
+}
+
+// broadcast(struct chatServer* server, struct chatRoom* room, struct chatConn* sender, struct chatMessage* msg)
+// Queues msg for everyone in room except sender, then drops the caller's reference
+// Members it would put over their cap are closed once the walk is done:
+// closing one changes the room (and broadcasts its part notice), which
+// mustn't happen under the loop.
+
+void broadcast(struct chatServer* server, struct chatRoom* room, struct chatConn* sender, struct chatMessage* msg) {
+
+  struct chatConn* member;
+  struct chatConn* drop = NULL;
+  char* data;
+  size_t length;
+
+  if (msg == NULL) {
+    return;
+  }
+  for (member = room ? room->members : NULL; member != NULL; member = member->roomNext) {
+    if (member == sender || member->dropping || member->fd == -1) {
+      continue;
+    }
+    wireBytes(member, msg, &data, &length);
+    if (member->outBytes + length > server->queueBytes) {
+      member->dropping = 1;
+      member->nextDrop = drop;
+      drop = member;
+      continue;
+    }
+    enqueue(server, member, msg);
+  }
+  releaseMessage(msg);
+
+  while ((member = drop) != NULL) {
+    drop = member->nextDrop;
+    if (DEBUG) {
+      printf("broadcast() - client %d fell too far behind, dropping\n", member->fd);
+    }
+    closeConn(server, member);
+  }
+}
+
+// queueText(struct chatServer* server, struct chatConn* conn, int type, const char* data, size_t length)
+// Queues a one-off reply (handshake, notices) for a single client
+
+int queueText(struct chatServer* server, struct chatConn* conn, int type, const char* data, size_t length) {
+
+  struct chatMessage* msg = newMessage(type, data, length);
+  int result;
+
+  if (msg == NULL) {
+    return -1;
+  }
+  result = enqueue(server, conn, msg);
+  releaseMessage(msg);
+  return result;
+}
+
+// enqueue(struct chatServer* server, struct chatConn* conn, struct chatMessage* msg)
+// Adds a reference to msg to conn's outbound queue and schedules a flush
+// Returns 0 on success, -1 if conn was over its cap and has been dropped
+
+int enqueue(struct chatServer* server, struct chatConn* conn, struct chatMessage* msg) {
+
+  struct outItem* item;
+  char* data;
+  size_t length;
+
+  if (conn->fd == -1) {
+    return -1;
+  }
+  wireBytes(conn, msg, &data, &length);
+  if (conn->outBytes + length > server->queueBytes) {
+    if (DEBUG) {
+      printf("enqueue() - client %d fell too far behind, dropping\n", conn->fd);
+    }
+    closeConn(server, conn);
+    return -1;
+  }
+
+  if ((item = server->freeItems) != NULL) {
+    server->freeItems = item->next;
+  } else if ((item = malloc(sizeof(struct outItem))) == NULL) {
+    return -1;
+  }
+  msg->refs++;
+  item->msg = msg;
+  item->next = NULL;
+  if (conn->outTail != NULL) {
+    conn->outTail->next = item;
+  } else {
+    conn->outHead = item;
+  }
+  conn->outTail = item;
+  conn->outBytes += length;
+
+  if (!conn->dirty) {
+    conn->dirty = 1;
+    conn->nextDirty = server->dirtyList;
+    server->dirtyList = conn;
+  }
+  return 0;
+}
+
+// flushConn(struct chatServer* server, struct chatConn* conn)
+// Writes as much of conn's queue as the socket takes, MAX_BATCH_IOV messages per writev()
+// Arms EPOLLOUT if anything is left over
+// Returns 0 on success, -1 if the connection failed
+
+int flushConn(struct chatServer* server, struct chatConn* conn) {
+
+  struct iovec iov[MAX_BATCH_IOV];
+  struct epoll_event ev;
+
+  while (conn->outHead != NULL) {
+
+    struct outItem* item = conn->outHead;
+    int count = 0;
+    char* data;
+    size_t length;
+
+    wireBytes(conn, item->msg, &data, &length);
+    iov[0].iov_base = data + conn->headOffset;
+    iov[0].iov_len = length - conn->headOffset;
+    for (item = item->next, count = 1; item != NULL && count < MAX_BATCH_IOV; item = item->next, count++) {
+      wireBytes(conn, item->msg, &data, &length);
+      iov[count].iov_base = data;
+      iov[count].iov_len = length;
+    }
+
+    ssize_t written = writev(conn->fd, iov, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+
+    // Retire every message that went out completely
+    conn->outBytes -= written;
+    while (written > 0) {
+      item = conn->outHead;
+      wireBytes(conn, item->msg, &data, &length);
+      size_t remaining = length - conn->headOffset;
+      if ((size_t)written < remaining) {
+        conn->headOffset += written;
+        break;
+      }
+      written -= remaining;
+      conn->headOffset = 0;
+      conn->outHead = item->next;
+      if (conn->outHead == NULL) {
+        conn->outTail = NULL;
+      }
+      releaseMessage(item->msg);
+      item->next = server->freeItems;
+      server->freeItems = item;
+    }
+  }
+
+  // Only wake for writability while there's something to write
+  int wantWritable = conn->outHead != NULL;
+  if (wantWritable != conn->writable) {
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | (wantWritable ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->writable = wantWritable;
+  }
+  return 0;
+}
+
+// flushDirty(struct chatServer* server)
+// Flushes every connection that got output (or became writable) this pass
+
+void flushDirty(struct chatServer* server) {
+
+  while (server->dirtyList != NULL) {
+    struct chatConn* conn = server->dirtyList;
+    server->dirtyList = conn->nextDirty;
+    conn->dirty = 0;
+
+    if (conn->fd == -1) {
+      // Closed while it was on the list; free it with the rest
+      conn->nextDirty = gClosed;
+      gClosed = conn;
+      continue;
+    }
+    if (flushConn(server, conn) == -1) {
+      closeConn(server, conn);
+    }
+  }
+}
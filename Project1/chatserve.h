@@ -0,0 +1,122 @@
+#ifndef CHATSERVE_H_ /* Include Guard */
+#define CHATSERVE_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "chatframe.h"
+#include "chatlog.h"
+
+#define MAX_HANDLE_LENGTH 11        // Handles are up to 10 chars, same as chatclient
+#define MAX_MESSAGE_LENGTH 500      // Longest chat line we relay
+#define MAX_LINE_LENGTH 512         // Longest unframed (version 1) line
+#define CONN_BUFFER_LENGTH (FRAME_HEADER_LENGTH + MAX_FRAME_PAYLOAD) // Per-connection receive buffer
+#define MAX_ROOM_LENGTH 32          // Longest room name
+#define DEFAULT_ROOM "lobby"
+#define SERVER_HANDLE "ChatServer"
+#define HANDSHAKE "HELLO"           // Version 1 handshake; HELLO_V2 offers framing
+#define GOODBYE "\\quit"
+#define JOIN_COMMAND "\\join"
+#define HISTORY_COMMAND "\\history"  // \history [count]
+#define SINCE_COMMAND "\\since"      // \since <unix time>
+
+#define DEFAULT_MAX_CLIENTS 16384   // Connections accepted before new ones are turned away
+#define DEFAULT_QUEUE_BYTES 65536   // Outbound bytes a client may fall behind by before it's dropped
+#define MAX_EVENTS 256              // epoll_wait() batch size
+#define MAX_BATCH_IOV 64            // Queued messages per writev()
+#define ROOM_BUCKETS 1024           // Room hash table size
+#define DEFAULT_REPLAY 20           // History replayed on joining a room
+#define MAX_REPLAY 1024             // Most history replayed at once
+
+#define CONN_HELLO 0                // Waiting for the client's HELLO
+#define CONN_HANDLE 1               // Waiting for the client's handle
+#define CONN_CHAT 2                 // Chatting
+
+// One relayed line, shared by every recipient's queue
+// frame is a frame header followed by the payload: version 2 clients get
+// the whole thing, version 1 clients just the payload.  It points at data,
+// or for replayed history, into the log segment the message holds open.
+struct chatMessage {
+  int refs;
+  int type;                         // FRAME_*
+  size_t length;                    // Payload length
+  char* frame;
+  struct logSegment* segment;
+  char data[];
+};
+
+// One entry in a connection's outbound queue
+struct outItem {
+  struct chatMessage* msg;
+  struct outItem* next;
+};
+
+struct chatRoom;
+
+struct chatConn {
+  int fd;
+  int state;                        // CONN_*
+  int version;                      // Protocol version from the handshake
+  int dirty;                        // On the flush list for this loop pass
+  int writable;                     // EPOLLOUT is armed
+  int dropping;                     // Over its cap in a broadcast, to be closed after it
+  char handle[MAX_HANDLE_LENGTH];
+  struct chatRoom* room;
+  struct chatConn* roomPrev;        // Room membership list
+  struct chatConn* roomNext;
+  struct chatConn* nextDirty;       // Flush list
+  struct chatConn* nextDrop;        // broadcast()'s drop list
+  char inBuf[CONN_BUFFER_LENGTH];   // Bytes of an unfinished line or frame
+  size_t inLength;
+  struct outItem* outHead;          // Outbound queue
+  struct outItem* outTail;
+  size_t headOffset;                // Bytes of outHead already written
+  size_t outBytes;                  // Bytes queued, for the per-client cap
+};
+
+struct chatRoom {
+  char name[MAX_ROOM_LENGTH + 1];
+  struct chatConn* members;
+  int numMembers;
+  struct chatRoom* next;            // Hash chain
+};
+
+// Server-wide state
+struct chatServer {
+  int listenFd;
+  int epollFd;
+  int numClients;
+  int maxClients;
+  size_t queueBytes;
+  struct chatRoom* rooms[ROOM_BUCKETS];
+  struct chatConn* dirtyList;
+  struct outItem* freeItems;        // Recycled queue entries
+  struct chatLog* log;              // Message history, or NULL
+  size_t replayCount;               // Messages replayed on join
+};
+
+int parseCommandlineArgs(int argc, char* argv[], struct chatServer* server);
+int openListener(const char* port);
+void raiseFileLimit(void);
+void runServer(struct chatServer* server);
+
+void acceptClients(struct chatServer* server);
+void closeConn(struct chatServer* server, struct chatConn* conn);
+void handleReadable(struct chatServer* server, struct chatConn* conn);
+void handleFrames(struct chatServer* server, struct chatConn* conn);
+void handleLine(struct chatServer* server, struct chatConn* conn, char* line, size_t length);
+void handleLines(struct chatServer* server, struct chatConn* conn);
+void joinRoom(struct chatServer* server, struct chatConn* conn, const char* name);
+int leaveRoom(struct chatServer* server, struct chatConn* conn);
+
+struct chatMessage* newMessage(int type, const char* data, size_t length);
+struct chatMessage* historyMessage(struct logEntry* entry);
+void replayHistory(struct chatServer* server, struct chatConn* conn, size_t count, int64_t since);
+void releaseMessage(struct chatMessage* msg);
+void broadcast(struct chatServer* server, struct chatRoom* room, struct chatConn* sender, struct chatMessage* msg);
+int enqueue(struct chatServer* server, struct chatConn* conn, struct chatMessage* msg);
+int flushConn(struct chatServer* server, struct chatConn* conn);
+void flushDirty(struct chatServer* server);
+int queueText(struct chatServer* server, struct chatConn* conn, int type, const char* data, size_t length);
+void wireBytes(struct chatConn* conn, struct chatMessage* msg, char** data, size_t* length);
+
+#endif // CHATSERVE_H_
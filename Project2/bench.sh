@@ -0,0 +1,79 @@
+#!/bin/sh
+# bench.sh
+# Project 2
+# cs372_400_w2017
+# Jeromie Clark <clarkje@oregonstate.edu>
+#
+# Localhost throughput of one big -g with client/ftclient, in each mode:
+#   plain   cleartext, sendfile()
+#   ktls    TLS handed to the kernel, so it's still sendfile()
+#   tls     TLS in user space (ftserver -U)
+# If the kernel won't take the TLS sessions (no "tls" module), the ktls run
+# says so and falls back to user space like the tls one.
+#
+# Usage: ./bench.sh [<size_mb>] [<runs>] [<port>]
+
+SIZE_MB=${1:-512}
+RUNS=${2:-3}
+PORT=${3:-12900}
+DATA_PORT=$((PORT + 1))
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/ftbench.XXXXXX)
+SERVER_PID=
+
+cleanup() {
+  [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+make -s -C "$HERE" || exit 1
+
+# A throwaway certificate for localhost, and a file with no holes to send
+mkdir -p "$WORK/root" "$WORK/out"
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 \
+  -subj /CN=localhost -addext subjectAltName=DNS:localhost \
+  -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null || exit 1
+head -c $((SIZE_MB << 20)) /dev/urandom > "$WORK/root/bench.bin"
+
+# run <mode> <ftserver options> <ftclient options>
+run() {
+  mode=$1
+  "$HERE/ftserver" $2 -r "$WORK/root" "$PORT" > "$WORK/server.log" 2>&1 &
+  SERVER_PID=$!
+  while ! grep -q "listening for connections" "$WORK/server.log"; do
+    kill -0 "$SERVER_PID" 2>/dev/null || { cat "$WORK/server.log"; exit 1; }
+    sleep 0.1
+  done
+
+  best=0
+  total=0
+  run=0
+  while [ $run -lt "$RUNS" ]; do
+    rm -f "$WORK/out/bench.bin"
+    start=$(date +%s%N)
+    "$HERE/client/ftclient" $3 -o "$WORK/out/bench.bin" localhost "$PORT" -g bench.bin "$DATA_PORT" > /dev/null || exit 1
+    end=$(date +%s%N)
+    cmp -s "$WORK/root/bench.bin" "$WORK/out/bench.bin" || { echo "$mode: the copy doesn't match"; exit 1; }
+    rate=$(( SIZE_MB * 1000000 / ((end - start) / 1000 + 1) ))
+    [ $rate -gt $best ] && best=$rate
+    total=$((total + rate))
+    run=$((run + 1))
+  done
+
+  note=
+  if [ "$mode" = ktls ] && ! grep -q "kernel TLS" "$WORK/server.log"; then
+    note=" (kernel TLS unavailable: user space)"
+  fi
+  printf "%-6s %6d MB/s best %6d MB/s mean%s\n" "$mode" "$best" $((total / RUNS)) "$note"
+
+  kill "$SERVER_PID"
+  wait "$SERVER_PID" 2>/dev/null
+  SERVER_PID=
+}
+
+echo "$SIZE_MB MB, $RUNS runs each, localhost"
+run plain "" ""
+run ktls "-C $WORK/cert.pem -K $WORK/key.pem" "-S $WORK/cert.pem"
+run tls "-U -C $WORK/cert.pem -K $WORK/key.pem" "-S $WORK/cert.pem"
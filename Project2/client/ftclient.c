@@ -0,0 +1,870 @@
+/**
+* ftclient.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Native ftclient for big -g fetches
+* ftclient.py holds the whole file in memory and decides it's done when the
+* data connection goes quiet.  This one doesn't:
+* - Data goes from the socket to the file with splice(), through a pipe,
+*   without passing through user space.  Where splice() can't be used it
+*   falls back to one reusable COPY_BUFFER.  Memory use is the same for a
+*   1KB file and a 100GB one.
+* - It asks for SPARSE transfers, so holes stay holes (see streamSparse() in
+*   ../transfer.c).  Each data extent is preallocated with fallocate() just
+*   before it's written.
+* - -n <streams> splits the file into ranges fetched by parallel sessions
+*   ("-g <path> SPARSE RANGE <start> <length>"), one forked process each.
+*   Each writes its range straight into place with positioned writes.
+* - The fetch goes to <output>.part.  <output>.part.state records how much of
+*   each range is on disk (checkpointed every PROGRESS_EVERY bytes, after
+*   fdatasync()).  Run the same command again after an interruption and it
+*   picks up where each range left off.  That only happens while the server's
+*   size and mtime still match; otherwise it starts over.
+* - -S <ca_file> talks TLS to a server started with -C/-K, and checks its
+*   certificate against ca_file.  Data is read through OpenSSL then, unless
+*   the kernel decrypts it (kTLS receive), in which case splice() still works.
+* - -L <socket> fetches from a server on the same host through its Unix
+*   socket (ftserver -L).  The server hands over the open file, which is
+*   copied into place with copy_file_range(), data extents only; on
+*   filesystems that can share blocks nothing is copied at all.
+*
+* Usage: ftclient [-n <streams>] [-o <output>] [-S <ca_file>] <SERVER_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>
+*        ftclient [-o <output>] -L <socket> -g <FILENAME>
+*/
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "ftclient.h"
+#include "netconnect.h"
+#include "tls.h"
+
+#define DATA_ACCEPT_TIMEOUT_MS 10000    // How long we wait for the server to connect back
+
+static int gPipe[2] = { -1, -1 };       // splice() pipe, made on first use
+static int gSplice = 1;                 // Cleared if splice() turns out not to work here
+static char* gBuffer = NULL;            // COPY_BUFFER for when it doesn't
+
+static double secondsSince(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ftclient [-n <streams>] [-o <output>] [-S <ca_file>] <SERVER_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>\n");
+  fprintf(stderr, "       ftclient [-o <output>] -L <socket> -g <FILENAME>\n");
+  exit(2);
+}
+
+int main(int argc, char* argv[]) {
+
+  struct fetchTarget target;
+  struct stateRange ranges[MAX_STREAMS];
+  struct stateHeader header;
+  struct timespec started;
+  pid_t pids[MAX_STREAMS];
+  char partName[4096], stateName[4096];
+  int64_t size, mtime, already = 0;
+  int streams = 1, numRanges, fileFd, stateFd, opt, i, failed = 0, changed = 0;
+  double seconds;
+
+  memset(&target, 0, sizeof target);
+
+  // "+" stops at the first operand, so the -g among them isn't taken for an
+  // option.  With -L there are no operands, and -g is one.
+  while ((opt = getopt(argc, argv, "+g:L:n:o:S:")) != -1) {
+    switch (opt) {
+      case 'g':
+        target.path = optarg;
+        break;
+      case 'L':
+        target.localPath = optarg;
+        break;
+      case 'n':
+        streams = atoi(optarg);
+        if (streams < 1 || streams > MAX_STREAMS) {
+          fprintf(stderr, "ftclient: -n must be between 1 and %d\n", MAX_STREAMS);
+          exit(2);
+        }
+        break;
+      case 'o':
+        target.output = optarg;
+        break;
+      case 'S':
+        if (tlsInit(TLS_CLIENT, NULL, NULL, optarg, 1) == -1) {
+          exit(1);
+        }
+        break;
+      default:
+        usage();
+    }
+  }
+  if (target.localPath != NULL) {
+    if (argc - optind != 0 || target.path == NULL) {
+      usage();
+    }
+  } else if (target.path != NULL || argc - optind != 5 || strcmp(argv[optind + 2], "-g") != 0) {
+    usage();
+  } else {
+    target.host = argv[optind];
+    target.port = argv[optind + 1];
+    target.path = argv[optind + 3];
+    target.dataPort = atoi(argv[optind + 4]);
+  }
+  if (target.localPath == NULL && (target.dataPort < 1 || target.dataPort + streams - 1 > 65535)) {
+    fprintf(stderr, "ftclient: bad data port %s\n", argv[optind + 4]);
+    exit(2);
+  }
+  if (target.output == NULL) {
+    char* copy = strdup(target.path);
+    target.output = strdup(basename(copy));
+    free(copy);
+  }
+  snprintf(partName, sizeof partName, "%s.part", target.output);
+  snprintf(stateName, sizeof stateName, "%s.part.state", target.output);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // Same host: the server hands us the file itself
+  if (target.localPath != NULL) {
+    exit(fetchLocal(&target, partName));
+  }
+
+  // One round trip for the size and mtime, with no data connection
+  if (probeFile(&target, &size, &mtime) == -1) {
+    exit(1);
+  }
+
+  if ((fileFd = open(partName, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1 ||
+      (stateFd = open(stateName, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+    perror("ftclient: open");
+    exit(1);
+  }
+  // Two runs writing the same .part would tear each other's ranges
+  if (flock(stateFd, LOCK_EX | LOCK_NB) == -1) {
+    fprintf(stderr, "ftclient: another ftclient is already fetching %s\n", target.output);
+    exit(1);
+  }
+
+  numRanges = loadState(stateFd, size, mtime, ranges);
+  if (numRanges > 0) {
+    for (i = 0; i < numRanges; i++) {
+      already += ranges[i].done;
+    }
+    printf("Resuming %s: %lld of %lld bytes already here\n", target.output, (long long)already, (long long)size);
+  } else {
+    // Start over.  Setting the size first leaves every unwritten byte a hole.
+    numRanges = splitRanges(size, streams, ranges);
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, STATE_MAGIC, sizeof header.magic);
+    header.size = size;
+    header.mtime = mtime;
+    header.numRanges = numRanges;
+    if (ftruncate(fileFd, 0) == -1 || ftruncate(fileFd, size) == -1 ||
+        ftruncate(stateFd, 0) == -1 ||
+        pwrite(stateFd, &header, sizeof header, 0) != sizeof header ||
+        pwrite(stateFd, ranges, numRanges * sizeof(struct stateRange), sizeof header) !=
+          (ssize_t)(numRanges * sizeof(struct stateRange))) {
+      perror("ftclient: preparing output");
+      exit(1);
+    }
+    printf("Fetching %s (%lld bytes) over %d stream%s\n", target.path, (long long)size,
+           numRanges, numRanges == 1 ? "" : "s");
+  }
+
+  // One process per unfinished range
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  for (i = 0; i < numRanges; i++) {
+    pids[i] = -1;
+    if (ranges[i].done >= ranges[i].end - ranges[i].start) {
+      continue;
+    }
+    if ((pids[i] = fork()) == 0) {
+      // CHILD PROCESS BEGIN
+      exit(fetchRange(&target, i, &ranges[i], fileFd, stateFd, size, mtime));
+      // CHILD PROCESS END
+    }
+    if (pids[i] == -1) {
+      perror("ftclient: fork");
+      failed = 1;
+    }
+  }
+
+  for (i = 0; i < numRanges; i++) {
+    int status;
+    if (pids[i] <= 0) {
+      continue;
+    }
+    while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = 1;
+      changed |= WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CHANGED;
+    }
+  }
+  seconds = secondsSince(&started);
+
+  if (failed) {
+    if (changed) {
+      unlink(stateName);
+      fprintf(stderr, "ftclient: %s changed on the server during the fetch; run again to start over\n", target.path);
+    } else {
+      fprintf(stderr, "ftclient: fetch incomplete; run the same command again to resume\n");
+    }
+    exit(1);
+  }
+
+  // Everything's on disk: give it the server's mtime and its real name
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_NOW;
+  times[1].tv_sec = mtime;
+  times[1].tv_nsec = 0;
+  if (futimens(fileFd, times) == -1 || fsync(fileFd) == -1 || rename(partName, target.output) == -1) {
+    perror("ftclient: finishing output");
+    exit(1);
+  }
+  close(fileFd);
+  close(stateFd);
+  unlink(stateName);
+
+  printf("Received %s: %lld bytes in %.2fs (%.1f MB/s)\n", target.output,
+         (long long)(size - already), seconds,
+         seconds > 0 ? (size - already) / seconds / 1e6 : 0.0);
+  return 0;
+}
+
+/*
+* Connects to the server and waits for its HELLO
+* If listenFd isn't NULL, also opens the listener for dataPort, in the same
+* address family as the control connection (that's where the server connects back to)
+* Returns the control socket, or -1 on error
+*/
+
+int openSession(struct fetchTarget* target, int dataPort, int* listenFd) {
+
+  struct addrinfo hints, *servinfo;
+  struct sockaddr_storage local;
+  socklen_t localLength = sizeof local;
+  char hello[HELLO_LENGTH];
+  int status, fd;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((status = getaddrinfo(target->host, target->port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "ftclient: %s: %s\n", target->host, gai_strerror(status));
+    return -1;
+  }
+  fd = connectFirst(servinfo, CONNECT_TIMEOUT_MS);
+  freeaddrinfo(servinfo);
+  if (fd == -1) {
+    perror("ftclient: connect failed");
+    return -1;
+  }
+  if (tlsStart(fd, target->host) == -1) {
+    fprintf(stderr, "ftclient: TLS handshake with %s failed\n", target->host);
+    close(fd);
+    return -1;
+  }
+
+  if (recvAll(fd, hello, HELLO_LENGTH) != HELLO_LENGTH || memcmp(hello, "HELLO", HELLO_LENGTH) != 0) {
+    fprintf(stderr, "ftclient: no HELLO from the server\n");
+    netClose(fd);
+    return -1;
+  }
+
+  if (listenFd != NULL) {
+    int yes = 1, no = 0;
+
+    getsockname(fd, (struct sockaddr*)&local, &localLength);
+    if (local.ss_family == AF_INET6) {
+      struct sockaddr_in6* addr = (struct sockaddr_in6*)&local;
+      addr->sin6_addr = in6addr_any;
+      addr->sin6_port = htons(dataPort);
+    } else {
+      struct sockaddr_in* addr = (struct sockaddr_in*)&local;
+      addr->sin_addr.s_addr = htonl(INADDR_ANY);
+      addr->sin_port = htons(dataPort);
+    }
+    *listenFd = socket(local.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (*listenFd != -1) {
+      setsockopt(*listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+      if (local.ss_family == AF_INET6) {
+        setsockopt(*listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no);
+      }
+    }
+    if (*listenFd == -1 || bind(*listenFd, (struct sockaddr*)&local, localLength) == -1 ||
+        listen(*listenFd, 1) == -1) {
+      fprintf(stderr, "ftclient: can't listen on data port %d: %s\n", dataPort, strerror(errno));
+      if (*listenFd != -1) {
+        close(*listenFd);
+      }
+      netClose(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/*
+* Reads one control reply: up to a newline, or until the server closes
+* (ERROR_FILE_NOT_FOUND has no newline).  The newline is dropped.
+* Returns the reply's length, or -1 on error
+*/
+
+int readReply(int fd, char* reply, size_t len) {
+
+  size_t used = 0;
+
+  while (used < len - 1) {
+    ssize_t got = netRecv(fd, reply + used, 1, 0);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got < 1 || reply[used] == '\n') {
+      break;
+    }
+    used++;
+  }
+  reply[used] = '\0';
+  return used > 0 ? (int)used : -1;
+}
+
+/*
+* Asks for an empty range of the file, which gets its size and mtime back
+* without the server ever opening a data connection
+* Returns 0 on success, -1 on error
+*/
+
+int probeFile(struct fetchTarget* target, int64_t* size, int64_t* mtime) {
+
+  char command[4352], reply[REPLY_LENGTH];
+  long long replySize, replyMtime;
+  int fd;
+
+  if ((fd = openSession(target, target->dataPort, NULL)) == -1) {
+    return -1;
+  }
+  snprintf(command, sizeof command, "DATA_PORT %d ON_DEMAND\n-g %s RANGE 0 0\n", target->dataPort, target->path);
+  if (netSend(fd, command, strlen(command), 0) == -1 || readReply(fd, reply, sizeof reply) == -1) {
+    fprintf(stderr, "ftclient: lost the server\n");
+    netClose(fd);
+    return -1;
+  }
+  netSend(fd, "EXIT", 4, MSG_NOSIGNAL);
+  netClose(fd);
+
+  if (sscanf(reply, "OK %lld %lld", &replySize, &replyMtime) != 2) {
+    if (strstr(reply, "ERROR_FILE_NOT_FOUND") != NULL) {
+      fprintf(stderr, "ftclient: %s could not be found on the server\n", target->path);
+    } else {
+      fprintf(stderr, "ftclient: unexpected reply \"%s\"\n", reply);
+    }
+    return -1;
+  }
+  *size = replySize;
+  *mtime = replyMtime;
+  return 0;
+}
+
+/*
+* Reads the ranges from a state file left by an interrupted fetch
+* Returns how many there are, or 0 if there's no usable state for a file of
+* this size and mtime (so the fetch starts over)
+*/
+
+int loadState(int stateFd, int64_t size, int64_t mtime, struct stateRange* ranges) {
+
+  struct stateHeader header;
+  int i;
+
+  if (pread(stateFd, &header, sizeof header, 0) != sizeof header ||
+      memcmp(header.magic, STATE_MAGIC, sizeof header.magic) != 0 ||
+      header.size != size || header.mtime != mtime ||
+      header.numRanges < 1 || header.numRanges > MAX_STREAMS) {
+    return 0;
+  }
+  if (pread(stateFd, ranges, header.numRanges * sizeof(struct stateRange), sizeof header) !=
+      (ssize_t)(header.numRanges * sizeof(struct stateRange))) {
+    return 0;
+  }
+  for (i = 0; i < (int)header.numRanges; i++) {
+    if (ranges[i].start < 0 || ranges[i].end > size || ranges[i].start > ranges[i].end ||
+        ranges[i].done < 0 || ranges[i].done > ranges[i].end - ranges[i].start) {
+      return 0;
+    }
+  }
+  return header.numRanges;
+}
+
+/*
+* Splits [0, size) into at most streams ranges of at least MIN_STREAM_BYTES,
+* with boundaries on RANGE_ALIGN
+* Returns how many ranges there are (always at least one)
+*/
+
+int splitRanges(int64_t size, int streams, struct stateRange* ranges) {
+
+  int64_t share, start = 0;
+  int i;
+
+  if (size / MIN_STREAM_BYTES < streams) {
+    streams = size / MIN_STREAM_BYTES > 0 ? size / MIN_STREAM_BYTES : 1;
+  }
+  share = (size / streams + RANGE_ALIGN - 1) / RANGE_ALIGN * RANGE_ALIGN;
+
+  for (i = 0; i < streams; i++) {
+    ranges[i].start = start;
+    ranges[i].end = (i == streams - 1 || start + share > size) ? size : start + share;
+    ranges[i].done = 0;
+    start = ranges[i].end;
+  }
+  return streams;
+}
+
+/*
+* Fetches what's left of one range, in its own session, straight into place
+* Returns 0 on success, EXIT_CHANGED if the server's file isn't the one the
+* fetch started on, 1 on any other error
+*/
+
+int fetchRange(struct fetchTarget* target, int index, struct stateRange* range,
+               int fileFd, int stateFd, int64_t size, int64_t mtime) {
+
+  char command[4352], reply[REPLY_LENGTH];
+  unsigned char header[EXTENT_HEADER_LENGTH];
+  long long replySize, replyMtime;
+  int64_t position = range->start + range->done;
+  int cmdFd, listenFd, dataFd;
+  struct pollfd pfd;
+
+  if ((cmdFd = openSession(target, target->dataPort + index, &listenFd)) == -1) {
+    return 1;
+  }
+  snprintf(command, sizeof command, "DATA_PORT %d ON_DEMAND\n-g %s SPARSE RANGE %lld %lld\n",
+           target->dataPort + index, target->path, (long long)position, (long long)(range->end - position));
+  if (netSend(cmdFd, command, strlen(command), 0) == -1 || readReply(cmdFd, reply, sizeof reply) == -1) {
+    fprintf(stderr, "ftclient: stream %d lost the server\n", index);
+    return 1;
+  }
+  if (sscanf(reply, "OK %lld %lld", &replySize, &replyMtime) != 2) {
+    fprintf(stderr, "ftclient: stream %d: unexpected reply \"%s\"\n", index, reply);
+    return 1;
+  }
+  if (replySize != size || replyMtime != mtime) {
+    return EXIT_CHANGED;
+  }
+
+  pfd.fd = listenFd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, DATA_ACCEPT_TIMEOUT_MS) < 1 || (dataFd = accept(listenFd, NULL, NULL)) == -1) {
+    fprintf(stderr, "ftclient: stream %d: the server never connected to data port %d\n",
+            index, target->dataPort + index);
+    return 1;
+  }
+  close(listenFd);
+  if (tlsStart(dataFd, target->host) == -1) {
+    fprintf(stderr, "ftclient: stream %d: TLS handshake on the data connection failed\n", index);
+    return 1;
+  }
+
+  // Extents arrive in order; whatever lies between them is a hole, already
+  // in place thanks to the ftruncate() when the fetch began
+  while (1) {
+    int64_t offset, length, chunk;
+
+    if (recvAll(dataFd, header, EXTENT_HEADER_LENGTH) != EXTENT_HEADER_LENGTH) {
+      fprintf(stderr, "ftclient: stream %d: transfer cut short\n", index);
+      return 1;
+    }
+    memcpy(&offset, header, 8);
+    memcpy(&length, header + 8, 8);
+    offset = be64toh(offset);
+    length = be64toh(length);
+
+    if (length == 0) {
+      if (offset != range->end) {
+        fprintf(stderr, "ftclient: stream %d: range ended early\n", index);
+        return 1;
+      }
+      break;
+    }
+    if (offset < position || length < 0 || offset + length > range->end) {
+      fprintf(stderr, "ftclient: stream %d: bad extent %lld+%lld\n", index, (long long)offset, (long long)length);
+      return 1;
+    }
+
+    fallocate(fileFd, FALLOC_FL_KEEP_SIZE, offset, length);
+
+    // Big extents are taken in PROGRESS_EVERY pieces, each checkpointed
+    for (chunk = 0; chunk < length; chunk += PROGRESS_EVERY) {
+      int64_t piece = length - chunk < PROGRESS_EVERY ? length - chunk : PROGRESS_EVERY;
+      if (receiveExtent(dataFd, fileFd, offset + chunk, piece) == -1) {
+        fprintf(stderr, "ftclient: stream %d: %s\n", index, errno ? strerror(errno) : "transfer cut short");
+        return 1;
+      }
+      position = offset + chunk + piece;
+      range->done = position - range->start;
+      saveProgress(fileFd, stateFd, index, range);
+    }
+  }
+
+  range->done = range->end - range->start;
+  saveProgress(fileFd, stateFd, index, range);
+  netClose(dataFd);
+  netSend(cmdFd, "EXIT", 4, MSG_NOSIGNAL);
+  netClose(cmdFd);
+  return 0;
+}
+
+/*
+* Moves length bytes from the data socket into the file at offset
+* With splice() the bytes go socket -> pipe -> file inside the kernel;
+* otherwise they go through the one COPY_BUFFER.  A TLS connection can only
+* be spliced while the kernel is decrypting it.
+* Returns 0 on success, -1 on error (errno 0 if the server hung up)
+*/
+
+int receiveExtent(int dataFd, int fileFd, int64_t offset, int64_t length) {
+
+  loff_t fileOffset = offset;
+
+  if (gSplice && gPipe[0] == -1) {
+    if (pipe2(gPipe, O_CLOEXEC) == -1) {
+      gSplice = 0;
+    } else {
+      fcntl(gPipe[1], F_SETPIPE_SZ, PIPE_BYTES);
+    }
+  }
+
+  while (length > 0 && gSplice && (!tlsEnabled() || tlsKernelRecv(dataFd))) {
+    size_t want = length < PIPE_BYTES ? (size_t)length : PIPE_BYTES;
+    ssize_t inPipe = splice(dataFd, NULL, gPipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (inPipe == -1 && errno == EINTR) {
+      continue;
+    }
+    if (inPipe == -1 && errno == EINVAL) {
+      gSplice = 0;          // Not on this kind of socket; the pipe's still empty
+      break;
+    }
+    if (inPipe < 1) {
+      errno = inPipe == 0 ? 0 : errno;
+      return -1;
+    }
+
+    while (inPipe > 0) {
+      ssize_t written = splice(gPipe[0], NULL, fileFd, &fileOffset, inPipe, SPLICE_F_MOVE);
+
+      if (written == -1 && errno == EINTR) {
+        continue;
+      }
+      if (written == -1 && errno == EINVAL) {
+        // This filesystem won't take splice(); empty the pipe by hand
+        if (gBuffer == NULL && (gBuffer = malloc(COPY_BUFFER)) == NULL) {
+          return -1;
+        }
+        written = read(gPipe[0], gBuffer, inPipe < COPY_BUFFER ? inPipe : COPY_BUFFER);
+        if (written < 1 || pwrite(fileFd, gBuffer, written, fileOffset) != written) {
+          return -1;
+        }
+        fileOffset += written;
+        gSplice = 0;
+      } else if (written < 1) {
+        return -1;
+      }
+      inPipe -= written;
+      length -= written;
+    }
+  }
+
+  // Without splice(): one reusable buffer, positioned writes
+  while (length > 0) {
+    ssize_t got, written;
+
+    if (gBuffer == NULL && (gBuffer = malloc(COPY_BUFFER)) == NULL) {
+      return -1;
+    }
+    got = netRecv(dataFd, gBuffer, length < COPY_BUFFER ? length : COPY_BUFFER, 0);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got < 1) {
+      errno = got == 0 ? 0 : errno;
+      return -1;
+    }
+    for (written = 0; written < got; ) {
+      ssize_t n = pwrite(fileFd, gBuffer + written, got - written, fileOffset);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n < 1) {
+        return -1;
+      }
+      written += n;
+      fileOffset += n;
+    }
+    length -= got;
+  }
+  return 0;
+}
+
+/*
+* Checkpoints a range: what it says is done must be on disk first
+* Returns 0 on success, -1 on error
+*/
+
+int saveProgress(int fileFd, int stateFd, int index, struct stateRange* range) {
+
+  if (fdatasync(fileFd) == -1) {
+    return -1;
+  }
+  if (pwrite(stateFd, range, sizeof(struct stateRange),
+             sizeof(struct stateHeader) + index * sizeof(struct stateRange)) != sizeof(struct stateRange)) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+* Reads exactly len bytes, unless the connection closes first
+* Returns the number of bytes read, or -1 on error
+*/
+
+ssize_t recvAll(int fd, void* buf, size_t len) {
+
+  size_t got = 0;
+
+  while (got < len) {
+    ssize_t n = netRecv(fd, (char*)buf + got, len - got, 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    got += n;
+  }
+  return got;
+}
+
+/*
+* Fetches target->path from a server on this host, through its Unix socket
+* One request, and the reply brings the open file with it.  Its data
+* extents are copied into partName, which then gets the server's mtime and
+* the output's name.  There's nothing to resume: it's one kernel-side copy.
+* Returns 0 on success, 1 on error
+*/
+
+int fetchLocal(struct fetchTarget* target, const char* partName) {
+
+  struct sockaddr_un addr;
+  struct timespec started, times[2];
+  char request[4352], reply[REPLY_LENGTH];
+  long long size, mtime;
+  off_t position = 0;
+  int fd, fromFd, toFd;
+  double seconds;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(target->localPath) >= sizeof addr.sun_path) {
+    fprintf(stderr, "ftclient: socket path too long: %s\n", target->localPath);
+    return 1;
+  }
+  strcpy(addr.sun_path, target->localPath);
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+      connect(fd, (struct sockaddr*)&addr, sizeof addr) == -1) {
+    fprintf(stderr, "ftclient: can't connect to %s: %s\n", target->localPath, strerror(errno));
+    return 1;
+  }
+  snprintf(request, sizeof request, "-g %s\n", target->path);
+  if (send(fd, request, strlen(request), MSG_NOSIGNAL) == -1 ||
+      (fromFd = receiveDescriptor(fd, reply, sizeof reply)) == -1) {
+    fprintf(stderr, "ftclient: lost the server\n");
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  if (sscanf(reply, "OK %lld %lld", &size, &mtime) != 2 || fromFd == -2) {
+    if (strstr(reply, "ERROR_FILE_NOT_FOUND") != NULL) {
+      fprintf(stderr, "ftclient: %s could not be found on the server\n", target->path);
+    } else {
+      fprintf(stderr, "ftclient: unexpected reply \"%s\"\n", reply);
+    }
+    if (fromFd >= 0) {
+      close(fromFd);
+    }
+    return 1;
+  }
+
+  // Setting the size first leaves the holes as holes
+  if ((toFd = open(partName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ||
+      ftruncate(toFd, size) == -1) {
+    perror("ftclient: preparing output");
+    return 1;
+  }
+  while (position < size) {
+    off_t dataStart = lseek(fromFd, position, SEEK_DATA);
+    off_t dataEnd;
+
+    if (dataStart == -1 && errno == ENXIO) {
+      break;                                // Nothing but hole from here on
+    }
+    if (dataStart == -1) {
+      dataStart = position;                 // No SEEK_DATA here: copy it all
+      dataEnd = size;
+    } else if ((dataEnd = lseek(fromFd, dataStart, SEEK_HOLE)) == -1 || dataEnd > size) {
+      dataEnd = size;
+    }
+    if (dataStart >= size) {
+      break;
+    }
+    if (copyRange(fromFd, toFd, dataStart, dataEnd - dataStart) == -1) {
+      fprintf(stderr, "ftclient: copying %s: %s\n", target->path,
+              errno ? strerror(errno) : "the file shrank on the server");
+      return 1;
+    }
+    position = dataEnd;
+  }
+  close(fromFd);
+  seconds = secondsSince(&started);
+
+  // Give it the server's mtime and its real name
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_NOW;
+  times[1].tv_sec = mtime;
+  times[1].tv_nsec = 0;
+  if (futimens(toFd, times) == -1 || fsync(toFd) == -1 || rename(partName, target->output) == -1) {
+    perror("ftclient: finishing output");
+    return 1;
+  }
+  close(toFd);
+
+  printf("Received %s: %lld bytes in %.2fs (%.1f MB/s, local)\n", target->output,
+         size, seconds, seconds > 0 ? size / seconds / 1e6 : 0.0);
+  return 0;
+}
+
+/*
+* Reads a local reply line, and the descriptor that may come with it
+* Returns the descriptor, -2 if the reply came without one, or -1 on error
+*/
+
+int receiveDescriptor(int fd, char* reply, size_t len) {
+
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  int received = -2;
+  ssize_t got;
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = reply;
+  iov.iov_len = len - 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  while ((got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+  if (got < 1) {
+    return -1;
+  }
+  reply[got] = '\0';
+  reply[strcspn(reply, "\n")] = '\0';
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return received;
+}
+
+/*
+* Copies length bytes at offset from one file to the same place in another
+* copy_file_range() keeps it in the kernel, and may share the blocks rather
+* than copy them.  Where it can't be used, COPY_BUFFER and positioned I/O.
+* Returns 0 on success, -1 on error (errno 0 if the source came up short)
+*/
+
+int copyRange(int fromFd, int toFd, int64_t offset, int64_t length) {
+
+  loff_t fromOffset = offset, toOffset = offset;
+
+  while (length > 0) {
+    ssize_t n = copy_file_range(fromFd, &fromOffset, toFd, &toOffset, length, 0);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+      break;
+    }
+    if (n < 1) {
+      errno = n == 0 ? 0 : errno;
+      return -1;
+    }
+    length -= n;
+  }
+
+  // Without copy_file_range(): through the one buffer
+  while (length > 0) {
+    ssize_t got, written;
+
+    if (gBuffer == NULL && (gBuffer = malloc(COPY_BUFFER)) == NULL) {
+      return -1;
+    }
+    got = pread(fromFd, gBuffer, length < COPY_BUFFER ? length : COPY_BUFFER, fromOffset);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got < 1) {
+      errno = got == 0 ? 0 : errno;
+      return -1;
+    }
+    for (written = 0; written < got; ) {
+      ssize_t n = pwrite(toFd, gBuffer + written, got - written, toOffset);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n < 1) {
+        return -1;
+      }
+      written += n;
+      toOffset += n;
+    }
+    fromOffset += got;
+    length -= got;
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef FTCLIENT_H_ /* Include Guard */
+#define FTCLIENT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAX_STREAMS 16                  // Parallel sessions one fetch may use
+#define MIN_STREAM_BYTES (16LL << 20)   // Files aren't split into ranges smaller than this
+#define RANGE_ALIGN (1LL << 20)         // Range boundaries fall on multiples of this
+#define PIPE_BYTES (1 << 20)            // splice() pipe size
+#define COPY_BUFFER (1 << 20)           // Buffer used where splice() can't be
+#define PROGRESS_EVERY (64LL << 20)     // Bytes between resume checkpoints
+#define REPLY_LENGTH 128                // Longest control reply we read
+#define HELLO_LENGTH 5
+#define EXTENT_HEADER_LENGTH 16         // u64 offset, u64 length before each extent
+#define STATE_MAGIC "FTPART1"
+#define EXIT_CHANGED 3                  // A stream found the file had changed on the server
+
+// What to fetch, and from where
+struct fetchTarget {
+  const char* host;
+  const char* port;
+  const char* path;                     // On the server
+  const char* output;                   // Local file
+  int dataPort;                         // Stream i listens on dataPort + i
+  const char* localPath;                // The server's Unix socket (-L), or NULL for TCP
+};
+
+// Header of <output>.part.state, which lets an interrupted fetch resume
+struct stateHeader {
+  char magic[8];
+  int64_t size;                         // The server's file, when the fetch began
+  int64_t mtime;
+  uint32_t numRanges;
+  uint32_t reserved;
+};
+
+// One stream's share of the file.  Its stream rewrites it as it goes.
+struct stateRange {
+  int64_t start;
+  int64_t end;
+  int64_t done;                         // Bytes from start that are safely on disk
+};
+
+int openSession(struct fetchTarget* target, int dataPort, int* listenFd);
+int readReply(int fd, char* reply, size_t len);
+int probeFile(struct fetchTarget* target, int64_t* size, int64_t* mtime);
+int loadState(int stateFd, int64_t size, int64_t mtime, struct stateRange* ranges);
+int splitRanges(int64_t size, int streams, struct stateRange* ranges);
+int fetchRange(struct fetchTarget* target, int index, struct stateRange* range,
+               int fileFd, int stateFd, int64_t size, int64_t mtime);
+int receiveExtent(int dataFd, int fileFd, int64_t offset, int64_t length);
+int saveProgress(int fileFd, int stateFd, int index, struct stateRange* range);
+ssize_t recvAll(int fd, void* buf, size_t len);
+int fetchLocal(struct fetchTarget* target, const char* partName);
+int receiveDescriptor(int fd, char* reply, size_t len);
+int copyRange(int fromFd, int toFd, int64_t offset, int64_t length);
+
+#endif // FTCLIENT_H_
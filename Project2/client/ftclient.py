@@ -8,21 +8,89 @@
 # ftserver and ftclient establish a TCP control connection on <SERVER_PORT>
 # ftclient sends -l or -g <FILENAME> on Control Port
 #
+# -S <CA_FILE>, before the other arguments, talks TLS to a server started with
+# -C/-K, on both connections, and checks its certificate against CA_FILE
+#
+# -L <SOCKET> <COMMAND> talks to a server on the same host through its Unix
+# socket (ftserver -L) instead: one request, answered on the same socket, no
+# HELLO or DATA_PORT.  Only listings (-l, -q) go this way from here; the file
+# itself comes back as a descriptor, which Python 2 can't receive, so -g is
+# client/ftclient -L.
+#
 
+import json
 import os
 import socket
+import ssl
 import struct
 import sys
 import threading
 import time
 
 MSGLEN = 65535          # Maximum message length
+VALIDATOR_FILE = ".ftvalidators"    # What -u remembers about the files it fetched
+TRACE_FILE = "ftserver-trace.json"  # Where -T dump saves the server's trace
+SYNC_FILE = ".ftsync"               # What -m knows about the mirror it keeps
+TLS_CA = None                       # -S: the CA file to check the server against, or None for cleartext
+LOCAL_SOCKET = None                 # -L: the server's Unix socket, for same-host requests
+
+# The server's hash functions (validator.c, merkle.c), so we can work out
+# the Merkle hash of our own copy
+MASK64 = (1 << 64) - 1
+HASH_PRIME1 = 0x9E3779B97F4A7C15
+HASH_PRIME2 = 0x87C37B91114253D5
+MERKLE_SEED = 0x4D45524B4C455452
+
+def rotl64(x, r):
+    return ((x << r) | (x >> (64 - r))) & MASK64
+
+def hashWord(hash, word):
+    hash ^= (rotl64((word * HASH_PRIME1) & MASK64, 31) * HASH_PRIME2) & MASK64
+    return (rotl64(hash, 27) * 5 + 0x52dce729) & MASK64
+
+def hashWords(hash, data):
+    data += "\0" * (-len(data) % 8)
+    for word in struct.unpack("<{0}Q".format(len(data) // 8), data):
+        hash = hashWord(hash, word)
+    return hash
+
+def hashFinish(hash):
+    hash ^= hash >> 33
+    hash = (hash * 0xff51afd7ed558ccd) & MASK64
+    hash ^= hash >> 33
+    hash = (hash * 0xc4ceb9fe1a85ec53) & MASK64
+    hash ^= hash >> 33
+    return hash
+
+# Hashes a directory from {name: (type, hash)} of its children
+def merkleDirHash(children):
+    hash = MERKLE_SEED ^ len(children)
+    for name in sorted(children):
+        kind, childHash = children[name]
+        hash = hashWords(hash, name)
+        hash = hashWord(hash, (len(name) << 8) | ord(kind))
+        hash = hashWord(hash, childHash)
+    return hashFinish(hash)
 
 class FTClient:
 
     mCmdSock = None
     mDataSock = None
     mDataConnection = None
+    mTLS = None
+
+    # Wraps a connection in TLS (with -S), as the client, whichever end connected
+    # ftserver is the TLS server on the data connection too
+    def wrapTLS(self, connection):
+        if (TLS_CA is None):
+            return connection
+        if (self.mTLS is None):
+            self.mTLS = ssl.SSLContext(ssl.PROTOCOL_SSLv23)
+            self.mTLS.options |= ssl.OP_NO_SSLv2 | ssl.OP_NO_SSLv3 | ssl.OP_NO_TLSv1 | ssl.OP_NO_TLSv1_1
+            self.mTLS.verify_mode = ssl.CERT_REQUIRED
+            self.mTLS.check_hostname = True
+            self.mTLS.load_verify_locations(TLS_CA)
+        return self.mTLS.wrap_socket(connection, server_hostname=SERVER_HOST)
 
     def promptForOverwrite(self):
         # http://sweetme.at/2014/01/22/how-to-get-user-input-from-the-command-line-in-a-python-script/
@@ -34,13 +102,16 @@ class FTClient:
         return 0
 
     # Requests a file from the remote server and writes it to disk
+    # The file may live in a subdirectory on the server; it is saved locally
+    # under its base name
     def getFile(self, filename):
 
         print("in getFile()")
+        localName = os.path.basename(filename)
 
         # Check to see if the specified filename exists
         # http://stackoverflow.com/questions/82831/how-do-i-check-whether-a-file-exists-using-python
-        if (os.path.isfile(filename)):
+        if (os.path.isfile(localName)):
             print("isFile")
 
             # file exists, negotiate overwrite
@@ -48,8 +119,8 @@ class FTClient:
                 print("Operation Cancelled.  Exiting")
                 sys.exit(0)
 
-        # ask the server to send us the file
-        self.mCmdSock.sendall("-g {0}".format(filename))
+        # ask the server to send us the file, holes left out
+        self.mCmdSock.sendall("-g {0} SPARSE\n".format(filename))
         time.sleep(1)
 
         response = self.mCmdSock.recv(32)
@@ -57,9 +128,10 @@ class FTClient:
 
         if ("OK" in response):
             # we're good to write/overwrite this file
-            with open(filename, 'w') as f:
-                print("Transferring File, Please Wait.")
-                f.write(self.receiveDataTimeout())
+            print("Transferring File, Please Wait.")
+            if (self.receiveSparse(localName) == -1):
+                print("Transfer cut short.  Exiting.")
+            else:
                 print("File received.  Exiting")
 
         elif ("ERROR_FILE_NOT_FOUND" in response):
@@ -69,19 +141,353 @@ class FTClient:
 
         return
 
+    # Reads exactly length bytes from connection, or fewer if it closes
+    def recvExactly(self, connection, length):
+        chunks = []
+        while length > 0:
+            data = connection.recv(min(length, 65536))
+            if not data:
+                break
+            chunks.append(data)
+            length -= len(data)
+        return ''.join(chunks)
+
+    # Writes a sparse transfer to path: extents of data, each after a
+    # big-endian (offset, length) header, ended by a header with length 0
+    # whose offset is the file's size.  Skipping over the gaps and setting
+    # the size with truncate() leaves the holes as holes.
+    # The server closes the data connection after the last header, so there's
+    # no need to wait out a timeout.
+    # Returns the file's size, or -1 if the transfer was cut short
+    def receiveSparse(self, path):
+        connection = self.acceptData()
+        connection.setblocking(1)
+        with open(path, 'wb') as f:
+            while 1:
+                header = self.recvExactly(connection, 16)
+                if (len(header) < 16):
+                    return -1
+                offset, length = struct.unpack(">QQ", header)
+                if (length == 0):
+                    f.truncate(offset)
+                    return offset
+                f.seek(offset)
+                while length > 0:
+                    data = connection.recv(min(length, 1 << 20))
+                    if not data:
+                        return -1
+                    f.write(data)
+                    length -= len(data)
+
+    # Reads one newline-terminated reply from the control connection
+    def readReply(self):
+        reply = ''
+        while ('\n' not in reply and len(reply) < 256):
+            data = self.mCmdSock.recv(256)
+            if not data:
+                break
+            reply += data
+        return reply.split('\n')[0].rstrip('\0')
+
+    # Fetches a file only if it differs from the local copy
+    # The server is told what we hold: the content hash it gave us last time,
+    # if the local copy hasn't been touched since, or else the copy's size and
+    # mtime.  An unchanged file costs one round trip and no data connection.
+    def updateFile(self, filename):
+
+        localName = os.path.basename(filename)
+        validators = {}
+        if (os.path.isfile(VALIDATOR_FILE)):
+            with open(VALIDATOR_FILE, 'r') as f:
+                validators = json.load(f)
+
+        condition = "-"
+        if (os.path.isfile(localName)):
+            st = os.stat(localName)
+            known = validators.get(localName)
+            if (known and known["hash"] != "-" and
+                    known["size"] == st.st_size and known["mtime"] == int(st.st_mtime)):
+                condition = known["hash"]
+            else:
+                condition = "{0} {1}".format(st.st_size, int(st.st_mtime))
+
+        self.mCmdSock.sendall("-g {0} SPARSE IF {1}\n".format(filename, condition))
+        response = self.readReply()
+        print("RESPONSE: {0}".format(response))
+
+        if (response == "NOT_MODIFIED"):
+            print("{0} is up to date.".format(localName))
+            return
+        if (not response.startswith("OK ")):
+            if ("ERROR_FILE_NOT_FOUND" in response):
+                print("The file could not be found on the server.  Exiting.")
+            else:
+                print("An error occurred. Exiting.")
+            return
+
+        ok, size, mtime, hash = response.split(" ")
+        size = int(size)
+        mtime = int(mtime)
+
+        print("Transferring File, Please Wait.")
+        received = self.receiveSparse(localName + ".part")
+        if (received != size):
+            os.remove(localName + ".part")
+            print("Transfer cut short.  Exiting.")
+            return
+        os.rename(localName + ".part", localName)
+
+        # Match the server's mtime so the size/mtime check works next time too
+        os.utime(localName, (time.time(), mtime))
+        validators[localName] = {"size": size, "mtime": mtime, "hash": hash}
+        with open(VALIDATOR_FILE, 'w') as f:
+            json.dump(validators, f)
+        print("File received.  Exiting")
+        return
+
+    # Loads SYNC_FILE and checks it against the disk
+    # Files that were deleted are forgotten, and files changed since we
+    # wrote them get hash 0, so the server sends them again.  Untracked
+    # files are left out altogether.
+    # Returns (manifest, children, hashes): children maps each directory
+    # to {name: (type, hash)}, and hashes has every directory's Merkle hash
+    def loadMirror(self):
+        manifest = {}
+        if (os.path.isfile(SYNC_FILE)):
+            with open(SYNC_FILE, 'r') as f:
+                for path, entry in json.load(f).items():
+                    manifest[path.encode("utf-8")] = entry
+
+        for path in sorted(manifest.keys()):
+            entry = manifest[path]
+            parent = os.path.dirname(path)
+            if (parent and manifest.get(parent, {}).get("type") != "d"):
+                del manifest[path]
+            elif (entry["type"] == "d"):
+                if (not os.path.isdir(path)):
+                    del manifest[path]
+            elif (not os.path.isfile(path)):
+                del manifest[path]
+            else:
+                st = os.stat(path)
+                if (st.st_size != entry["size"] or int(st.st_mtime) != entry["mtime"]):
+                    entry["hash"] = "0" * 16
+
+        children = {".": {}}
+        for path, entry in manifest.items():
+            if (entry["type"] == "d"):
+                children.setdefault(path, {})
+        for path, entry in manifest.items():
+            if (entry["type"] == "f"):
+                children[os.path.dirname(path) or "."][os.path.basename(path)] = ("f", int(entry["hash"], 16))
+
+        # Deepest directories first, so every child is hashed before its parent
+        hashes = {}
+        for path in sorted(children.keys(), key=lambda p: -p.count("/") - (p != ".")):
+            hashes[path] = merkleDirHash(children[path])
+            if (path != "."):
+                children[os.path.dirname(path) or "."][os.path.basename(path)] = ("d", hashes[path])
+        return manifest, children, hashes
+
+    # Mirrors the server's directory path into the current directory
+    # Both sides hash their copy as a Merkle tree.  If the roots match,
+    # that's one round trip.  Otherwise each round sends the server the
+    # entries of the directories that differ, a whole level at a time, and
+    # it answers with the subdirectories that still do.  Then it sends
+    # whatever differs, deletions included, on the data connection.
+    def mirror(self, path):
+        manifest, children, hashes = self.loadMirror()
+        rootHash = "{0:016x}".format(hashes["."]) if manifest else "-"
+
+        self.mCmdSock.sendall("SYNC {0} {1}\n".format(path, rootHash))
+        control = self.mCmdSock.makefile('rb')
+        response = control.readline().strip()
+        if (response == "SAME"):
+            print("{0} is up to date.".format(path))
+            return
+        if (response != "DIFFERS"):
+            if ("ERROR_FILE_NOT_FOUND" in response):
+                print("The directory could not be found on the server.  Exiting.")
+            elif ("ERROR_SYNC_DISABLED" in response):
+                print("The server wasn't started with -M.  Exiting.")
+            else:
+                print("An error occurred. Exiting.")
+            return
+
+        pending = ["."]
+        rounds = 1
+        while pending:
+            lines = [str(len(pending))]
+            for directory in pending:
+                entries = children.get(directory, {})
+                lines.append("{0} {1}".format(len(entries), directory))
+                for name in sorted(entries):
+                    lines.append("{0} {1:016x} {2}".format(entries[name][0], entries[name][1], name))
+            self.mCmdSock.sendall("\n".join(lines) + "\n")
+            count = control.readline()
+            if (not count.strip().isdigit()):
+                print("An error occurred. Exiting.")
+                return
+            pending = [control.readline().rstrip("\n") for i in range(int(count))]
+            rounds += 1
+
+        received, removed, total = self.receiveMirror(manifest)
+        with open(SYNC_FILE, 'w') as f:
+            json.dump(manifest, f)
+        if (received == -1):
+            print("Transfer cut short; run again to finish.")
+            return
+        print("{0} file(s) ({1} bytes) received, {2} removed, {3} round trip(s).".format(
+            received, total, removed, rounds))
+        return
+
+    # Applies the records SYNC sends (see merkle.c) to the current directory
+    # Returns (files received, paths removed, bytes), files -1 if cut short
+    def receiveMirror(self, manifest):
+        connection = self.acceptData()
+        connection.setblocking(1)
+        received = removed = total = 0
+        while 1:
+            kind = self.recvExactly(connection, 1)
+            if (kind == "e"):
+                return received, removed, total
+            header = self.recvExactly(connection, 2)
+            if (kind not in ("f", "d", "x") or len(header) < 2):
+                return -1, removed, total
+            path = self.recvExactly(connection, struct.unpack(">H", header)[0])
+            if (path.startswith("/") or ".." in path.split("/")):
+                return -1, removed, total
+
+            if (kind == "x"):
+                # Only what we put there ourselves, deepest first
+                for doomed in sorted([p for p in manifest if p == path or p.startswith(path + "/")], reverse=True):
+                    try:
+                        if (manifest[doomed]["type"] == "d"):
+                            os.rmdir(doomed)
+                        else:
+                            os.remove(doomed)
+                    except OSError:
+                        pass
+                    del manifest[doomed]
+                    removed += 1
+            elif (kind == "d"):
+                if (not os.path.isdir(path)):
+                    os.makedirs(path)
+                manifest[path] = {"type": "d"}
+            else:
+                fixed = self.recvExactly(connection, 24)
+                if (len(fixed) < 24):
+                    return -1, removed, total
+                size, mtime, hash = struct.unpack(">QqQ", fixed)
+                left = size
+                with open(path + ".part", 'wb') as f:
+                    while left > 0:
+                        data = connection.recv(min(left, 1 << 20))
+                        if not data:
+                            return -1, removed, total
+                        f.write(data)
+                        left -= len(data)
+                os.rename(path + ".part", path)
+                os.utime(path, (time.time(), mtime / 1e9))
+                manifest[path] = {"type": "f", "size": size, "mtime": int(os.stat(path).st_mtime),
+                                  "hash": "{0:016x}".format(hash)}
+                received += 1
+                total += size
+
+    # Switches the server's session tracing, or fetches what it has recorded
+    # args is "on [<every>]", "off" or "dump"; a dump is Chrome trace JSON,
+    # saved to TRACE_FILE for chrome://tracing or Perfetto
+    def traceCommand(self, args):
+        self.mCmdSock.sendall("-T {0}\n".format(args))
+        response = self.readReply()
+        if (response != "OK"):
+            print("The server rejected the trace command.")
+            return
+        if (args.strip() != "dump"):
+            print("Tracing {0}.".format(args.split()[0]))
+            return
+        connection = self.acceptData()
+        connection.setblocking(1)
+        with open(TRACE_FILE, 'w') as f:
+            while 1:
+                data = connection.recv(65536)
+                if not data:
+                    break
+                f.write(data)
+        print("Trace saved to {0}".format(TRACE_FILE))
+        return
+
     # Requests a directory listing from the remote server, then displays it
-    def getDirectoryListing(self):
-        self.mCmdSock.sendall("-l")
+    # command is -l (one directory) or -t (the whole subtree)
+    def getDirectoryListing(self, command="-l", path=""):
+        self.mCmdSock.sendall("{0} {1}\n".format(command, path))
         data = self.receiveDataTimeout(1)
         print("\n{0}".format(data))
         return
 
+    # Requests a filtered/sorted/paged listing and prints it
+    # query is "[<PATH>] [glob=..] [prefix=..] [sort=name|size|mtime] [order=asc|desc] [offset=N] [limit=N]"
+    # The response format is documented at the top of listing.c
+    def queryListing(self, query):
+        self.mCmdSock.sendall("-q {0}\n".format(query))
+        self.printListing(self.receiveDataTimeout(1))
+        return
+
+    # Sends one request over the server's Unix socket and returns the whole
+    # answer; the server closes the socket when it's done
+    def localRequest(self, request):
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        connection.connect(LOCAL_SOCKET)
+        connection.sendall(request + "\n")
+        chunks = []
+        while 1:
+            data = connection.recv(65536)
+            if not data:
+                break
+            chunks.append(data)
+        connection.close()
+        return ''.join(chunks)
+
+    # Prints a listing in the binary format documented at the top of listing.c
+    def printListing(self, data):
+        if (len(data) < 28 or data[0:4] != "FTLS"):
+            print("Malformed listing response.  Exiting.")
+            return
+        magic, version, status, reserved, total, offset, count = struct.unpack(">4sBBHQQI", data[0:28])
+        if (status == 1):
+            print("The directory could not be found on the server.")
+            return
+        if (status != 0):
+            print("The server rejected the query.")
+            return
+
+        pos = 28
+        for i in range(count):
+            size, mtime, kind, nameLen = struct.unpack(">QqcH", data[pos:pos + 19])
+            pos += 19
+            name = data[pos:pos + nameLen]
+            pos += nameLen
+            stamp = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(mtime / 1000000000))
+            print("{0}\t{1}\t{2}{3}".format(size, stamp, name, "/" if kind == "d" else ""))
+        print("({0}-{1} of {2})".format(offset + 1 if count else offset, offset + count, total))
+        return
+
+    # Waits for the server's data connection, the first time it's needed
+    # The server only connects once it has something to send
+    def acceptData(self):
+        if (self.mDataConnection is None):
+            print("Waiting for server connection on data port")
+            self.mDataConnection, serverAddress = self.mDataSock.accept()
+            self.mDataConnection = self.wrapTLS(self.mDataConnection)
+            print("Remote Server Connected on Data Port")
+        return self.mDataConnection
+
+    # Reads the data connection
     # Use a timeout to keep track of the end of the transmission.  Good enough for this.
     # http://code.activestate.com/recipes/408859-socketrecv-three-ways-to-turn-it-into-recvall/
     def receiveDataTimeout(self, timeout=2):
 
-        self.mDataConnection, serverAddress = self.mDataSock.accept()
-        self.mDataConnection.setblocking(0)
+        self.acceptData().setblocking(0)
         total_data=[]; data=''; begin=time.time()
         while 1:
             # if you get some data, then wait for a second and break
@@ -107,10 +513,10 @@ class FTClient:
     # References tutorial code at: https://pymotw.com/2/socket/tcp.html
     def startSession(self):
 
-        self.mCmdSock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        # create_connection() tries every address SERVER_HOST resolves to, IPv4 or IPv6
         client_address = (SERVER_HOST, int(SERVER_PORT))
         print("Conneting to {0} port {1}".format(SERVER_HOST, SERVER_PORT))
-        self.mCmdSock.connect(client_address)
+        self.mCmdSock = self.wrapTLS(socket.create_connection(client_address))
 
         # The server should begin the handshake, which starts with HELLO\0
         data_received = 0
@@ -123,34 +529,36 @@ class FTClient:
         if (data == "HELLO"):
             print("Server Handshake Received: {0}", data)
             data = None
-        # Open a listener on DATA_PORT
-        self.mDataSock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        # Open a listener on DATA_PORT.  The server connects back to the address
+        # this control connection came from, so listen on every address of the
+        # same family.
+        self.mDataSock = socket.socket(self.mCmdSock.family, socket.SOCK_STREAM)
+        self.mDataSock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
 
-        server_address = (socket.gethostname(), int(DATA_PORT))
-        #server_address = ('', int(DATA_PORT))
+        server_address = ('', int(DATA_PORT))
         self.mDataSock.bind(server_address)
         self.mDataSock.listen(5)
 
-        # Send DATA_PORT <DATA_PORT> to the server
+        # Send DATA_PORT <DATA_PORT> ON_DEMAND to the server.  It connects to
+        # the data port only when it has something to send (see acceptData()),
+        # so the command can follow straight away.  It ends at a newline.
         print("Sending DATA_PORT {0}".format(DATA_PORT))
-        self.mCmdSock.sendall("DATA_PORT {0}".format(DATA_PORT))
-
-        # Wait for server to connections
-        print("Waiting for server connection on data port")
-        self.mDataConnection, serverAddress = self.mDataSock.accept()
-
-        try:
-            # The server should begin the handshake, which starts with HELLO\0
-            print("Remote Server Connected on Data Port")
-
-        finally:
-            return
+        self.mCmdSock.sendall("DATA_PORT {0} ON_DEMAND\n".format(DATA_PORT))
+        return
 
     # Shows the Usage Instructions
 
     def showUsage(self):
-        print "usage:\nftclient.py <SERVER_HOST> <SERVER_PORT> -l <DATA_PORT>"
+        print "usage: (any of these may start with -S <CA_FILE>, for TLS)"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -l [<PATH>] <DATA_PORT>"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -t [<PATH>] <DATA_PORT>"
         print "ftclient.py <SERVER_HOST> <SERVER_PORT> -g <FILENAME> <DATA_PORT>"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -u <FILENAME> <DATA_PORT>"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -m <PATH> <DATA_PORT>"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -T \"on [<EVERY>]|off|dump\" <DATA_PORT>"
+        print "ftclient.py <SERVER_HOST> <SERVER_PORT> -q \"[<PATH>] [glob=..] [sort=..] [offset=..] [limit=..]\" <DATA_PORT>"
+        print "ftclient.py -L <SOCKET> -l [<PATH>]"
+        print "ftclient.py -L <SOCKET> -q \"[<PATH>] [glob=..] [sort=..] [offset=..] [limit=..]\""
         return
 
 if __name__ == '__main__':
@@ -159,8 +567,25 @@ if __name__ == '__main__':
     client = FTClient()
 
     # Validate Commandline Params
+    FILENAME = ""
+    if (len(sys.argv) > 2 and sys.argv[1] == "-S"):
+        TLS_CA = sys.argv[2]
+        del sys.argv[1:3]
+
+    # Same host: one request on the Unix socket, and we're done
+    if (len(sys.argv) > 2 and sys.argv[1] == "-L"):
+        LOCAL_SOCKET = sys.argv[2]
+        if (len(sys.argv) not in (4, 5) or sys.argv[3] not in ("-l", "-q", "-g")):
+            client.showUsage()
+            sys.exit(0)
+        if (sys.argv[3] == "-g"):
+            print("-g over the local socket hands over a file descriptor; use client/ftclient -L")
+            sys.exit(1)
+        argument = sys.argv[4] if len(sys.argv) == 5 else ""
+        client.printListing(client.localRequest("{0} {1}".format(sys.argv[3], argument)))
+        sys.exit(0)
     if (len(sys.argv) == 5):
-        if (sys.argv[3] != "-l"):
+        if (sys.argv[3] != "-l" and sys.argv[3] != "-t"):
             client.showUsage()
             sys.exit(0)
         else:
@@ -175,15 +600,28 @@ if __name__ == '__main__':
 
     client.startSession()
 
-    if (COMMAND == "-l"):
-        client.getDirectoryListing()
+    if (COMMAND == "-l" or COMMAND == "-t"):
+        client.getDirectoryListing(COMMAND, FILENAME)
+
+    if (COMMAND == "-q"):
+        client.queryListing(FILENAME)
 
     if (COMMAND == "-g"):
         client.getFile(FILENAME)
 
+    if (COMMAND == "-u"):
+        client.updateFile(FILENAME)
+
+    if (COMMAND == "-m"):
+        client.mirror(FILENAME)
+
+    if (COMMAND == "-T"):
+        client.traceCommand(FILENAME)
+
     # clean up
-    client.mDataConnection.shutdown(socket.SHUT_RDWR)
-    client.mDataConnection.close()
+    if (client.mDataConnection is not None):
+        client.mDataConnection.shutdown(socket.SHUT_RDWR)
+        client.mDataConnection.close()
     client.mDataSock.shutdown(socket.SHUT_RDWR)
     client.mDataSock.close()
     # tell the server we're done
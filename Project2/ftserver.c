@@ -21,14 +21,39 @@
 *            + sends appropriate error message
 *   + ftserver closes connection Q
 *   + ftserver runs until terminated by SIGINT
+*
+* Files are served from a root directory (-r, default ".") including all of
+* its subdirectories.  The tree is indexed into a path trie at startup and
+* re-indexed on SIGHUP; see pathtrie.c.
+*
+* With -s <path>, a new ftserver takes the listening socket over from the one
+* already running instead of binding its own, and the old one finishes its
+* sessions and exits; see handoff.c.
+*
+* Sessions can be traced phase by phase into shared ring buffers and dumped
+* as Chrome trace JSON: -x, SIGUSR1 (on/off), SIGUSR2 (dump), "-T"; see trace.c.
+*
+* With -M the index also carries a Merkle tree of content hashes, and "SYNC"
+* mirrors a directory by sending only what differs; see merkle.c.
+*
+* Sessions take their buffers from a pool shared by all of them, within a
+* budget (-b) that also decides when new sessions are admitted; see pool.c.
+*
+* With -C and -K, the control and data connections are TLS, offloaded to the
+* kernel where it can so files still go out with sendfile(); see tls.c.
+*
+* With -L <path>, clients on the same host can also connect to a Unix socket
+* at path, and are handed the open file instead of its contents; see local.c.
 */
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,15 +64,36 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include "ftserver.h"
+#include "handoff.h"
+#include "listing.h"
+#include "local.h"
+#include "merkle.h"
+#include "netconnect.h"
+#include "pathtrie.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "tls.h"
+#include "trace.h"
+#include "transfer.h"
+#include "validator.h"
 
 #define MIN_DATA_PORT 20201     // The first port number we'll try to bind to when creating a listener for file data
 #define MAX_PORT_LENGTH 6       // The number of digits we'll take in the commandline port parameter
-#define MAX_FILENAME_LENGTH 255 // Maximum length accepted for a filename
-#define MAX_COMMAND_LENGTH 256  // Maximum length accepted for client-side command
-#define MAX_DIR_LENGTH 65536    // Maximum length accepted for directory listings
+#define MAX_FILENAME_LENGTH 4096 // Maximum length accepted for a (relative) path
+#define MAX_COMMAND_LENGTH 4352 // Maximum length accepted for client-side command
+#define MAX_DIR_LENGTH 65536    // Size of the buffer directory listings are streamed through
 #define BACKLOG 10              // Number of pending connections the queue will hold
+#define DATA_CONNECT_TIMEOUT_MS 5000 // How long the client gets to accept the data connection
 #define DEBUG 1                // Print debug messages
 
+static struct pathTrie gTrie;             // Index of the served tree, shared with children via fork()
+static volatile sig_atomic_t gReindex = 0; // Set by SIGHUP, consumed by the accept loop
+static int gHandoffFd = -1;               // Where a successor asks for our listener (-s)
+static int gLocalFd = -1;                 // Listener for same-host clients (-L)
+static volatile sig_atomic_t gTraceDump = 0; // Set by SIGUSR2, consumed by the accept loop
+static const char* gTraceFile = TRACE_DEFAULT_FILE;
+static int gMerkle = 0;                   // Keep the Merkle tree for SYNC (-M)
+
 int main ( int argc, char *argv[]) {
 
   // Disable buffering on stdout for more reliable printf debugging
@@ -55,8 +101,9 @@ int main ( int argc, char *argv[]) {
     setbuf(stdout, NULL);
   }
 
-  int portNum = 0;  // Port number to listen on
-  int commandSocketDescriptor = 0;    // Socket descriptor for the main "command" port
+  struct serverOptions opts;          // Parsed commandline options
+  int commandSocketDescriptor = -1;   // Socket descriptor for the main "command" port
+  int handoffControlFd = -1;          // Connection to the server we're replacing, if any
   int dataSocketDescriptor = 0;       // Socket descriptor for the data port
   struct sigaction sa;
 
@@ -65,8 +112,54 @@ int main ( int argc, char *argv[]) {
   if(DEBUG) {
     printf("Calling parseCommandlineArgs()\n");
   }
-  portNum = parseCommandlineArgs(argc, argv);
-  printf("Listening on Port: %d\n", portNum);
+  parseCommandlineArgs(argc, argv, &opts);
+  printf("Listening on Port: %d\n", opts.portNum);
+
+  // Index the served tree before we accept anything
+  if (pathTrieBuild(&gTrie, opts.rootPath) == -1 || buildListingIndexes(&gTrie) == -1) {
+    fprintf(stderr, "Unable to index root directory %s.  Exiting\n", opts.rootPath);
+    exit(EXIT_FAILURE);
+  }
+  printf("Serving %s (%zu entries)\n", opts.rootPath, gTrie.numNodes);
+
+  // Every session's I/O buffers come out of one shared, budgeted pool
+  if (poolInit(opts.poolBudget) == -1) {
+    fprintf(stderr, "Unable to map a %zu byte buffer pool.  Exiting\n", opts.poolBudget);
+    exit(EXIT_FAILURE);
+  }
+
+  // Every session's connections are TLS, with its bulk data sent by the kernel if it can
+  if (opts.certFile != NULL) {
+    if (tlsInit(TLS_SERVER, opts.certFile, opts.keyFile, NULL, opts.kernelTls) == -1) {
+      fprintf(stderr, "Unable to load the certificate and key.  Exiting\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("TLS on%s\n", opts.kernelTls ? ", kernel offload where available" : ", user space only");
+  }
+
+  // Shared popularity table and the background prefetcher that reads it
+  if (prefetchInit() == 0) {
+    prefetchStart(&gTrie, NULL, 0);
+  }
+
+  // Shared cache of content hashes for conditional -g
+  validatorInit();
+
+  // Hash the whole tree for SYNC.  Re-indexing only reads what changed.
+  gMerkle = opts.merkle;
+  if (gMerkle) {
+    if (merkleBuild(&gTrie, NULL) == -1) {
+      fprintf(stderr, "Unable to hash root directory %s.  Exiting\n", opts.rootPath);
+      exit(EXIT_FAILURE);
+    }
+    printf("Merkle root %016llx\n", (unsigned long long)gTrie.root->hash);
+  }
+
+  // Shared trace rings; off unless -x asked for them
+  if (traceInit() == 0 && opts.traceSample > 0) {
+    traceSetEnabled(1, opts.traceSample);
+  }
+  gTraceFile = opts.traceFile;
 
   // reap all dead processes that appear as fork()ed child proccesses exit
   // Beej's guide to network programming, pp. 29
@@ -78,17 +171,79 @@ int main ( int argc, char *argv[]) {
     exit(1);
   }
 
+  // SIGHUP re-indexes the tree.  No SA_RESTART, so accept() wakes up for it.
+  sa.sa_handler = sighup_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  if (sigaction(SIGHUP, &sa, NULL) == -1) {
+    perror("sigaction");
+    exit(1);
+  }
+
+  // SIGUSR1 switches tracing on and off; SIGUSR2 dumps it
+  sa.sa_handler = sigusr1_handler;
+  if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+    perror("sigaction");
+    exit(1);
+  }
+  sa.sa_handler = sigusr2_handler;
+  if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+    perror("sigaction");
+    exit(1);
+  }
+
   // Start listening on the supplied port
   if(DEBUG) {
-    printf("Calling openSocket(%d)\n",portNum);
+    printf("Calling openSocket(%d)\n", opts.portNum);
+  }
+
+  // If another ftserver is running with the same -s, take its listener over.
+  // It stops accepting only once we have it, so no connection is refused.
+  if (opts.handoffPath != NULL) {
+    int inherited[HANDOFF_MAX_FDS];
+    int numInherited = handoffRequest(opts.handoffPath, inherited, HANDOFF_MAX_FDS, &handoffControlFd);
+
+    if (numInherited == -1) {
+      printf("Unable to take over from the running server.  Exiting");
+      exit(EXIT_FAILURE);
+    }
+    if (numInherited > 0) {
+      printf("Took over the listener from the running server\n");
+      commandSocketDescriptor = inherited[0];
+    }
+    // The local socket comes second, if the old server had one
+    if (numInherited > 1 && opts.localPath != NULL) {
+      gLocalFd = inherited[1];
+    } else if (numInherited > 1) {
+      close(inherited[1]);
+    }
   }
 
   // Bind to the command port, get the resulting socket descriptor
-  commandSocketDescriptor = openSocket(portNum);
+  if (commandSocketDescriptor == -1) {
+    commandSocketDescriptor = openSocket(opts.portNum);
+  }
   if (commandSocketDescriptor == -1) {
     printf("Unable to bind to supplied socket.  Exiting");
     exit(EXIT_FAILURE);
   }
+  if (opts.localPath != NULL && gLocalFd == -1 && (gLocalFd = localListen(opts.localPath)) == -1) {
+    printf("Unable to listen on %s.  Exiting", opts.localPath);
+    exit(EXIT_FAILURE);
+  }
+  if (gLocalFd != -1) {
+    printf("Local clients on %s\n", opts.localPath);
+  }
+
+  // Be ready to hand it on in turn, then let the old server go
+  if (opts.handoffPath != NULL &&
+      (gHandoffFd = handoffListen(opts.handoffPath, handoffControlFd != -1)) == -1) {
+    printf("Unable to listen on %s.  Exiting", opts.handoffPath);
+    exit(EXIT_FAILURE);
+  }
+  if (handoffControlFd != -1) {
+    handoffConfirm(handoffControlFd);
+  }
 
   // Listen to the socket for commands
   listenForCommands(commandSocketDescriptor);
@@ -101,6 +256,53 @@ void sigchld_handler(int s) {
   errno = saved_errno;
 }
 
+void sighup_handler(int s) {
+  gReindex = 1;
+}
+
+void sigusr1_handler(int s) {
+  traceSetEnabled(!traceIsEnabled(), 0);
+}
+
+void sigusr2_handler(int s) {
+  gTraceDump = 1;
+}
+
+/*
+* Rebuilds the path trie after a SIGHUP
+* The old index keeps serving if the rebuild fails.  listeners are the
+* sockets we accept on, which the new prefetcher mustn't hold open.
+*/
+
+void reindexTree(const int* listeners, int numListeners) {
+
+  struct pathTrie fresh;
+  int inherited[HANDOFF_MAX_FDS + 1];
+  int numInherited = 0;
+
+  gReindex = 0;
+  if (pathTrieBuild(&fresh, gTrie.rootPath) == -1) {
+    fprintf(stderr, "reindexTree: rebuild failed, keeping previous index\n");
+    return;
+  }
+  if (buildListingIndexes(&fresh) == -1 || (gMerkle && merkleBuild(&fresh, &gTrie) == -1)) {
+    fprintf(stderr, "reindexTree: rebuild failed, keeping previous index\n");
+    pathTrieFree(&fresh);
+    return;
+  }
+  pathTrieFree(&gTrie);
+  gTrie = fresh;
+  printf("reindexTree: %zu entries\n", gTrie.numNodes);
+
+  // The prefetcher works from its own copy of the index; give it the new one
+  while (numInherited < numListeners && numInherited < HANDOFF_MAX_FDS) {
+    inherited[numInherited] = listeners[numInherited];
+    numInherited++;
+  }
+  inherited[numInherited++] = gHandoffFd;
+  prefetchStart(&gTrie, inherited, numInherited);
+}
+
 /*
 * listenForCommands(int socketFileDescriptor)
 * Listens for commands on the supplied socket file descriptor
@@ -110,11 +312,10 @@ void sigchld_handler(int s) {
 void listenForCommands(int socketFileDescriptor) {
 
   // Modeled on example in Beej's Guide to Network Programming, pp. 23
-  struct sockaddr_storage their_addr;
-  socklen_t addr_size;
-  int currentFd = -1;    // Socket descriptor for the current command connection
-  int dataFd = -1;       // Socket descriptor for the data connection
-  int status;
+  struct pollfd fds[3];  // The listener, the local socket and the handoff socket
+  int listeners[2];      // What a successor takes over: the port, then the local socket
+  int numListeners;
+  int status, i;
   if(DEBUG) {
     printf("listenForCommands: calling listen(%d)\n", socketFileDescriptor);
   }
@@ -127,395 +328,800 @@ void listenForCommands(int socketFileDescriptor) {
 
   printf("ftserver: listening for connections \n");
 
+  listeners[0] = socketFileDescriptor;
+  listeners[1] = gLocalFd;
+  numListeners = gLocalFd == -1 ? 1 : 2;
+
   while(1) { // main accept() loop
 
-    // Accept an incoming connection
-    addr_size = sizeof their_addr;
-    if(DEBUG) {
-      printf("listenForCommands: input loop - calling accept\n");
+    if (gReindex) {
+      reindexTree(listeners, numListeners);
     }
-    currentFd = accept(socketFileDescriptor, (struct sockaddr *)&their_addr, &addr_size);
-
-    // If accept returns an error, show it and exit
-    if(currentFd == -1 ) {
-      fprintf(stderr, "listenForCommands:accept: %s\n", gai_strerror(currentFd));
-      exit(EXIT_FAILURE);
+    if (gTraceDump) {
+      gTraceDump = 0;
+      printf("ftserver: dumped %d trace spans to %s\n", traceDumpFile(gTraceFile), gTraceFile);
     }
 
-    // CHILD PROCESS BEGIN
-    if (fork() == 0) {
+    // Out of memory for another session: leave clients in the backlog until
+    // running sessions give some back (or are found dead and reclaimed)
+    if (!poolAdmit() && (poolReclaim() == 0 || !poolAdmit())) {
+      fds[0].fd = gHandoffFd;
+      fds[0].events = POLLIN;
+      if (gHandoffFd != -1 && poll(fds, 1, POOL_WAIT_MS) == 1 &&
+          handoffServe(gHandoffFd, listeners, numListeners)) {
+        drainAndExit(socketFileDescriptor);
+      } else if (gHandoffFd == -1) {
+        poll(NULL, 0, POOL_WAIT_MS);
+      }
+      continue;
+    }
 
-      close(socketFileDescriptor); // child doesn't need the listener
+    // Wait for a client on either listener, or for a successor asking for
+    // them.  poll() skips the entries that are -1.
+    fds[0].fd = socketFileDescriptor;
+    fds[1].fd = gLocalFd;
+    fds[2].fd = gHandoffFd;
+    for (i = 0; i < 3; i++) {
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, 3, -1) == -1) {
+      continue;                 // EINTR: go around again to pick up a re-index
+    }
+    if (gHandoffFd != -1 && (fds[2].revents & POLLIN) &&
+        handoffServe(gHandoffFd, listeners, numListeners)) {
+      drainAndExit(socketFileDescriptor);
+    }
 
-      if(DEBUG) {
-        printf("listenForCommands: in child - sending\n");
+    // One session from each listener that has a client, so neither starves the other
+    for (i = 0; i < 2; i++) {
+      if (fds[i].fd != -1 && (fds[i].revents & POLLIN)) {
+        startSession(fds[i].fd, socketFileDescriptor, i == 1);
       }
-      // Handle commands
-      handleCommands(currentFd);
-      close(currentFd);
-      // Exit
-      exit(0);
     }
-    // CHILD PROCESS END
+  }
+  printf("listenForCommands - completed");
+  return;
+}
+
+/*
+* Accepts a client waiting on listenFd and forks a session for it
+* local says listenFd is the Unix socket (-L), whose clients skip the
+* HELLO/DATA_PORT exchange (see local.c)
+*/
+
+void startSession(int listenFd, int socketFileDescriptor, int local) {
+
+  // Modeled on example in Beej's Guide to Network Programming, pp. 23
+  struct sockaddr_storage their_addr;
+  socklen_t addr_size;
+  int currentFd = -1;    // Socket descriptor for the current command connection
+
+  // Accept an incoming connection
+  addr_size = sizeof their_addr;
+  if(DEBUG) {
+    printf("listenForCommands: input loop - calling accept\n");
+  }
+  currentFd = accept(listenFd, (struct sockaddr *)&their_addr, &addr_size);
+
+  // A signal interrupted accept().  Go around again to pick up a re-index.
+  if(currentFd == -1 && errno == EINTR) {
+    return;
+  }
+
+  // If accept returns an error, show it and exit
+  if(currentFd == -1 ) {
+    fprintf(stderr, "listenForCommands:accept: %s\n", gai_strerror(currentFd));
+    exit(EXIT_FAILURE);
+  }
+
+  // CHILD PROCESS BEGIN
+  if (fork() == 0) {
+
+    close(socketFileDescriptor); // child doesn't need the listeners
+    if (gLocalFd != -1) {
+      close(gLocalFd);
+    }
+    if (gHandoffFd != -1) {
+      close(gHandoffFd);
+    }
+
     if(DEBUG) {
-      printf("listenForCommands - returned to parent\n");
+      printf("listenForCommands: in child - sending\n");
+    }
+    // Handle commands, out of a pooled arena
+    struct poolArena arena;
+    if (arenaInit(&arena, SESSION_ARENA_BYTES) == -1) {
+      exit(EXIT_FAILURE);
     }
+    traceSessionBegin();
+    if (local) {
+      handleLocalCommands(currentFd, &gTrie, &arena);
+    } else {
+      handleCommands(currentFd, &arena);
+    }
+    traceSessionEnd();
+    arenaRelease(&arena);
+    netClose(currentFd);
+    // Exit
+    exit(0);
+  }
+  // CHILD PROCESS END
+  if(DEBUG) {
+    printf("listenForCommands - returned to parent\n");
+  }
 
   close(currentFd); // parent doesn't need this
+}
+
+/*
+* Stops accepting after a successor has taken the listener over
+* Sessions already running are separate processes; wait for all of them to
+* finish their transfers, then exit.  The successor owns the handoff path now,
+* so it's left alone.
+*/
+
+void drainAndExit(int socketFileDescriptor) {
+
+  close(socketFileDescriptor);
+  if (gLocalFd != -1) {
+    close(gLocalFd);
   }
-  printf("listenForCommands - completed");
-  return;
+  close(gHandoffFd);
+  prefetchStop();
+  printf("ftserver: handed off, draining sessions\n");
+
+  // sigchld_handler() may reap some of them first; either way we're done at ECHILD
+  while (waitpid(-1, NULL, 0) != -1 || errno != ECHILD);
+
+  printf("ftserver: drained, exiting\n");
+  exit(0);
 }
 
 /*
 * Negotiate a socket connection for data transfer on a client-supplied port
+* The client sends "DATA_PORT <port>", and we connect back to it right away.
+* A client that sends "DATA_PORT <port> ON_DEMAND\n" instead goes straight on
+* to its command, and is only connected to once there's something to send
+* (see openDataConnection()), so a NOT_MODIFIED or an error costs no data
+* connection.  The DATA_PORT line is read into command, and whatever of the
+* command arrived with it is moved to the front; readCommandLine() reads the
+* rest.
+* Returns the number of command bytes there, or -1 on error
 */
 // References examples in Beej's guide to network programming
-int establishDataConnection(int socketFd) {
+int establishDataConnection(int socketFd, struct dataEndpoint* data, char* command, size_t commandLen) {
 
   int numbytes;
-  socklen_t len;
-  struct sockaddr_storage addr;
-  struct addrinfo hints, *res, *p, *servinfo;
-
-  struct sockaddr_storage clientAddr;  // Client socket info
-  char inBuffer[MAX_COMMAND_LENGTH];   // Client Input Buffer
-  int port, rv;
-  char inPort[MAX_PORT_LENGTH];        // Client-supplied Port
-  char inAddr[INET_ADDRSTRLEN];        // Client-supplied Address
-  char ipStr[INET_ADDRSTRLEN];
-  int dataFd = -1;
+  int copied = 0;
+
+  char* inBuffer = command;            // Client Input Buffer
+  char* rest;
+  long port;
+
+  int64_t span = traceStart();
+
+  memset(data, 0, sizeof(struct dataEndpoint));
+  data->fd = -1;
+
+  if (tlsEnabled()) {
+    if (tlsStart(socketFd, NULL) == -1) {
+      return -1;
+    }
+    traceEnd("tls_handshake", span, 0);
+    span = traceStart();
+  }
 
   if (DEBUG) {
     printf("establishDataConnection():Sending HELLO\n");
   }
-  send(socketFd, "HELLO", 5, 0);
+  netSend(socketFd, "HELLO", 5, 0);
 
   // Beej's Guide to Network Programming, pp. 31
-  if ((numbytes = recv(socketFd, inBuffer, MAX_COMMAND_LENGTH-1, 0 ) == -1)) {
-    perror("establishDataConnection: recv() failed\n");
+  if ((numbytes = netRecv(socketFd, inBuffer, commandLen - 1, 0 )) == -1) {
+    perror("establishDataConnection: netRecv() failed\n");
     exit(EXIT_FAILURE);
   }
+  inBuffer[numbytes] = '\0';
+  traceEnd("hello", span, 0);
+  span = traceStart();
 
-  if (strncmp("DATA_PORT", inBuffer, 9) == 0) {
-
-    if(DEBUG) {
-      printf("establishDataConnection(): Handling DATA_PORT command\n");
-    }
+  if (strncmp("DATA_PORT", inBuffer, 9) != 0) {
+    return -1;
+  }
 
-    // Copy the characters after "_DATA_PORT" into the buffer for the filename
-    // Pass in a pointer to the 9th character in inBuffer
-    strncpy(inPort, &inBuffer[10], MAX_PORT_LENGTH);
+  if(DEBUG) {
+    printf("establishDataConnection(): Handling DATA_PORT command\n");
+  }
 
-    if (DEBUG) {
-      printf("inBuffer: %s inPort: %s\n", inBuffer, inPort);
+  // The port follows "DATA_PORT "; anything after it on the line is a flag
+  port = strtol(&inBuffer[9], &rest, 10);
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, "establishDataConnection: bad data port \"%s\"\n", &inBuffer[9]);
+    return -1;
+  }
+  if (strncmp(rest, " ON_DEMAND", 10) == 0) {
+    data->onDemand = 1;
+    if ((rest = strchr(rest, '\n')) != NULL) {
+      copied = numbytes - (rest + 1 - inBuffer);
+      memmove(command, rest + 1, copied);
     }
+  }
+  command[copied] = '\0';
 
-    // I get that this truncates the string wherever the non-alpha character arrives.
-    // It's good enough for now.
-    // TODO: improve the whitespace-in-front case...
-    // Inspriation from: http://stackoverflow.com/questions/16431858/removing-non-alpha-characters-in-c
+  // Get the client's address
+  // http://beej.us/guide/bgnet/output/html/multipage/mangetpeernameman.html
+  data->addrLen = sizeof data->addr;
+  if (getpeername(socketFd, (struct sockaddr*)&data->addr, &data->addrLen) == -1) {
+    perror("establishDataConnection: getpeername() failed");
+    return -1;
+  }
 
-    int i;
-    for (i = 0; i < sizeof(inPort); i++) {
-      if ((inPort[i] < '0' || inPort[i] > '9') && inPort[i] != '\0') {
-        inPort[i] = '\0';
-      }
-    }
+  // Reuse the control connection's address as-is (IPv4 or IPv6); only the
+  // port changes, so there's nothing to print and resolve again
+  if (data->addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*)&data->addr)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in*)&data->addr)->sin_port = htons(port);
+  }
 
-    if(DEBUG) {
-      printf("establishDataConnection(): Port string processed\n");
-    }
+  if (DEBUG) {
+    char ipStr[INET6_ADDRSTRLEN] = "";
+    getnameinfo((struct sockaddr*)&data->addr, data->addrLen, ipStr, sizeof ipStr, NULL, 0, NI_NUMERICHOST);
+    printf("Client Address: %s\n", ipStr);
+    printf("Data Port: %ld%s\n", port, data->onDemand ? " (on demand)" : "");
+  }
 
-    // Get the client's IP
-    // http://beej.us/guide/bgnet/output/html/multipage/mangetpeernameman.html
-    len = sizeof addr;
-    getpeername(socketFd, (struct sockaddr*)&addr, &len);
+  traceEnd("data_port", span, port);
 
-      // Cast the address struct to sockaddr_in so we can get the address
-      struct sockaddr_in *sfd = (struct sockaddr_in *) &addr;
-      port = ntohs(sfd->sin_port);
-      inet_ntop(AF_INET, &sfd->sin_addr, ipStr, sizeof ipStr);
+  if (!data->onDemand && openDataConnection(data) == -1) {
+    return -1;
+  }
+  return copied;
+}
 
-      if (DEBUG) {
-      // Use ntohs to make a sting, and print it.
-      printf("Client Address: %s\n", ipStr);
-      printf("Data Port: %s\n", inPort);
-    }
+/*
+* Connects to the client's data port, unless that's already been done
+* With TLS on, the handshake is done here too (ftserver is the TLS server)
+* Returns the data socket, or -1 on error
+*/
 
-    // http://beej.us/guide/bgnet/output/html/multipage/clientserver.html#simpleclient
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+int openDataConnection(struct dataEndpoint* data) {
 
-    if ((rv = getaddrinfo(ipStr, inPort, &hints, &res)) != 0) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-      return 1;
+  if (data->fd == -1) {
+    int64_t span = traceStart();
+    data->fd = connectAddress((struct sockaddr*)&data->addr, data->addrLen, DATA_CONNECT_TIMEOUT_MS);
+    if (data->fd == -1) {
+      perror("openDataConnection: connect() failed");
     }
+    traceEnd("data_connect", span, 0);
+
+    if (data->fd != -1 && tlsEnabled()) {
+      span = traceStart();
+      if (tlsStart(data->fd, NULL) == -1) {
+        close(data->fd);
+        data->fd = -1;
+      } else {
+        printf("Data connection: %s\n", tlsKernelSend(data->fd) ? "kernel TLS" : "user space TLS");
+      }
+      traceEnd("tls_handshake", span, tlsKernelSend(data->fd));
+    }
+  }
+  return data->fd;
+}
 
-    // loop through all the results and connect to the first we can
-    for(p = res; p != NULL; p = p->ai_next) {
-        if ((dataFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("client: socket");
-            continue;
-        }
+/*
+* Reads an ON_DEMAND command up to its newline
+* TCP may split it anywhere, so the have bytes already in command aren't
+* necessarily all of it.  The newline is dropped.
+* Returns the command's length, or -1 on error
+*/
 
-        if (connect(dataFd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(dataFd);
-            perror("client: connect");
-            continue;
-        }
-        break;
-    }
+static int readCommandLine(int socketFd, char* command, int have, size_t commandLen) {
 
-    if (p == NULL) {
-      printf("Client failed to connect\n");
+  char* end;
+  int numbytes;
+
+  while ((end = memchr(command, '\n', have)) == NULL && (size_t)have < commandLen - 1) {
+    if ((numbytes = netRecv(socketFd, command + have, commandLen - 1 - have, 0)) == -1) {
       return -1;
     }
-
-    // Connect to the client's data port
-    dataFd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    connect(dataFd, res->ai_addr, res->ai_addrlen);
-
-    // Cleanup struct since we're done
-    freeaddrinfo(res);
+    if (numbytes == 0) {
+      break;
+    }
+    have += numbytes;
+  }
+  if (end != NULL) {
+    have = end - command;
   }
-  return dataFd;
+  command[have] = '\0';
+  return have;
 }
 
 /*
 * Handles commands sent from client
+* Their buffers come from arena, which is reset once the command is done
 */
 
-void handleCommands(int socketFd) {
-
-  int listBytes;
+void handleCommands(int socketFd, struct poolArena* arena) {
 
   if(DEBUG) {
     printf("handleCommands() called\n");
   }
 
-  char dirString[MAX_DIR_LENGTH];     // directory listing output
-  char inBuffer[MAX_COMMAND_LENGTH];  // client command input
-  char inFile[MAX_FILENAME_LENGTH];   // max length for a filename
-  int dataFd;                         // descriptor for the data socket
+  char* inBuffer = arenaAlloc(arena, MAX_COMMAND_LENGTH);  // client command input
+  char* inFile = arenaAlloc(arena, MAX_FILENAME_LENGTH);   // requested path, relative to the served root
+  struct dataEndpoint data;           // the data connection, made now or on demand
   int numbytes = 0;
 
-  dataFd = establishDataConnection(socketFd);
-  if (dataFd == -1) {
-    printf("Unable to connect to data socket.  Exiting");
+  if (inBuffer == NULL || inFile == NULL) {
     exit(EXIT_FAILURE);
   }
 
   // Initialize the memory for our buffer
   memset(inBuffer, '\0', MAX_COMMAND_LENGTH);
 
-  // Beej's Guide to Network Programming, pp. 31
-  if ((numbytes = recv(socketFd, inBuffer, MAX_COMMAND_LENGTH-1, 0 ) == -1)) {
-    perror("handleCommands: recv() failed\n");
+  numbytes = establishDataConnection(socketFd, &data, inBuffer, MAX_COMMAND_LENGTH);
+  if (numbytes == -1) {
+    printf("Unable to connect to data socket.  Exiting");
     exit(EXIT_FAILURE);
   }
 
+  // Beej's Guide to Network Programming, pp. 31
+  if (data.onDemand) {
+    int64_t span = traceStart();
+    if ((numbytes = readCommandLine(socketFd, inBuffer, numbytes, MAX_COMMAND_LENGTH)) == -1) {
+      perror("handleCommands: netRecv() failed\n");
+      exit(EXIT_FAILURE);
+    }
+    traceEnd("command", span, numbytes);
+  } else if (numbytes == 0) {
+    int64_t span = traceStart();
+    if ((numbytes = netRecv(socketFd, inBuffer, MAX_COMMAND_LENGTH-1, 0 )) == -1) {
+      perror("handleCommands: netRecv() failed\n");
+      exit(EXIT_FAILURE);
+    }
+    inBuffer[numbytes] = '\0';
+    traceEnd("command", span, numbytes);
+  }
+
   if (DEBUG) {
     printf("handleCommands - Command Recieved: %s\n", inBuffer);
   }
 
-  // Handle the LIST command
-  // Returns a directory listing of the current working directory on the server
+  // Client Command: -l [path] / -t [path]
+  // -l lists one directory, -t lists the whole subtree beneath it
   // Using strncmp to minimize issues with line endings and junk data
-  if (strncmp("-l", inBuffer, 2) == 0) {
-    // Populate dirString with the contents of the current directory
-    getDirectoryListing(dirString, MAX_DIR_LENGTH-1);
-    if ((numbytes = send(dataFd, dirString, sizeof(dirString), 0)) <= 0) {
-      perror("handleCommands: send list failed \n");
-      exit(EXIT_FAILURE);
+  if (strncmp("-l", inBuffer, 2) == 0 || strncmp("-t", inBuffer, 2) == 0) {
+
+    struct pathNode* dir;
+    int64_t span;
+
+    parseCommandPath(&inBuffer[2], inFile, MAX_FILENAME_LENGTH);
+    if (openDataConnection(&data) == -1) {
+      // Nowhere to send it
+    } else if ((dir = pathTrieLookup(&gTrie, inFile)) == NULL) {
+      netSend(data.fd, "ERROR_FILE_NOT_FOUND\n", 21, 0);
+    } else {
+      span = traceStart();
+      getDirectoryListing(data.fd, dir, inBuffer[1] == 't');
+      traceEnd("listing", span, 0);
     }
-    // The client only performs one activity per session, so we can close this.
-    close(dataFd);
   }
 
-  // Client Command: -g <filename>
-  // Retrieve a file from the current working directory on the server
-  if (strncmp("-g", inBuffer, 2) == 0) {
+  // Client Command: -q [path] [glob=..] [prefix=..] [sort=..] [order=..] [offset=..] [limit=..]
+  // Filtered, sorted, paginated listing in the binary format described in listing.c
+  if (strncmp("-q", inBuffer, 2) == 0) {
 
-    if (DEBUG) {
-      printf("handleCommands - Command Recieved: %s\n", inBuffer);
+    struct listQuery query;
+    int64_t span;
+
+    if (openDataConnection(&data) == -1) {
+      // Nowhere to send it
+    } else if (parseListQuery(&inBuffer[2], &query) == -1) {
+      sendListingStatus(data.fd, LIST_STATUS_BAD_QUERY);
+    } else {
+      span = traceStart();
+      sendListing(data.fd, &gTrie, &query);
+      traceEnd("query", span, 0);
     }
+  }
 
-    // Copy the characters after "-g " into the buffer for the filename
-    // Pass in a pointer to the 5th character in inBuffer
-    strncpy(inFile, &inBuffer[3], MAX_FILENAME_LENGTH);
+  // Client Command: SYNC [<path>] <hash|->
+  // Mirrors a directory: a few rounds on this connection find what differs
+  // from the client's copy, then only that is sent (see merkle.c)
+  if (strncmp("SYNC", inBuffer, 4) == 0) {
+    handleSync(socketFd, &data, &gTrie, &inBuffer[4]);
+  }
 
-    // I get that this truncates the string wherever the non-alpha character arrives.
-    // It's good enough for now.
-    // TODO: improve the whitespace-in-front case...
-    // Inspriation from: http://stackoverflow.com/questions/16431858/removing-non-alpha-characters-in-c
+  // Client Command: -T on [<every>] | -T off | -T dump
+  // Switches tracing, or sends the trace rings as Chrome trace JSON (see trace.c)
+  if (strncmp("-T", inBuffer, 2) == 0) {
+    handleTraceCommand(socketFd, &data, &inBuffer[2]);
+  }
 
-    int i;
-    for (i = 0; i < sizeof(inFile); i++) {
-      if ((inFile[i] < 'A' || inFile[i] > 'z') && ( inFile[i] < '0' || inFile[i] > '9') && inFile[i] != '.' && inFile[i] != '\0') {
-        inFile[i] = '\0';
-      }
-    }
+  // Client Command: -g <path> [SPARSE] [RANGE <start> <length>] [IF <size> <mtime> | IF <hash> | IF -]
+  // Retrieve a file from anywhere beneath the served root, optionally only
+  // if it differs from the copy the client holds (see validator.c).
+  // SPARSE sends only the data extents (see streamSparse() in transfer.c).
+  // RANGE sends part of the file, for resumed and multi-stream fetches.
+  if (strncmp("-g", inBuffer, 2) == 0) {
+
+    struct getCondition cond;
+    struct getOptions getOpts;
+    const char* rest = parseCommandPath(&inBuffer[2], inFile, MAX_FILENAME_LENGTH);
+
+    rest = parseGetOptions(rest, &getOpts);
 
     if (DEBUG) {
-      printf("Requesting File: %s", inFile);
+      printf("Requesting File: %s%s\n", inFile, getOpts.sparse ? " (sparse)" : "");
     }
 
-    if (sendFile(socketFd, dataFd, inFile) != 0) {
+    if (rest == NULL || parseCondition(rest, &cond) == -1) {
+      netSend(socketFd, "ERROR_BAD_CONDITION\n", 20, 0);
+    } else if (sendFile(socketFd, &data, inFile, &cond, &getOpts) != 0) {
       // Something bad happened
     }
+  }
 
-    close(dataFd);
+  // The client only performs one activity per session, so we can close this.
+  if (data.fd != -1) {
+    netClose(data.fd);
   }
 
-  // Initialize the buffer again
-  inBuffer[MAX_COMMAND_LENGTH] = '\0';
+  arenaReset(arena);
+
   if(DEBUG) {
     printf("handleCommands() exited\n");
   }
 }
 
+/*
+* Handles -T: "on [<every>]" traces one session in every (default 1), "off"
+* stops, "dump" replies OK and sends the trace rings on the data connection
+*/
+
+void handleTraceCommand(int socketFd, struct dataEndpoint* data, const char* args) {
+
+  char word[8];
+  unsigned every = 1;
+  int numArgs;
+
+  numArgs = sscanf(args, " %7s %u", word, &every);
+  if (numArgs >= 1 && strcmp(word, "on") == 0 && every > 0) {
+    traceSetEnabled(1, every);
+    netSend(socketFd, "OK\n", 3, 0);
+  } else if (numArgs == 1 && strcmp(word, "off") == 0) {
+    traceSetEnabled(0, 0);
+    netSend(socketFd, "OK\n", 3, 0);
+  } else if (numArgs == 1 && strcmp(word, "dump") == 0) {
+    FILE* out;
+
+    netSend(socketFd, "OK\n", 3, 0);
+    if (openDataConnection(data) == -1 || (out = netFdopen(data->fd)) == NULL) {
+      return;
+    }
+    traceDump(out);
+    fclose(out);
+  } else {
+    netSend(socketFd, "ERROR_BAD_COMMAND\n", 18, 0);
+  }
+}
+
+/*
+* Copies the path argument that follows a command into out
+* Skips leading whitespace and stops at the first whitespace or control character,
+* so trailing newlines and junk don't end up in the path.
+* Anything else is left for pathTrieLookup() to accept or reject.
+* Returns a pointer just past the path, where any further arguments start
+*/
+
+const char* parseCommandPath(const char* in, char* out, size_t outLen) {
+
+  size_t i = 0;
+
+  while (*in == ' ' || *in == '\t') {
+    in++;
+  }
+  while (i < outLen - 1 && (unsigned char)*in > ' ' && *in != 0x7f) {
+    out[i++] = *in++;
+  }
+  out[i] = '\0';
+  return in;
+}
+
+/*
+* Parses the SPARSE and RANGE <start> <length> options that may follow a -g path
+* Returns a pointer just past them, or NULL if RANGE is malformed
+*/
+
+const char* parseGetOptions(const char* in, struct getOptions* opts) {
+
+  char* end;
+
+  memset(opts, 0, sizeof(struct getOptions));
+
+  while (*in == ' ') {
+    in++;
+  }
+  if (strncmp(in, "SPARSE", 6) == 0 && (in[6] == ' ' || in[6] == '\0')) {
+    opts->sparse = 1;
+    in += 6;
+    while (*in == ' ') {
+      in++;
+    }
+  }
+  if (strncmp(in, "RANGE ", 6) == 0) {
+    opts->ranged = 1;
+    opts->start = strtoll(in + 6, &end, 10);
+    if (end == in + 6 || *end != ' ' || opts->start < 0) {
+      return NULL;
+    }
+    in = end + 1;
+    opts->length = strtoll(in, &end, 10);
+    if (end == in || opts->length < 0) {
+      return NULL;
+    }
+    in = end;
+  }
+  return in;
+}
+
+/*
+* Sends all len bytes of buf, retrying short writes
+* Returns 0 on success, -1 on error
+*/
+
+int sendAll(int fd, const char* buf, size_t len) {
+
+  size_t offset = 0;
+
+  while (offset < len) {
+    ssize_t bytesSent = netSend(fd, buf + offset, len - offset, MSG_NOSIGNAL);
+    if (bytesSent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytesSent < 1) {
+      return -1;
+    }
+    offset += bytesSent;
+  }
+  return 0;
+}
+
 /*
 * Transmits a file to the client
-* Returns number of bytes transmitted, or -1 on error
+* A conditional request (cond->kind != CONDITION_NONE) is answered with
+* "NOT_MODIFIED\n" if the client's copy still matches, and nothing is sent on
+* the data connection.  Otherwise the reply is "OK <size> <mtime> <hash>\n"
+* (hash is "-" if it couldn't be worked out) followed by the file.
+* A ranged request always gets that reply, so the client can tell the file
+* it's assembling hasn't changed, but only hashes if a condition asks it to.
+* Its range is cut to the file's size; an empty range sends no data at all.
+* With opts->sparse the data goes out as extents, holes left out.
+* Returns 0 on success, 1 if the file wasn't found, -1 on error
 */
 
-int sendFile(int socketFd, int dataFd, char* filename) {
+int sendFile(int socketFd, struct dataEndpoint* data, char* filename, struct getCondition* cond, struct getOptions* opts) {
 
   if (DEBUG) {
-    printf("Called sendFile()");
+    printf("Called sendFile()\n");
   }
 
-  FILE *fp;
-  size_t bytesWritten = 0;
-  size_t bytesToWrite;
-  size_t fileSize;
-
-  int numbytes;
-  int bytesRead;
-  char buf[1025];
+  struct pathNode* node;
+  struct stat fileStat;
+  int fileFd;
+  off_t bytesSent;
+  off_t start = 0, length;
+  int64_t span = traceStart();
 
   // If there's no file, we can't do anything anyway
   // Just send an error to the client and return an error code
-  if (fileExists(filename) == 0) {
-    send(socketFd, "ERROR_FILE_NOT_FOUND", 20, 0);
+  node = pathTrieLookup(&gTrie, filename);
+  if (node == NULL || !S_ISREG(node->mode) ||
+      (fileFd = pathTrieOpen(&gTrie, node, O_RDONLY)) == -1) {
+    netSend(socketFd, "ERROR_FILE_NOT_FOUND", 20, 0);
     return 1;
+  }
+
+  // The index may be older than the file, so size the transfer from fstat()
+  if (fstat(fileFd, &fileStat) == -1) {
+    close(fileFd);
+    return -1;
+  }
+  traceEnd("lookup", span, 0);
+  span = traceStart();
+
+  length = fileStat.st_size;
+  if (opts->ranged) {
+    start = opts->start < fileStat.st_size ? opts->start : fileStat.st_size;
+    length = opts->length < fileStat.st_size - start ? opts->length : fileStat.st_size - start;
+  }
+
+  if (cond->kind == CONDITION_NONE && !opts->ranged) {
+    printf("sending OK\n");
+    netSend(socketFd, "OK", 3, 0);
   } else {
+    char reply[96];
+    char hashStr[17] = "-";
+    uint64_t hash;
+    int hashed = 0;
+
+    // Size and mtime come from the inode; only a hash match needs the content
+    int unchanged = cond->kind == CONDITION_SIZE_MTIME &&
+                    cond->size == fileStat.st_size && cond->mtime == fileStat.st_mtim.tv_sec;
+
+    if (!unchanged && cond->kind != CONDITION_NONE && validatorHash(fileFd, &fileStat, &hash) == 0) {
+      hashed = 1;
+      snprintf(hashStr, sizeof hashStr, "%016llx", (unsigned long long)hash);
+      unchanged = cond->kind == CONDITION_HASH && cond->hash == hash;
+    }
+    traceEnd("validate", span, hashed);
+    if (unchanged) {
+      printf("sending NOT_MODIFIED\n");
+      netSend(socketFd, "NOT_MODIFIED\n", 13, 0);
+      close(fileFd);
+      return 0;
+    }
     printf("sending OK\n");
-    send(socketFd, "OK", 3, 0);
+    snprintf(reply, sizeof reply, "OK %lld %lld %s\n", (long long)fileStat.st_size,
+             (long long)fileStat.st_mtim.tv_sec, hashed ? hashStr : "-");
+    netSend(socketFd, reply, strlen(reply), 0);
   }
 
-  // File transfer logic modeled on:
-  // http://stackoverflow.com/questions/9875735/c-socket-programming-a-client-server-application-to-send-a-file
-
-  fp = fopen(filename, "rb");
-  if (!fp)
-  {
-      printf("Can't open file for reading");
-      return;
+  if (length == 0 && opts->ranged) {
+    close(fileFd);      // The client only wanted the validators
+    return 0;
   }
-  while (!feof(fp))
-  {
-      int bytesRead = fread(buf, 1, sizeof(buf), fp);
-      if (bytesRead < 1)
-      {
-          printf("Can't read from file");
-          fclose(fp);
-          return;
-      }
 
-      int offset = 0;
-      do
-      {
-          int bytesSent = send(dataFd, &buf[offset], bytesRead - offset, 0);
-          if (bytesSent < 1)
-          {
-              printf("Can't write to socket");
-              fclose(fp);
-              return;
-          }
-
-          offset += bytesSent;
-      }
-      while (offset < bytesRead);
+  prefetchRecordHit(filename);
 
-    }
+  if (openDataConnection(data) == -1) {
+    close(fileFd);
+    return -1;
+  }
+  span = traceStart();
+  if (opts->sparse) {
+    bytesSent = streamSparse(data->fd, fileFd, start, length);
+  } else {
+    bytesSent = streamFile(data->fd, fileFd, start, length);
+  }
+  traceEnd(opts->sparse ? "stream_sparse" : "stream", span, bytesSent);
 
-  fclose(fp);
+  // Done streaming.  Unless other clients keep asking for this file, drop it
+  // from the page cache so one big transfer doesn't evict the popular ones.
+  // Only our range: other streams may still be reading the rest.
+  if (!prefetchIsHot(filename)) {
+    posix_fadvise(fileFd, start, length, POSIX_FADV_DONTNEED);
+  }
+  close(fileFd);
+
+  if (bytesSent == -1) {
+    printf("Can't write to socket");
+    return -1;
+  }
   return 0;
 }
 
 
 /*
-* Determines whether or not a file exists.
+* Writes one "size\tpath\n" line; directories get a trailing '/'
 */
 
-int fileExists(char *filename) {
-
-  DIR *dir_p;               // Pointer to the directory handle
-  struct dirent *entry_p;    // Pointer to the directory entry_p
-
-  dir_p = opendir("./");
-  while ((entry_p = readdir(dir_p)) && entry_p != NULL) {
+static void listEntry(struct listBuffer* out, const char* prefix, size_t prefixLen, struct pathNode* entry) {
 
-    printf("checking %s against %s...\n", entry_p->d_name, filename);
+  char sizeStr[32];
+  int sizeLen = snprintf(sizeStr, sizeof sizeStr, "%lld\t", (long long)entry->size);
 
-    if (strcmp(entry_p->d_name, filename ) == 0) {
-      return 1;
-    }
-  }
-  return 0;
+  listWrite(out, sizeStr, sizeLen);
+  listWrite(out, prefix, prefixLen);
+  listWrite(out, entry->name, strlen(entry->name));
+  listWrite(out, S_ISDIR(entry->mode) ? "/\n" : "\n", S_ISDIR(entry->mode) ? 2 : 1);
 }
 
 /*
-* Writes a directory listing of the current working directory to the supplied buffer
+* Streams a listing of dir to dataFd
+* If recursive is set, every entry in the subtree is listed with its path
+* relative to dir.  The walk is iterative so depth is only bounded by memory.
 */
 
 // References example code from:
 // http://www.gnu.org/savannah-checkouts/gnu/libc/manual/html_node/Simple-Directory-Lister.html
 // http://stackoverflow.com/questions/12489/how-do-you-get-a-directory-listing-in-c
-// http://stackoverflow.com/questions/2674312/how-to-append-strings-using-sprintf
 
-void getDirectoryListing(char* buf, int maxLen) {
+void getDirectoryListing(int dataFd, struct pathNode* dir, int recursive) {
 
   if (DEBUG) {
     printf("getDirectoryListing() called\n");
   }
 
-  char tmpBuf[maxLen];
+  struct listBuffer out;
+  struct listFrame {
+    struct pathNode* node;
+    int cursor;
+    size_t prefixLen;
+  } *stack = NULL;
+  size_t depth = 0, capStack = 0;
+  char* prefix = NULL;              // Path of the directory being walked, relative to dir
+  size_t prefixLen = 0, capPrefix = 0;
+
+  if (listBufferInit(&out, dataFd, MAX_DIR_LENGTH) == -1) {
+    perror("getDirectoryListing: malloc");
+    return;
+  }
 
-  // Initialize the memory for our buffer
-  memset(buf, '\0', maxLen);
-  memset(tmpBuf, '\0', maxLen);
+  // A file lists as itself
+  if (!S_ISDIR(dir->mode)) {
+    listEntry(&out, "", 0, dir);
+    listFlush(&out);
+    listBufferFree(&out);
+    return;
+  }
+
+  capStack = 16;
+  stack = malloc(capStack * sizeof(*stack));
+  if (stack == NULL) {
+    listBufferFree(&out);
+    return;
+  }
+  stack[depth].node = dir;
+  stack[depth].cursor = 0;
+  stack[depth].prefixLen = 0;
+  depth++;
 
-  DIR *dir_p;               // Pointer to the directory handle
-  struct dirent *entry_p;   // Pointer to the directory entry
-  struct stat dirStat;      // stat info for the directory entry
+  while (depth > 0 && !out.failed) {
 
-  // Open a handle for the current working directory
-  dir_p = opendir("./");
+    struct listFrame* top = &stack[depth - 1];
 
-  // Loop over the results of readdir and assemble the output
-  while((entry_p = readdir(dir_p)) && entry_p != NULL) {
+    if (top->cursor == top->node->numChildren) {
+      prefixLen = top->prefixLen;
+      depth--;
+      continue;
+    }
 
-    // Populate the dirStat struct for the current directory entry
-    stat(entry_p->d_name, &dirStat);
+    struct pathNode* entry = top->node->children[top->cursor++];
+    listEntry(&out, prefix, prefixLen, entry);
 
-    // Builds the string up by concatenating the contents of buf with what
-    // we want to add, up to the supplied buffer lenght, maxLen to prevent overflows
-    if(strncmp(buf, "\0", 1) == 0) {
-      snprintf(buf, maxLen-1, "%d\t%s\n", dirStat.st_size, entry_p->d_name);
-    } else {
-      snprintf(tmpBuf, maxLen-1, "%s%d\t%s\n", buf, dirStat.st_size, entry_p->d_name);
-      strcpy(buf, tmpBuf);
+    if (!recursive || !S_ISDIR(entry->mode) || entry->numChildren == 0) {
+      continue;
     }
+
+    // Descend: extend the prefix with "name/" and push a frame
+    size_t nameLen = strlen(entry->name);
+    if (prefixLen + nameLen + 1 > capPrefix) {
+      size_t newCap = (prefixLen + nameLen + 1) * 2;
+      char* grown = realloc(prefix, newCap);
+      if (grown == NULL) {
+        break;
+      }
+      prefix = grown;
+      capPrefix = newCap;
+    }
+    if (depth == capStack) {
+      struct listFrame* grown = realloc(stack, capStack * 2 * sizeof(*stack));
+      if (grown == NULL) {
+        break;
+      }
+      stack = grown;
+      capStack *= 2;
+    }
+    stack[depth].node = entry;
+    stack[depth].cursor = 0;
+    stack[depth].prefixLen = prefixLen;
+    depth++;
+    memcpy(prefix + prefixLen, entry->name, nameLen);
+    prefixLen += nameLen;
+    prefix[prefixLen++] = '/';
   }
 
+  listFlush(&out);
+
   if (DEBUG) {
-    printf("getDirectoryListing():output\n %s\n",buf);
     printf("exited loop\n");
   }
+  free(prefix);
+  free(stack);
+  listBufferFree(&out);
   return;
 }
 
@@ -528,15 +1134,16 @@ void getDirectoryListing(char* buf, int maxLen) {
 int openSocket(int portNum) {
 
   // Borrowed from Beej's Guide to Network Programming, pp 16,17
-  int status, sfd;
+  int status, sfd, pass;
   int yes = 1;
+  int no = 0;
   struct addrinfo hints;
   struct addrinfo *result, *rp;
   char port[MAX_PORT_LENGTH];
 
   memset(&hints, 0, sizeof hints);  // make sure the struct is empty
 
-  hints.ai_family = AF_UNSPEC;        // I'm not worrying about IPV6
+  hints.ai_family = AF_UNSPEC;      // IPv4 or IPv6
   hints.ai_socktype = SOCK_STREAM;  // We need TCP sockets here
   hints.ai_flags = AI_PASSIVE;      // Populate the local IP automatically
 
@@ -557,25 +1164,38 @@ int openSocket(int portNum) {
   // Try each address until we successfully bind().
   // If socket() or bind() fails, we close the socket and try the next address.
 
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sfd == -1)
-      continue;
-
-    // Set the socket to be reusable so it's less annoying to test.
-    // Beej's guide to network programming, pp.28
-    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-       perror("setsockopt failed");
-       return -1;
-     }
+  // The IPv6 wildcard goes first: with V6ONLY off it takes IPv4 clients too
+  // (as ::ffff:a.b.c.d), so both kinds of client can reach us.
+  for (pass = 0; pass < 2; pass++) {
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+      if ((rp->ai_family == AF_INET6) != (pass == 0))
+        continue;
+
+      sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+      if (sfd == -1)
+        continue;
+
+      // Set the socket to be reusable so it's less annoying to test.
+      // Beej's guide to network programming, pp.28
+      if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+         perror("setsockopt failed");
+         return -1;
+       }
+      if (rp->ai_family == AF_INET6) {
+        setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int));
+      }
 
-    if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
-      if(DEBUG) {
-        printf("openSocket(): bind was successfull\n");
+      if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+        if(DEBUG) {
+          printf("openSocket(): bind was successfull\n");
+        }
+        break;      // ** Success **
       }
-      break;      // ** Success **
 
-    close(sfd);
+      close(sfd);
+    }
+    if (rp != NULL)
+      break;
   }
 
   if (rp == NULL) {  // Could not bind to any available port
@@ -595,23 +1215,80 @@ int openSocket(int portNum) {
   return sfd;
 }
 
-int parseCommandlineArgs(int argc, char* argv[]) {
+/*
+* Parses ftserver [-M] [-b <budget_mb>] [-C <cert_file> -K <key_file> [-U]] [-L <local_socket>] [-r <root_dir>] [-s <handoff_socket>] [-x <trace_every>] [-T <trace_file>] <port> into opts
+* Prints usage and exits if the arguments are wrong
+*/
 
-  char port[MAX_PORT_LENGTH];     // Port number supplied from commandline
-  int portNum = 0;
+int parseCommandlineArgs(int argc, char* argv[], struct serverOptions* opts) {
+
+  int opt;
+
+  memset(opts, 0, sizeof(struct serverOptions));
+  opts->rootPath = ".";
+  opts->traceFile = TRACE_DEFAULT_FILE;
+  opts->poolBudget = POOL_DEFAULT_BUDGET;
+  opts->kernelTls = 1;
+
+  while ((opt = getopt(argc, argv, "b:C:K:L:MUr:s:T:x:")) != -1) {
+    switch (opt) {
+      case 'b': {
+        char* end;
+        long megabytes;
+        errno = 0;
+        megabytes = strtol(optarg, &end, 10);
+        if (errno != 0 || end == optarg || *end != '\0' || megabytes < 1 || megabytes > POOL_MAX_BUDGET_MB) {
+          fprintf(stderr, "The memory budget must be a number of MB in [1..%d].\n", POOL_MAX_BUDGET_MB);
+          exit(EXIT_FAILURE);
+        }
+        opts->poolBudget = (size_t)megabytes << 20;
+        break;
+      }
+      case 'C':
+        opts->certFile = optarg;
+        break;
+      case 'K':
+        opts->keyFile = optarg;
+        break;
+      case 'L':
+        opts->localPath = optarg;
+        break;
+      case 'M':
+        opts->merkle = 1;
+        break;
+      case 'U':
+        opts->kernelTls = 0;
+        break;
+      case 'r':
+        opts->rootPath = optarg;
+        break;
+      case 's':
+        opts->handoffPath = optarg;
+        break;
+      case 'T':
+        opts->traceFile = optarg;
+        break;
+      case 'x':
+        opts->traceSample = atoi(optarg);
+        break;
+      default:
+        printf("Usage: ftserver [-M] [-b <budget_mb>] [-C <cert_file> -K <key_file> [-U]] [-L <local_socket>] [-r <root_dir>] [-s <handoff_socket>] [-x <trace_every>] [-T <trace_file>] <port>\n");
+        exit(0);
+    }
+  }
 
   // If the number of commandline arguments is wrong, print usage instructions
-  if (argc != 2) {
-    printf("Usage: ftserver.c <port>\n");
+  if (argc - optind != 1 || (opts->certFile == NULL) != (opts->keyFile == NULL)) {
+    printf("Usage: ftserver [-M] [-b <budget_mb>] [-C <cert_file> -K <key_file> [-U]] [-L <local_socket>] [-r <root_dir>] [-s <handoff_socket>] [-x <trace_every>] [-T <trace_file>] <port>\n");
     exit(0);
   }
 
   // Convert the supplied value for port to an integer
-  // If the conversion fails, throw an assert
-  portNum = atoi(argv[1]);
-  if(portNum == 0) {
-    assert("The supplied value for port was not valid.  Please use a valid integer in [1024..65535] and try again.\n");
+  opts->portNum = atoi(argv[optind]);
+  if(opts->portNum <= 0 || opts->portNum > 65535) {
+    fprintf(stderr, "The supplied value for port was not valid.  Please use a valid integer in [1024..65535] and try again.\n");
+    exit(EXIT_FAILURE);
   }
 
-  return portNum;
+  return opts->portNum;
 }
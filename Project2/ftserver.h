@@ -1,15 +1,63 @@
 #ifndef FTSERVER_H_ /* Include Guard */
 #define FTSERVER_H_
 
-int establishDataConnection(int socketFd);
-int fileExists(char *filename);
-void getDirectoryListing(char* buf, int maxLen);
-void handleCommands(int socketFd);
+#include <stddef.h>
+#include <sys/socket.h>
 
+struct getCondition;
+struct pathNode;
+struct poolArena;
+
+// Settings taken from the commandline
+struct serverOptions {
+  int portNum;          // Control port to listen on
+  char* rootPath;       // Directory tree to serve
+  char* handoffPath;    // Unix socket for hot restarts (-s), or NULL
+  char* traceFile;      // Where SIGUSR2 dumps the trace (-T)
+  int traceSample;      // Trace one session in this many from startup (-x), 0 = off
+  int merkle;           // Keep a Merkle tree of the served tree for SYNC (-M)
+  size_t poolBudget;    // Bytes of session buffers shared by all sessions (-b)
+  char* certFile;       // TLS certificate chain (-C), or NULL for cleartext
+  char* keyFile;        // Its private key (-K)
+  int kernelTls;        // Hand TLS sessions to the kernel where it can (cleared by -U)
+  char* localPath;      // Unix socket for same-host clients (-L), or NULL
+};
+
+// Where the data connection goes, and the connection once it's made
+struct dataEndpoint {
+  struct sockaddr_storage addr;   // Client's address with its DATA_PORT filled in
+  socklen_t addrLen;
+  int onDemand;                   // Client said ON_DEMAND: connect only when there's data to send
+  int fd;                         // -1 until connected
+};
+
+// How -g should send the file: "-g <path> [SPARSE] [RANGE <start> <length>] ..."
+struct getOptions {
+  int sparse;                     // Data extents only, holes left out
+  int ranged;                     // Only [start, start + length) of the file
+  off_t start;
+  off_t length;                   // 0 = just the validators, no data
+};
+
+int establishDataConnection(int socketFd, struct dataEndpoint* data, char* command, size_t commandLen);
+int openDataConnection(struct dataEndpoint* data);
+void getDirectoryListing(int dataFd, struct pathNode* dir, int recursive);
+void handleCommands(int socketFd, struct poolArena* arena);
+const char* parseCommandPath(const char* in, char* out, size_t outLen);
+const char* parseGetOptions(const char* in, struct getOptions* opts);
+
+void drainAndExit(int socketFileDescriptor);
 void listenForCommands(int socketFileDescriptor);
+void startSession(int listenFd, int socketFileDescriptor, int local);
 int openSocket(int portNum);
-int parseCommandlineArgs(int argc, char* argv[]);
-int sendFile(int socketFd, int dataFd, char* filename);
+int parseCommandlineArgs(int argc, char* argv[], struct serverOptions* opts);
+void reindexTree(const int* listeners, int numListeners);
+int sendAll(int fd, const char* buf, size_t len);
+int sendFile(int socketFd, struct dataEndpoint* data, char* filename, struct getCondition* cond, struct getOptions* opts);
 void sigchld_handler(int s);
+void sighup_handler(int s);
+void sigusr1_handler(int s);
+void sigusr2_handler(int s);
+void handleTraceCommand(int socketFd, struct dataEndpoint* data, const char* args);
 
-#endif // CHATCLIENT_H_
+#endif // FTSERVER_H_
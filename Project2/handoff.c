@@ -0,0 +1,313 @@
+/**
+* handoff.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Hot restart: passing the listening sockets from a running ftserver to its
+* replacement, so an upgrade never refuses a connection
+* - A server started with -s <path> listens for a successor on a Unix socket
+*   at path
+* - A new server started with the same -s connects to it first and sends
+*   HANDOFF.  The old server answers with its listening sockets, passed as
+*   SCM_RIGHTS.  Connections waiting in the backlog come along with them,
+*   because it's the same socket.
+* - The new server says TAKEN once it holds them.  Only then does the old
+*   server stop accepting.  It waits for its in-flight sessions to finish and
+*   exits.  If TAKEN never arrives, the old server just carries on.
+* - The new server then binds path itself, ready for the next upgrade.
+*
+* The exchange:
+*   new -> old   "HANDOFF\n"
+*   old -> new   "LISTENERS <n>\n" with n descriptors attached
+*   new -> old   "TAKEN\n"
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "handoff.h"
+
+#define DEBUG 0
+
+static int fillAddress(struct sockaddr_un* addr, const char* path) {
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr->sun_path) {
+    fprintf(stderr, "handoff: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+// Waits up to HANDOFF_TIMEOUT_MS for fd to become readable
+// SA_RESTART doesn't cover poll(), and sessions exiting raise SIGCHLD all the time
+static int waitReadable(int fd) {
+
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  struct timespec start, now;
+  int status, left = HANDOFF_TIMEOUT_MS;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while ((status = poll(&pfd, 1, left)) == -1 && errno == EINTR) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = HANDOFF_TIMEOUT_MS - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+    if (left < 0) {
+      left = 0;
+    }
+  }
+  return status > 0 ? 0 : -1;
+}
+
+// Reads up to a newline, waiting at most HANDOFF_TIMEOUT_MS for each piece
+static int readLine(int fd, char* buf, size_t len) {
+
+  size_t used = 0;
+
+  while (used < len - 1) {
+    ssize_t got;
+
+    if (waitReadable(fd) == -1) {
+      return -1;
+    }
+    if ((got = recv(fd, buf + used, 1, 0)) < 1) {
+      return -1;
+    }
+    if (buf[used++] == '\n') {
+      break;
+    }
+  }
+  buf[used] = '\0';
+  return 0;
+}
+
+/*
+* Makes path free to bind a Unix socket to
+* A stale socket left behind by a server that's gone is removed.  Anything
+* else at path (a socket someone still accepts on, a regular file) is left
+* alone, and is an error.
+* Returns 0 if path can be bound, -1 if not
+*/
+
+int claimSocketPath(const char* path) {
+
+  struct sockaddr_un addr;
+  struct stat pathStat;
+  int fd, status, error;
+
+  if (lstat(path, &pathStat) == -1) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror(path);
+    return -1;
+  }
+  if (!S_ISSOCK(pathStat.st_mode)) {
+    fprintf(stderr, "%s exists and isn't a socket\n", path);
+    return -1;
+  }
+  if (fillAddress(&addr, path) == -1 || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return -1;
+  }
+  status = connect(fd, (struct sockaddr*)&addr, sizeof addr);
+  error = errno;
+  close(fd);
+  if (status == 0) {
+    fprintf(stderr, "%s is in use\n", path);
+    return -1;
+  }
+  if (error != ECONNREFUSED) {
+    fprintf(stderr, "%s: %s\n", path, strerror(error));
+    return -1;
+  }
+  unlink(path);
+  return 0;
+}
+
+/*
+* Listens for a successor on the Unix socket at path
+* takeover says we've just taken over from the server that had path, whose
+* socket is replaced.  On a cold start only a stale socket is.
+* Returns the listening socket, or -1 on error
+*/
+
+int handoffListen(const char* path, int takeover) {
+
+  struct sockaddr_un addr;
+  int fd;
+
+  if (fillAddress(&addr, path) == -1) {
+    return -1;
+  }
+  if (takeover) {
+    unlink(path);
+  } else if (claimSocketPath(path) == -1) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    perror("handoffListen: socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(fd, 1) == -1) {
+    perror("handoffListen: bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+* Asks the server listening at path for its listening sockets
+* On success the descriptors are stored in fds, and *controlFd is left open
+* for handoffConfirm()
+* Returns how many were received, 0 if no server is listening there (a cold
+* start), or -1 if one is but the handoff failed
+*/
+
+int handoffRequest(const char* path, int* fds, int maxFds, int* controlFd) {
+
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  char reply[32];
+  int fd, numFds = 0, announced = 0;
+  ssize_t got;
+
+  *controlFd = -1;
+  if (fillAddress(&addr, path) == -1) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof addr) == -1) {
+    close(fd);
+    return (errno == ENOENT || errno == ECONNREFUSED) ? 0 : -1;
+  }
+  if (send(fd, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST), MSG_NOSIGNAL) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  // The descriptors ride on the LISTENERS line, which fits in one recvmsg()
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = reply;
+  iov.iov_len = sizeof reply - 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof control;
+
+  if (waitReadable(fd) == -1 || (got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 1) {
+    close(fd);
+    return -1;
+  }
+  reply[got] = '\0';
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int* passed = (int*)CMSG_DATA(cmsg);
+      for (i = 0; i < count; i++) {
+        if (numFds < maxFds) {
+          fds[numFds++] = passed[i];
+        } else {
+          close(passed[i]);
+        }
+      }
+    }
+  }
+
+  if (sscanf(reply, "LISTENERS %d", &announced) != 1 || announced != numFds ||
+      (msg.msg_flags & MSG_CTRUNC) || numFds == 0) {
+    fprintf(stderr, "handoffRequest: bad reply from the running server\n");
+    while (numFds > 0) {
+      close(fds[--numFds]);
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (DEBUG) {
+    printf("handoffRequest(): received %d listener(s)\n", numFds);
+  }
+  *controlFd = fd;
+  return numFds;
+}
+
+/*
+* Tells the old server we hold its listeners, so it can stop accepting
+* Returns 0 on success, -1 on error
+*/
+
+int handoffConfirm(int controlFd) {
+
+  int status = send(controlFd, HANDOFF_TAKEN, strlen(HANDOFF_TAKEN), MSG_NOSIGNAL) == -1 ? -1 : 0;
+  close(controlFd);
+  return status;
+}
+
+/*
+* Accepts a successor on handoffFd and passes it fds
+* Returns 1 if the successor took them (stop accepting now), 0 if it went
+* away or asked for something else (keep serving)
+*/
+
+int handoffServe(int handoffFd, const int* fds, int numFds) {
+
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  char line[32];
+  int fd, taken = 0;
+
+  if ((fd = accept4(handoffFd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+    return 0;
+  }
+  if (numFds < 1 || numFds > HANDOFF_MAX_FDS ||
+      readLine(fd, line, sizeof line) == -1 || strcmp(line, HANDOFF_REQUEST) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  snprintf(line, sizeof line, "LISTENERS %d\n", numFds);
+  memset(&msg, 0, sizeof msg);
+  memset(control, 0, sizeof control);
+  iov.iov_base = line;
+  iov.iov_len = strlen(line);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+
+  if (sendmsg(fd, &msg, MSG_NOSIGNAL) != -1 &&
+      readLine(fd, line, sizeof line) == 0 && strcmp(line, HANDOFF_TAKEN) == 0) {
+    taken = 1;
+  }
+  close(fd);
+
+  if (DEBUG) {
+    printf("handoffServe(): successor %s\n", taken ? "took over" : "gave up, still serving");
+  }
+  return taken;
+}
@@ -0,0 +1,15 @@
+#ifndef HANDOFF_H_ /* Include Guard */
+#define HANDOFF_H_
+
+#define HANDOFF_MAX_FDS 8           // Listening sockets one handoff can carry
+#define HANDOFF_TIMEOUT_MS 5000     // How long either side waits on the other
+#define HANDOFF_REQUEST "HANDOFF\n" // New server -> old: send me your listeners
+#define HANDOFF_TAKEN "TAKEN\n"     // New server -> old: got them, stop accepting
+
+int claimSocketPath(const char* path);
+int handoffListen(const char* path, int takeover);
+int handoffRequest(const char* path, int* fds, int maxFds, int* controlFd);
+int handoffConfirm(int controlFd);
+int handoffServe(int handoffFd, const int* fds, int numFds);
+
+#endif // HANDOFF_H_
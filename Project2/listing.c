@@ -0,0 +1,459 @@
+/**
+* listing.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Filtered, sorted and paginated directory listings (-q)
+*
+* Request (control port):
+*   -q [<path>] [glob=<pattern>] [prefix=<text>] [sort=name|size|mtime]
+*               [order=asc|desc] [offset=<n>] [limit=<n>]
+*
+* Response (data port), all integers big-endian:
+*   header:  "FTLS" u8 version, u8 status, u16 reserved,
+*            u64 total matches, u64 offset, u32 entry count
+*   entry:   u64 size, i64 mtime (ns since the epoch), u8 type ('d' or 'f'),
+*            u16 name length, name bytes (no terminator)
+*
+* Children in the trie are already in name order, so a prefix (or the literal
+* start of a glob) is a binary-searched index range, and a name-sorted page
+* with no glob is answered without scanning the directory at all.
+* Directories with LIST_INDEX_THRESHOLD or more entries also carry size and
+* mtime orderings built at index time, so those sorts don't qsort per request.
+*/
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "ftserver.h"
+#include "listing.h"
+#include "pathtrie.h"
+#include "pool.h"
+
+#define DEBUG 0
+
+/*
+* Takes a pool buffer of up to cap bytes for a listing writer on fd
+* When memory is short it may be smaller; the writer just flushes more often
+* Returns 0 on success, -1 on allocation failure
+*/
+
+int listBufferInit(struct listBuffer* out, int fd, size_t cap) {
+
+  memset(out, 0, sizeof(struct listBuffer));
+  out->fd = fd;
+  if ((out->buf = poolGet(cap, cap < POOL_MIN_BYTES ? cap : POOL_MIN_BYTES, &out->cap)) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+void listBufferFree(struct listBuffer* out) {
+  poolPut(out->buf);
+  out->buf = NULL;
+}
+
+void listFlush(struct listBuffer* out) {
+  if (!out->failed && out->len > 0 && sendAll(out->fd, out->buf, out->len) == -1) {
+    out->failed = 1;
+  }
+  out->len = 0;
+}
+
+void listWrite(struct listBuffer* out, const void* data, size_t len) {
+
+  const char* p = data;
+
+  while (len > 0 && !out->failed) {
+    size_t room = out->cap - out->len;
+    size_t chunk = len < room ? len : room;
+    memcpy(out->buf + out->len, p, chunk);
+    out->len += chunk;
+    p += chunk;
+    len -= chunk;
+    if (out->len == out->cap) {
+      listFlush(out);
+    }
+  }
+}
+
+static int64_t mtimeNanos(struct pathNode* node) {
+  return (int64_t)node->mtime.tv_sec * 1000000000LL + node->mtime.tv_nsec;
+}
+
+/*
+* qsort_r comparators over child indexes of one directory
+* Ties fall back to the index, which is name order
+*/
+
+static int compareBySize(const void* a, const void* b, void* arg) {
+  struct pathNode** children = arg;
+  int left = *(const int*)a, right = *(const int*)b;
+  off_t l = children[left]->size, r = children[right]->size;
+  if (l != r) {
+    return l < r ? -1 : 1;
+  }
+  return left - right;
+}
+
+static int compareByMtime(const void* a, const void* b, void* arg) {
+  struct pathNode** children = arg;
+  int left = *(const int*)a, right = *(const int*)b;
+  int64_t l = mtimeNanos(children[left]), r = mtimeNanos(children[right]);
+  if (l != r) {
+    return l < r ? -1 : 1;
+  }
+  return left - right;
+}
+
+static int* sortedOrder(struct pathNode* dir, int sortKey) {
+
+  int* order = malloc((dir->numChildren ? dir->numChildren : 1) * sizeof(int));
+  int i;
+
+  if (order == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < dir->numChildren; i++) {
+    order[i] = i;
+  }
+  qsort_r(order, dir->numChildren, sizeof(int),
+          sortKey == LIST_SORT_SIZE ? compareBySize : compareByMtime, dir->children);
+  return order;
+}
+
+/*
+* Precomputes size and mtime orderings for every large directory in the trie
+* Called right after pathTrieBuild() so forked sessions inherit them
+* Returns 0 on success, -1 on allocation failure
+*/
+
+int buildListingIndexes(struct pathTrie* trie) {
+
+  struct pathNode** stack;
+  size_t depth = 0;
+  size_t capStack = 64;
+  int i;
+
+  if ((stack = malloc(capStack * sizeof(struct pathNode*))) == NULL) {
+    return -1;
+  }
+  stack[depth++] = trie->root;
+
+  while (depth > 0) {
+    struct pathNode* dir = stack[--depth];
+
+    if (dir->numChildren >= LIST_INDEX_THRESHOLD) {
+      dir->bySize = sortedOrder(dir, LIST_SORT_SIZE);
+      dir->byMtime = sortedOrder(dir, LIST_SORT_MTIME);
+      if (dir->bySize == NULL || dir->byMtime == NULL) {
+        free(stack);
+        return -1;
+      }
+    }
+
+    for (i = 0; i < dir->numChildren; i++) {
+      if (!S_ISDIR(dir->children[i]->mode) || dir->children[i]->numChildren == 0) {
+        continue;
+      }
+      if (depth == capStack) {
+        struct pathNode** grown = realloc(stack, capStack * 2 * sizeof(struct pathNode*));
+        if (grown == NULL) {
+          free(stack);
+          return -1;
+        }
+        stack = grown;
+        capStack *= 2;
+      }
+      stack[depth++] = dir->children[i];
+    }
+  }
+
+  free(stack);
+  return 0;
+}
+
+/*
+* Parses the arguments that follow -q
+* Tokens are split in place, so query points into args afterwards
+* Returns 0 on success, -1 if the query is malformed
+*/
+
+int parseListQuery(char* args, struct listQuery* query) {
+
+  char* savePtr = NULL;
+  char* token;
+  int first = 1;
+
+  memset(query, 0, sizeof(struct listQuery));
+  query->path = "";
+  query->limit = LIST_DEFAULT_LIMIT;
+
+  for (token = strtok_r(args, " \t\r\n", &savePtr); token != NULL;
+       token = strtok_r(NULL, " \t\r\n", &savePtr), first = 0) {
+
+    char* value = strchr(token, '=');
+    char* end;
+
+    // The first bare token is the directory
+    if (value == NULL) {
+      if (!first) {
+        return -1;
+      }
+      query->path = token;
+      continue;
+    }
+    *value++ = '\0';
+
+    if (strcmp(token, "glob") == 0) {
+      query->glob = value;
+    } else if (strcmp(token, "prefix") == 0) {
+      query->prefix = value;
+    } else if (strcmp(token, "sort") == 0) {
+      // sort=-size is shorthand for sort=size order=desc
+      if (*value == '-') {
+        query->descending = 1;
+        value++;
+      }
+      if (strcmp(value, "name") == 0) {
+        query->sortKey = LIST_SORT_NAME;
+      } else if (strcmp(value, "size") == 0) {
+        query->sortKey = LIST_SORT_SIZE;
+      } else if (strcmp(value, "mtime") == 0) {
+        query->sortKey = LIST_SORT_MTIME;
+      } else {
+        return -1;
+      }
+    } else if (strcmp(token, "order") == 0) {
+      if (strcmp(value, "asc") == 0) {
+        query->descending = 0;
+      } else if (strcmp(value, "desc") == 0) {
+        query->descending = 1;
+      } else {
+        return -1;
+      }
+    } else if (strcmp(token, "offset") == 0 || strcmp(token, "limit") == 0) {
+      errno = 0;
+      unsigned long long n = strtoull(value, &end, 10);
+      if (errno != 0 || *value == '\0' || *end != '\0' || *value == '-') {
+        return -1;
+      }
+      if (token[0] == 'o') {
+        query->offset = n;
+      } else {
+        query->limit = n;
+      }
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+* First child index in [low, high) whose name doesn't sort before key
+* If prefixOnly is set, "doesn't start with key and sorts after it" instead,
+* which gives the end of the range of names starting with key
+*/
+
+static int boundSearch(struct pathNode* dir, int low, int high, const char* key, int prefixOnly) {
+
+  size_t keyLen = strlen(key);
+
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    int cmp = prefixOnly ? strncmp(dir->children[mid]->name, key, keyLen)
+                         : strcmp(dir->children[mid]->name, key);
+    if (prefixOnly ? cmp <= 0 : cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void writeHeader(struct listBuffer* out, int status, uint64_t total, uint64_t offset, uint32_t count) {
+
+  unsigned char header[LIST_HEADER_LENGTH];
+  uint64_t total_be = htobe64(total);
+  uint64_t offset_be = htobe64(offset);
+  uint32_t count_be = htobe32(count);
+
+  memcpy(header, LIST_MAGIC, 4);
+  header[4] = LIST_VERSION;
+  header[5] = status;
+  header[6] = 0;
+  header[7] = 0;
+  memcpy(header + 8, &total_be, 8);
+  memcpy(header + 16, &offset_be, 8);
+  memcpy(header + 24, &count_be, 4);
+  listWrite(out, header, sizeof header);
+}
+
+static void writeEntry(struct listBuffer* out, struct pathNode* entry) {
+
+  unsigned char fixed[19];
+  size_t nameLen = strlen(entry->name);
+  uint64_t size_be = htobe64((uint64_t)entry->size);
+  uint64_t mtime_be = htobe64((uint64_t)mtimeNanos(entry));
+  uint16_t nameLen_be = htobe16((uint16_t)nameLen);
+
+  memcpy(fixed, &size_be, 8);
+  memcpy(fixed + 8, &mtime_be, 8);
+  fixed[16] = S_ISDIR(entry->mode) ? 'd' : 'f';
+  memcpy(fixed + 17, &nameLen_be, 2);
+  listWrite(out, fixed, sizeof fixed);
+  listWrite(out, entry->name, nameLen);
+}
+
+/*
+* Sends an empty listing carrying just a status (e.g. LIST_STATUS_BAD_QUERY)
+* Returns 0 on success, -1 if it couldn't be sent
+*/
+
+int sendListingStatus(int dataFd, int status) {
+
+  struct listBuffer out;
+  int result;
+
+  if (listBufferInit(&out, dataFd, LIST_HEADER_LENGTH) == -1) {
+    return -1;
+  }
+  writeHeader(&out, status, 0, 0, 0);
+  listFlush(&out);
+  result = out.failed ? -1 : 0;
+  listBufferFree(&out);
+  return result;
+}
+
+/*
+* Answers a -q request on dataFd
+* Returns 0 on success, -1 if the listing couldn't be sent
+*/
+
+int sendListing(int dataFd, struct pathTrie* trie, struct listQuery* query) {
+
+  struct listBuffer out;
+  struct pathNode* dir;
+  struct pathNode* single[1];
+  struct pathNode fileDir;      // Stand-in parent when the query names a file
+  int* order = NULL;            // Child indexes in the requested order
+  int* scratch = NULL;          // order, when we had to sort it ourselves
+  int* page = NULL;             // Selected child indexes
+  const char* rangePrefix;
+  uint64_t total = 0;
+  uint32_t count = 0;
+  uint64_t k, n;
+  int low, high;
+  int status;
+
+  if (listBufferInit(&out, dataFd, 65536) == -1) {
+    return -1;
+  }
+
+  dir = pathTrieLookup(trie, query->path);
+  if (dir == NULL) {
+    writeHeader(&out, LIST_STATUS_NOT_FOUND, 0, query->offset, 0);
+    goto done;
+  }
+
+  // A file lists as a one-entry directory
+  if (!S_ISDIR(dir->mode)) {
+    memset(&fileDir, 0, sizeof fileDir);
+    single[0] = dir;
+    fileDir.children = single;
+    fileDir.numChildren = 1;
+    dir = &fileDir;
+  }
+
+  // Narrow to the contiguous name range the prefix (or the glob's literal
+  // lead-in, whichever is more specific) allows
+  rangePrefix = query->prefix ? query->prefix : "";
+  if (query->glob != NULL) {
+    size_t litLen = strcspn(query->glob, "*?[\\");
+    size_t prefixLen = strlen(rangePrefix);
+    if (litLen > prefixLen) {
+      if (strncmp(query->glob, rangePrefix, prefixLen) != 0) {
+        writeHeader(&out, LIST_STATUS_OK, 0, query->offset, 0);
+        goto done;
+      }
+      rangePrefix = strndupa(query->glob, litLen);
+    } else if (strncmp(query->glob, rangePrefix, litLen) != 0) {
+      writeHeader(&out, LIST_STATUS_OK, 0, query->offset, 0);
+      goto done;
+    }
+  }
+  low = 0;
+  high = dir->numChildren;
+  if (*rangePrefix != '\0') {
+    low = boundSearch(dir, 0, high, rangePrefix, 0);
+    high = boundSearch(dir, low, high, rangePrefix, 1);
+  }
+
+  if (query->sortKey != LIST_SORT_NAME) {
+    order = query->sortKey == LIST_SORT_SIZE ? dir->bySize : dir->byMtime;
+    if (order == NULL) {
+      if ((scratch = sortedOrder(dir, query->sortKey)) == NULL) {
+        writeHeader(&out, LIST_STATUS_BAD_QUERY, 0, query->offset, 0);
+        goto done;
+      }
+      order = scratch;
+    }
+  }
+
+  n = query->sortKey == LIST_SORT_NAME ? (uint64_t)(high - low) : (uint64_t)dir->numChildren;
+  size_t pageCap = query->limit < n ? query->limit : n;
+  if ((page = malloc((pageCap ? pageCap : 1) * sizeof(int))) == NULL) {
+    writeHeader(&out, LIST_STATUS_BAD_QUERY, 0, query->offset, 0);
+    goto done;
+  }
+
+  if (query->glob == NULL && (query->sortKey == LIST_SORT_NAME || (low == 0 && high == dir->numChildren))) {
+    // Every candidate matches: the page is a direct slice, no scan needed
+    total = n;
+    for (k = query->offset; k < n && count < pageCap; k++) {
+      uint64_t pos = query->descending ? n - 1 - k : k;
+      page[count++] = query->sortKey == LIST_SORT_NAME ? low + (int)pos : order[pos];
+    }
+  } else {
+    for (k = 0; k < n; k++) {
+      uint64_t pos = query->descending ? n - 1 - k : k;
+      int idx = query->sortKey == LIST_SORT_NAME ? low + (int)pos : order[pos];
+
+      if (idx < low || idx >= high) {
+        continue;
+      }
+      if (query->glob != NULL && fnmatch(query->glob, dir->children[idx]->name, 0) != 0) {
+        continue;
+      }
+      if (total >= query->offset && count < pageCap) {
+        page[count++] = idx;
+      }
+      total++;
+    }
+  }
+
+  if (DEBUG) {
+    printf("sendListing(): %llu matches, sending %u\n", (unsigned long long)total, count);
+  }
+
+  writeHeader(&out, LIST_STATUS_OK, total, query->offset, count);
+  for (k = 0; k < count; k++) {
+    writeEntry(&out, dir->children[page[k]]);
+  }
+
+done:
+  listFlush(&out);
+  status = out.failed ? -1 : 0;
+  listBufferFree(&out);
+  free(scratch);
+  free(page);
+  return status;
+}
@@ -0,0 +1,55 @@
+#ifndef LISTING_H_ /* Include Guard */
+#define LISTING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pathNode;
+struct pathTrie;
+
+#define LIST_MAGIC "FTLS"       // First four bytes of a binary listing
+#define LIST_VERSION 1
+#define LIST_HEADER_LENGTH 28   // magic, version, status, reserved, total, offset, count
+
+#define LIST_STATUS_OK 0
+#define LIST_STATUS_NOT_FOUND 1
+#define LIST_STATUS_BAD_QUERY 2
+
+#define LIST_SORT_NAME 0
+#define LIST_SORT_SIZE 1
+#define LIST_SORT_MTIME 2
+
+#define LIST_DEFAULT_LIMIT 1000
+#define LIST_INDEX_THRESHOLD 64 // Directories this big get size/mtime orderings precomputed
+
+// Buffered writer listings are streamed through
+struct listBuffer {
+  int fd;
+  char* buf;
+  size_t len;
+  size_t cap;
+  int failed;
+};
+
+// A parsed -q request
+struct listQuery {
+  char* path;           // Directory to list, relative to the root
+  char* glob;           // fnmatch() pattern, or NULL
+  char* prefix;         // Literal name prefix, or NULL
+  int sortKey;          // LIST_SORT_*
+  int descending;
+  uint64_t offset;
+  uint64_t limit;
+};
+
+int listBufferInit(struct listBuffer* out, int fd, size_t cap);
+void listBufferFree(struct listBuffer* out);
+void listFlush(struct listBuffer* out);
+void listWrite(struct listBuffer* out, const void* data, size_t len);
+
+int buildListingIndexes(struct pathTrie* trie);
+int parseListQuery(char* args, struct listQuery* query);
+int sendListing(int dataFd, struct pathTrie* trie, struct listQuery* query);
+int sendListingStatus(int dataFd, int status);
+
+#endif // LISTING_H_
@@ -0,0 +1,223 @@
+/**
+* local.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Same-host transport: a Unix domain socket (-L <path>) next to the TCP port
+* A client on the same machine has no use for HELLO, DATA_PORT and a data
+* connection, or for the file's bytes being copied through two sockets:
+* - It connects to path and sends one request line.  There's no handshake.
+* - "-g <path>" is checked against the index like any other fetch, then the
+*   server opens the file read-only and answers "OK <size> <mtime>\n" with
+*   the descriptor attached (SCM_RIGHTS).  The client reads the file itself
+*   (or copy_file_range()s it, which may not copy at all), so a fetch is one
+*   round trip and no data passes through the server.
+*   Errors are "ERROR_FILE_NOT_FOUND\n" or "ERROR_BAD_COMMAND\n", with
+*   nothing attached.
+* - "-l [<path>]" and "-q <query>" answer on the same socket, in the framed
+*   binary format of listing.c.  -l is the whole directory, in name order.
+*
+* Sessions are forked like TCP ones, and under the same admission control.
+* The descriptor is as good as the file: anyone who can connect to path can
+* read whatever the server serves, the same as over TCP, so path's
+* permissions are the access control.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ftserver.h"
+#include "handoff.h"
+#include "listing.h"
+#include "local.h"
+#include "pathtrie.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "trace.h"
+
+#define DEBUG 0
+
+/*
+* Listens for same-host clients on the Unix socket at path
+* A stale socket left behind by a server that's gone is replaced.  Anything
+* else at path (a socket someone still accepts on, a regular file) is left
+* alone, and is an error.
+* Returns the listening socket, or -1 on error
+*/
+
+int localListen(const char* path) {
+
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    fprintf(stderr, "localListen: socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (claimSocketPath(path) == -1) {
+    return -1;
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    perror("localListen: socket");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(fd, LOCAL_BACKLOG) == -1) {
+    perror("localListen: bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+* Sends line with fd attached, or with nothing attached if fd is -1
+* Returns 0 on success, -1 on error
+*/
+
+int sendDescriptor(int socketFd, const char* line, int fd) {
+
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+
+  memset(&msg, 0, sizeof msg);
+  memset(control, 0, sizeof control);
+  iov.iov_base = (void*)line;
+  iov.iov_len = strlen(line);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (fd != -1) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  while (sendmsg(socketFd, &msg, MSG_NOSIGNAL) == -1) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+* Answers -g: the file's size and mtime, and the file itself, open read-only
+*/
+
+static void passFile(int socketFd, struct pathTrie* trie, const char* path) {
+
+  struct pathNode* node;
+  struct stat fileStat;
+  char reply[64];
+  int fileFd;
+  int64_t span = traceStart();
+
+  node = pathTrieLookup(trie, path);
+  if (node == NULL || !S_ISREG(node->mode) ||
+      (fileFd = pathTrieOpen(trie, node, O_RDONLY | O_CLOEXEC)) == -1) {
+    sendDescriptor(socketFd, "ERROR_FILE_NOT_FOUND\n", -1);
+    return;
+  }
+  if (fstat(fileFd, &fileStat) == -1) {
+    close(fileFd);
+    sendDescriptor(socketFd, "ERROR_FILE_NOT_FOUND\n", -1);
+    return;
+  }
+  traceEnd("lookup", span, 0);
+
+  span = traceStart();
+  snprintf(reply, sizeof reply, "OK %lld %lld\n", (long long)fileStat.st_size,
+           (long long)fileStat.st_mtim.tv_sec);
+  if (sendDescriptor(socketFd, reply, fileFd) == 0) {
+    prefetchRecordHit(path);
+  }
+  close(fileFd);
+  traceEnd("pass_fd", span, fileStat.st_size);
+}
+
+/*
+* Handles the one request a local client sends
+* Its buffers come from arena, which is reset once the request is done
+*/
+
+void handleLocalCommands(int socketFd, struct pathTrie* trie, struct poolArena* arena) {
+
+  char* inBuffer = arenaAlloc(arena, LOCAL_REQUEST_LENGTH);
+  char* inFile = arenaAlloc(arena, LOCAL_PATH_LENGTH);
+  struct timeval timeout = { LOCAL_TIMEOUT_MS / 1000, (LOCAL_TIMEOUT_MS % 1000) * 1000 };
+  ssize_t numbytes;
+  int64_t span = traceStart();
+
+  if (inBuffer == NULL || inFile == NULL) {
+    return;
+  }
+
+  // The request is one short line; don't let a client that never sends it hold a session
+  setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  while ((numbytes = recv(socketFd, inBuffer, LOCAL_REQUEST_LENGTH - 1, 0)) == -1 && errno == EINTR);
+  if (numbytes < 1) {
+    arenaReset(arena);
+    return;
+  }
+  inBuffer[numbytes] = '\0';
+  traceEnd("command", span, numbytes);
+
+  if (DEBUG) {
+    printf("handleLocalCommands - Command Recieved: %s\n", inBuffer);
+  }
+
+  // Local Command: -g <path>
+  if (strncmp("-g", inBuffer, 2) == 0) {
+    parseCommandPath(&inBuffer[2], inFile, LOCAL_PATH_LENGTH);
+    passFile(socketFd, trie, inFile);
+
+  // Local Command: -l [<path>], the whole directory in the -q format
+  } else if (strncmp("-l", inBuffer, 2) == 0) {
+    struct listQuery query;
+
+    parseCommandPath(&inBuffer[2], inFile, LOCAL_PATH_LENGTH);
+    memset(&query, 0, sizeof query);
+    query.path = inFile;
+    query.limit = UINT64_MAX;
+    span = traceStart();
+    sendListing(socketFd, trie, &query);
+    traceEnd("listing", span, 0);
+
+  // Local Command: -q [<path>] [glob=..] [prefix=..] [sort=..] [order=..] [offset=..] [limit=..]
+  } else if (strncmp("-q", inBuffer, 2) == 0) {
+    struct listQuery query;
+
+    if (parseListQuery(&inBuffer[2], &query) == -1) {
+      sendListingStatus(socketFd, LIST_STATUS_BAD_QUERY);
+    } else {
+      span = traceStart();
+      sendListing(socketFd, trie, &query);
+      traceEnd("query", span, 0);
+    }
+
+  } else {
+    sendDescriptor(socketFd, "ERROR_BAD_COMMAND\n", -1);
+  }
+
+  arenaReset(arena);
+}
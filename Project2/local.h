@@ -0,0 +1,16 @@
+#ifndef LOCAL_H_ /* Include Guard */
+#define LOCAL_H_
+
+struct pathTrie;
+struct poolArena;
+
+#define LOCAL_BACKLOG 64                // Pending local connections
+#define LOCAL_REQUEST_LENGTH 4352       // Longest request line
+#define LOCAL_PATH_LENGTH 4096          // Longest path in one
+#define LOCAL_TIMEOUT_MS 5000           // How long a local client gets to send its request
+
+int localListen(const char* path);
+void handleLocalCommands(int socketFd, struct pathTrie* trie, struct poolArena* arena);
+int sendDescriptor(int socketFd, const char* line, int fd);
+
+#endif // LOCAL_H_
@@ -0,0 +1,676 @@
+/**
+* merkle.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Merkle tree over the served tree, and the SYNC command that mirrors a
+* directory with it
+* - With -M, every node in the path trie carries a hash: a file's is its
+*   content hash (the same one conditional -g uses, see validator.c), and a
+*   directory's covers its children's names, types and hashes, in name order.
+*   Two directories with the same hash hold the same files.
+* - The tree is built with the index.  A re-index (SIGHUP) takes each file's
+*   hash from the previous tree when its inode, size and mtime are unchanged,
+*   so only files that changed are read again.
+*
+* A client keeps the hashes the server gave it, and works out the same tree
+* for its copy.  The exchange, on the control connection:
+*   client: SYNC [<path>] <hash|->       its hash for the whole directory
+*   server: SAME                         nothing differs: done
+*        or DIFFERS                      then rounds, each one:
+*   client: <n>                          n directories that differ, each:
+*           <k> <relpath>                  the directory ("." is the root), then
+*           <d|f> <hash> <name>            one line for each of its k entries
+*   server: <m>                          m subdirectories that still differ,
+*           <relpath>                      one per line: send them next round
+*   ...until the server answers 0.  A round covers a whole level of the tree,
+*   so a sync takes about as many round trips as the tree is deep, and an
+*   unchanged mirror of any size takes one.
+*
+* The server then sends what differs on the data connection, as records
+* (integers big-endian, paths relative to the synced directory):
+*   u8 type, u16 path length, path bytes
+*   'f' (file) adds u64 size, i64 mtime (ns since the epoch), u64 hash and the
+*   contents; 'd' is a directory to create; 'x' one to delete; 'e' ends it.
+* Entries the client lacks come over whole, subdirectories included, without
+* any more rounds.
+*/
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ftserver.h"
+#include "listing.h"
+#include "merkle.h"
+#include "pathtrie.h"
+#include "pool.h"
+#include "trace.h"
+#include "tls.h"
+#include "transfer.h"
+#include "validator.h"
+
+#define DEBUG 0
+#define SYNC_INLINE_BYTES 16384   // Files this small are copied into the record stream, not sendfile()d
+
+// Buffered reader for the lines a client sends during SYNC
+struct syncReader {
+  int fd;
+  size_t start;
+  size_t len;
+  char buf[SYNC_LINE_LENGTH];
+};
+
+// Lines for the reply to one round
+struct syncReply {
+  char* buf;
+  size_t len;
+  size_t cap;
+  int count;
+};
+
+/*
+* Hashes a directory from its children's names, types and hashes
+* The children must be hashed already
+*/
+
+uint64_t merkleDirHash(struct pathNode* dir) {
+
+  uint64_t hash = MERKLE_SEED ^ (uint64_t)dir->numChildren;
+  int i;
+
+  for (i = 0; i < dir->numChildren; i++) {
+    struct pathNode* child = dir->children[i];
+    size_t nameLen = strlen(child->name);
+
+    hash = hashWords(hash, child->name, nameLen);
+    hash = hashWord(hash, ((uint64_t)nameLen << 8) | (S_ISDIR(child->mode) ? 'd' : 'f'));
+    hash = hashWord(hash, child->hash);
+  }
+  return hashFinish(hash);
+}
+
+/*
+* Fills in a file node's content hash
+* It's taken from old (the same path in the previous tree) if the file
+* hasn't changed since; otherwise the file is read.  The node's size and
+* mtime are refreshed from the file that was actually hashed.
+* Returns 1 if the file was read, 0 if not
+*/
+
+static int hashFileNode(struct pathTrie* trie, struct pathNode* node, struct pathNode* old) {
+
+  struct stat st;
+  int fd;
+
+  if (old != NULL && S_ISREG(old->mode) && old->ino == node->ino && old->dev == node->dev &&
+      old->size == node->size && old->mtime.tv_sec == node->mtime.tv_sec &&
+      old->mtime.tv_nsec == node->mtime.tv_nsec) {
+    node->hash = old->hash;
+    return 0;
+  }
+
+  // An unreadable file keeps hash 0, which no client copy matches
+  node->hash = 0;
+  if ((fd = pathTrieOpen(trie, node, O_RDONLY)) == -1) {
+    return 0;
+  }
+  if (fstat(fd, &st) == 0 && validatorHash(fd, &st, &node->hash) == 0) {
+    node->size = st.st_size;
+    node->mtime = st.st_mtim;
+  }
+  close(fd);
+  return 1;
+}
+
+/*
+* Hashes every node in trie, bottom up
+* previous is the tree being replaced, or NULL; unchanged files keep the
+* hashes it has for them
+* Returns 0 on success, -1 on allocation failure
+*/
+
+int merkleBuild(struct pathTrie* trie, struct pathTrie* previous) {
+
+  struct merkleFrame {
+    struct pathNode* node;
+    struct pathNode* old;       // The same directory in previous, or NULL
+    int cursor;
+  } *stack;
+  size_t depth = 0, capStack = 64;
+  size_t filesRead = 0, filesKept = 0;
+
+  if ((stack = malloc(capStack * sizeof(*stack))) == NULL) {
+    return -1;
+  }
+  stack[0].node = trie->root;
+  stack[0].old = (previous != NULL && previous->hashed) ? previous->root : NULL;
+  stack[0].cursor = 0;
+  depth = 1;
+
+  while (depth > 0) {
+
+    struct merkleFrame* top = &stack[depth - 1];
+    struct pathNode *child, *oldChild = NULL;
+
+    // Every child is hashed: the directory can be
+    if (top->cursor == top->node->numChildren) {
+      top->node->hash = merkleDirHash(top->node);
+      depth--;
+      continue;
+    }
+
+    child = top->node->children[top->cursor++];
+    if (top->old != NULL) {
+      oldChild = pathTrieFindChild(top->old, child->name, strlen(child->name));
+    }
+
+    if (!S_ISDIR(child->mode)) {
+      if (hashFileNode(trie, child, oldChild)) {
+        filesRead++;
+      } else {
+        filesKept++;
+      }
+      continue;
+    }
+
+    if (depth == capStack) {
+      struct merkleFrame* grown = realloc(stack, capStack * 2 * sizeof(*stack));
+      if (grown == NULL) {
+        free(stack);
+        return -1;
+      }
+      stack = grown;
+      capStack *= 2;
+    }
+    stack[depth].node = child;
+    stack[depth].old = (oldChild != NULL && S_ISDIR(oldChild->mode)) ? oldChild : NULL;
+    stack[depth].cursor = 0;
+    depth++;
+  }
+
+  free(stack);
+  trie->hashed = 1;
+
+  if (DEBUG) {
+    printf("merkleBuild(): read %zu files, kept %zu hashes, root %016llx\n",
+           filesRead, filesKept, (unsigned long long)trie->root->hash);
+  }
+  return 0;
+}
+
+/*
+* Returns the next line from the client, without its line ending, or NULL
+* if the connection closed or the line is too long
+*/
+
+static char* readSyncLine(struct syncReader* in) {
+
+  while (1) {
+    char* newline = memchr(in->buf + in->start, '\n', in->len);
+    ssize_t got;
+
+    if (newline != NULL) {
+      char* line = in->buf + in->start;
+      size_t used = newline - line + 1;
+      *newline = '\0';
+      if (newline > line && newline[-1] == '\r') {
+        newline[-1] = '\0';
+      }
+      in->start += used;
+      in->len -= used;
+      return line;
+    }
+
+    // Make room at the end, then read more
+    memmove(in->buf, in->buf + in->start, in->len);
+    in->start = 0;
+    if (in->len == sizeof in->buf) {
+      return NULL;
+    }
+    got = netRecv(in->fd, in->buf + in->len, sizeof in->buf - in->len, 0);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got < 1) {
+      return NULL;
+    }
+    in->len += got;
+  }
+}
+
+static int addItem(struct syncState* state, struct pathNode* node, char* gone, int subtree) {
+
+  if (state->numItems == state->capItems) {
+    size_t newCap = state->capItems ? state->capItems * 2 : 64;
+    struct syncItem* grown = realloc(state->items, newCap * sizeof(struct syncItem));
+    if (grown == NULL) {
+      free(gone);
+      return -1;
+    }
+    state->items = grown;
+    state->capItems = newCap;
+  }
+  state->items[state->numItems].node = node;
+  state->items[state->numItems].gone = gone;
+  state->items[state->numItems].subtree = subtree;
+  state->numItems++;
+  return 0;
+}
+
+static int addReplyLine(struct syncReply* reply, const char* dir, const char* name) {
+
+  size_t need = strlen(dir) + strlen(name) + 2;
+
+  if (reply->len + need > reply->cap) {
+    size_t newCap = (reply->len + need) * 2;
+    char* grown = realloc(reply->buf, newCap);
+    if (grown == NULL) {
+      return -1;
+    }
+    reply->buf = grown;
+    reply->cap = newCap;
+  }
+  if (strcmp(dir, ".") == 0) {
+    reply->len += sprintf(reply->buf + reply->len, "%s\n", name);
+  } else {
+    reply->len += sprintf(reply->buf + reply->len, "%s/%s\n", dir, name);
+  }
+  reply->count++;
+  return 0;
+}
+
+static char* joinPath(const char* dir, const char* name) {
+
+  char* path;
+
+  if (strcmp(dir, ".") == 0) {
+    return strdup(name);
+  }
+  if (asprintf(&path, "%s/%s", dir, name) == -1) {
+    return NULL;
+  }
+  return path;
+}
+
+static int compareNames(const void* key, const void* member) {
+  return strcmp((const char*)key, (*(struct pathNode* const*)member)->name);
+}
+
+/*
+* Compares one directory the client says differs against ours
+* Reads the client's numEntries entry lines for it.  Files that differ,
+* entries the client lacks and deletions become items to send; subdirectories
+* that differ go into reply for the next round.
+* Returns 0 on success, -1 if the client sent something malformed
+*/
+
+static int compareDirectory(struct syncState* state, struct syncReader* in, const char* relPath,
+                            long numEntries, struct syncReply* reply) {
+
+  struct pathNode* dir;
+  char* fullPath;
+  unsigned char* seen;
+  long j;
+  int i, status = 0;
+
+  if (asprintf(&fullPath, "%s/%s", state->rootPath, relPath) == -1) {
+    return -1;
+  }
+  dir = pathTrieLookup(state->trie, fullPath);
+  free(fullPath);
+  if (dir == NULL || !S_ISDIR(dir->mode) ||
+      (seen = calloc(dir->numChildren ? dir->numChildren : 1, 1)) == NULL) {
+    return -1;
+  }
+
+  for (j = 0; j < numEntries && status == 0; j++) {
+    char* line = readSyncLine(in);
+    struct pathNode** found;
+    struct pathNode* child;
+    char* end;
+    uint64_t hash;
+    int isDir;
+
+    if (line == NULL || (line[0] != 'd' && line[0] != 'f') || line[1] != ' ') {
+      status = -1;
+      break;
+    }
+    isDir = line[0] == 'd';
+    hash = strtoull(line + 2, &end, 16);
+    if (end != line + 18 || *end != ' ' || end[1] == '\0') {
+      status = -1;
+      break;
+    }
+
+    found = bsearch(end + 1, dir->children, dir->numChildren, sizeof(struct pathNode*), compareNames);
+    if (found == NULL) {
+      status = addItem(state, NULL, joinPath(relPath, end + 1), 0);
+      continue;
+    }
+    child = *found;
+    seen[found - dir->children] = 1;
+
+    if (isDir != (S_ISDIR(child->mode) != 0)) {
+      // A file became a directory or the other way round: replace it whole
+      status = addItem(state, NULL, joinPath(relPath, end + 1), 0);
+      if (status == 0) {
+        status = addItem(state, child, NULL, 1);
+      }
+    } else if (hash != child->hash) {
+      status = isDir ? addReplyLine(reply, relPath, child->name) : addItem(state, child, NULL, 0);
+    }
+  }
+
+  // Whatever the client didn't mention, it doesn't have
+  for (i = 0; i < dir->numChildren && status == 0; i++) {
+    if (!seen[i]) {
+      status = addItem(state, dir->children[i], NULL, 1);
+    }
+  }
+  free(seen);
+  return status;
+}
+
+static void writeRecord(struct listBuffer* out, int type, const char* path) {
+
+  unsigned char header[3];
+  size_t pathLen = strlen(path);
+  uint16_t pathLen_be = htobe16((uint16_t)pathLen);
+
+  header[0] = type;
+  memcpy(header + 1, &pathLen_be, 2);
+  listWrite(out, header, sizeof header);
+  listWrite(out, path, pathLen);
+}
+
+/*
+* Writes a file's record and its contents
+* Small files are copied into the buffer so a tree of them goes out in big
+* writes; bigger ones are flushed past and sendfile()d.  A file that can no
+* longer be opened is sent as a deletion instead.
+* Returns 0 on success, -1 if the stream broke
+*/
+
+static int writeFileRecord(struct syncState* state, struct listBuffer* out, struct pathNode* node,
+                           const char* path, char* inlineBuf) {
+
+  struct stat st;
+  unsigned char fixed[24];
+  uint64_t hash, size_be, mtime_be, hash_be;
+  int fd;
+  off_t sent;
+
+  if ((fd = pathTrieOpen(state->trie, node, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    writeRecord(out, SYNC_RECORD_GONE, path);
+    return out->failed ? -1 : 0;
+  }
+
+  // The tree's hash is only good for the file it was taken from
+  hash = node->hash;
+  if (st.st_size != node->size || st.st_mtim.tv_sec != node->mtime.tv_sec ||
+      st.st_mtim.tv_nsec != node->mtime.tv_nsec) {
+    if (validatorHash(fd, &st, &hash) == -1) {
+      hash = 0;
+    }
+  }
+
+  size_be = htobe64((uint64_t)st.st_size);
+  mtime_be = htobe64((uint64_t)((int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec));
+  hash_be = htobe64(hash);
+  memcpy(fixed, &size_be, 8);
+  memcpy(fixed + 8, &mtime_be, 8);
+  memcpy(fixed + 16, &hash_be, 8);
+  writeRecord(out, SYNC_RECORD_FILE, path);
+  listWrite(out, fixed, sizeof fixed);
+
+  if (st.st_size <= SYNC_INLINE_BYTES) {
+    off_t got = 0;
+    while (got < st.st_size) {
+      ssize_t n = pread(fd, inlineBuf + got, st.st_size - got, got);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n < 1) {
+        break;
+      }
+      got += n;
+    }
+    close(fd);
+    if (got != st.st_size) {
+      return -1;        // It shrank: the size we promised is wrong
+    }
+    listWrite(out, inlineBuf, got);
+    return out->failed ? -1 : 0;
+  }
+
+  listFlush(out);
+  sent = out->failed ? -1 : streamFile(out->fd, fd, 0, st.st_size);
+  close(fd);
+  return sent == st.st_size ? 0 : -1;
+}
+
+/*
+* Sends every item on dataFd, then the end record
+* Returns the number of records sent, or -1 if the stream broke
+*/
+
+static long streamItems(struct syncState* state, int dataFd) {
+
+  struct listBuffer out;
+  struct pathNode** stack = NULL;
+  size_t depth, capStack, i;
+  char* path = NULL;
+  size_t capPath = 0;
+  char* inlineBuf;
+  size_t inlineCap;
+  long records = 0;
+  int status = 0;
+  unsigned char end = SYNC_RECORD_END;
+
+  if (listBufferInit(&out, dataFd, SYNC_STREAM_BUFFER) == -1) {
+    return -1;
+  }
+  capStack = 64;
+  inlineBuf = poolGet(SYNC_INLINE_BYTES, SYNC_INLINE_BYTES, &inlineCap);
+  stack = malloc(capStack * sizeof(struct pathNode*));
+  if (inlineBuf == NULL || stack == NULL) {
+    if (inlineBuf != NULL) {
+      poolPut(inlineBuf);
+    }
+    free(stack);
+    listBufferFree(&out);
+    return -1;
+  }
+
+  for (i = 0; i < state->numItems && status == 0; i++) {
+    struct syncItem* item = &state->items[i];
+
+    if (item->node == NULL) {
+      writeRecord(&out, SYNC_RECORD_GONE, item->gone);
+      records++;
+      continue;
+    }
+
+    // A new subtree goes out whole, directories before what's in them
+    depth = 0;
+    stack[depth++] = item->node;
+
+    while (depth > 0 && status == 0) {
+      struct pathNode* node = stack[--depth];
+      int c;
+
+      if (pathTrieRelativePath(node, state->root, &path, &capPath) == -1) {
+        status = -1;
+        break;
+      }
+      records++;
+      if (!S_ISDIR(node->mode)) {
+        status = writeFileRecord(state, &out, node, path, inlineBuf);
+        continue;
+      }
+      writeRecord(&out, SYNC_RECORD_DIR, path);
+      if (!item->subtree) {
+        continue;
+      }
+      // Pushed in reverse so they come off in name order
+      for (c = node->numChildren - 1; c >= 0; c--) {
+        if (depth == capStack) {
+          struct pathNode** grown = realloc(stack, capStack * 2 * sizeof(struct pathNode*));
+          if (grown == NULL) {
+            status = -1;
+            break;
+          }
+          stack = grown;
+          capStack *= 2;
+        }
+        stack[depth++] = node->children[c];
+      }
+    }
+    if (out.failed) {
+      status = -1;
+    }
+  }
+
+  if (status == 0) {
+    listWrite(&out, &end, 1);
+    listFlush(&out);
+  }
+  if (out.failed) {
+    status = -1;
+  }
+  listBufferFree(&out);
+  poolPut(inlineBuf);
+  free(stack);
+  free(path);
+  return status == 0 ? records : -1;
+}
+
+/*
+* Handles "SYNC [<path>] <hash|->" for the rest of the session
+* See the top of this file for the exchange
+*/
+
+void handleSync(int socketFd, struct dataEndpoint* data, struct pathTrie* trie, const char* args) {
+
+  char first[SYNC_LINE_LENGTH], second[SYNC_LINE_LENGTH];
+  const char *path, *hashArg;
+  struct syncState state;
+  struct syncReader* in;
+  struct syncReply reply;
+  uint64_t clientHash = 0;
+  long rounds = 0, records;
+  size_t i;
+  int status = 0;
+  int64_t span;
+
+  parseCommandPath(parseCommandPath(args, first, sizeof first), second, sizeof second);
+  path = second[0] != '\0' ? first : "";
+  hashArg = second[0] != '\0' ? second : first;
+
+  if (!trie->hashed) {
+    netSend(socketFd, "ERROR_SYNC_DISABLED\n", 20, 0);
+    return;
+  }
+  if (strcmp(hashArg, "-") != 0) {
+    char* end;
+    clientHash = strtoull(hashArg, &end, 16);
+    if (end - hashArg != 16 || *end != '\0') {
+      netSend(socketFd, "ERROR_BAD_COMMAND\n", 18, 0);
+      return;
+    }
+  }
+
+  memset(&state, 0, sizeof state);
+  state.trie = trie;
+  state.rootPath = (char*)path;
+  if ((state.root = pathTrieLookup(trie, path)) == NULL) {
+    netSend(socketFd, "ERROR_FILE_NOT_FOUND\n", 21, 0);
+    return;
+  }
+  if (!S_ISDIR(state.root->mode)) {
+    netSend(socketFd, "ERROR_NOT_A_DIRECTORY\n", 22, 0);
+    return;
+  }
+
+  if (strcmp(hashArg, "-") != 0 && clientHash == state.root->hash) {
+    netSend(socketFd, "SAME\n", 5, 0);
+    return;
+  }
+  if (sendAll(socketFd, "DIFFERS\n", 8) == -1 || (in = calloc(1, sizeof(struct syncReader))) == NULL) {
+    return;
+  }
+  in->fd = socketFd;
+  memset(&reply, 0, sizeof reply);
+
+  // One round per level of the tree that still differs
+  do {
+    char* line = readSyncLine(in);
+    char countLine[24];
+    long numDirs, d;
+
+    span = traceStart();
+    reply.len = 0;
+    reply.count = 0;
+    if (line == NULL || (numDirs = strtol(line, NULL, 10)) < 0) {
+      status = -1;
+      break;
+    }
+    for (d = 0; d < numDirs && status == 0; d++) {
+      char* dirPath;
+      long numEntries;
+
+      if ((line = readSyncLine(in)) == NULL) {
+        status = -1;
+        break;
+      }
+      numEntries = strtol(line, &dirPath, 10);
+      if (numEntries < 0 || *dirPath != ' ' || (dirPath = strdup(dirPath + 1)) == NULL) {
+        status = -1;
+        break;
+      }
+      status = compareDirectory(&state, in, dirPath, numEntries, &reply);
+      free(dirPath);
+    }
+    if (status == -1) {
+      break;
+    }
+
+    snprintf(countLine, sizeof countLine, "%d\n", reply.count);
+    if (sendAll(socketFd, countLine, strlen(countLine)) == -1 ||
+        (reply.len > 0 && sendAll(socketFd, reply.buf, reply.len) == -1)) {
+      status = -1;
+    }
+    rounds++;
+    traceEnd("sync_compare", span, numDirs);
+  } while (status == 0 && reply.count > 0);
+
+  free(reply.buf);
+  free(in);
+
+  if (status == 0) {
+    span = traceStart();
+    records = openDataConnection(data) == -1 ? -1 : streamItems(&state, data->fd);
+    traceEnd("sync_stream", span, records);
+    if (DEBUG) {
+      printf("handleSync(): %ld rounds, %zu items, %ld records\n", rounds, state.numItems, records);
+    }
+  } else {
+    netSend(socketFd, "ERROR_BAD_COMMAND\n", 18, 0);
+  }
+
+  for (i = 0; i < state.numItems; i++) {
+    free(state.items[i].gone);
+  }
+  free(state.items);
+}
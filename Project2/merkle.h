@@ -0,0 +1,41 @@
+#ifndef MERKLE_H_ /* Include Guard */
+#define MERKLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct dataEndpoint;
+struct pathNode;
+struct pathTrie;
+
+#define MERKLE_SEED 0x4D45524B4C455452ULL  // Starts every directory's hash
+#define SYNC_LINE_LENGTH 4352               // Longest line a client may send during SYNC
+#define SYNC_STREAM_BUFFER 65536            // Size of the buffer records are written through
+
+#define SYNC_RECORD_FILE 'f'                // Create or replace a file; its contents follow
+#define SYNC_RECORD_DIR 'd'                 // Create a directory
+#define SYNC_RECORD_GONE 'x'                // Delete: the server no longer has it
+#define SYNC_RECORD_END 'e'                 // Nothing more follows
+
+// Something SYNC will send once the comparison is done
+struct syncItem {
+  struct pathNode* node;                    // NULL for a deletion
+  char* gone;                               // Path (relative to the sync root) to delete
+  int subtree;                              // Send everything beneath node as well
+};
+
+// One SYNC session's state
+struct syncState {
+  struct pathTrie* trie;
+  struct pathNode* root;                    // The directory being mirrored
+  char* rootPath;                           // Its path, as the client named it
+  struct syncItem* items;
+  size_t numItems;
+  size_t capItems;
+};
+
+int merkleBuild(struct pathTrie* trie, struct pathTrie* previous);
+uint64_t merkleDirHash(struct pathNode* dir);
+void handleSync(int socketFd, struct dataEndpoint* data, struct pathTrie* trie, const char* args);
+
+#endif // MERKLE_H_
@@ -0,0 +1,480 @@
+/**
+* pathtrie.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* In-memory index of the directory tree ftserver serves.
+* - Each node is one path component, children sorted by name
+* - Built once (and rebuilt on SIGHUP) so requests never walk the disk
+*   to find a file or produce a listing
+* - Files are opened relative to the root descriptor with openat2()
+*   (RESOLVE_BENEATH), falling back to a component-by-component
+*   openat(O_NOFOLLOW) walk, so a request can never escape the root
+*
+* The build is iterative and only holds one directory descriptor open at a
+* time, so trees thousands of directories deep don't blow the stack or the
+* descriptor limit.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#include "pathtrie.h"
+
+#define DEBUG 0
+#define INITIAL_CHILDREN 8      // First allocation for a directory's child array
+
+/*
+* Allocates a node for the supplied name and stat info
+*/
+
+static struct pathNode* newNode(const char* name, struct pathNode* parent, struct stat* st) {
+
+  struct pathNode* node = calloc(1, sizeof(struct pathNode));
+  if (node == NULL) {
+    return NULL;
+  }
+
+  node->name = strdup(name);
+  if (node->name == NULL) {
+    free(node);
+    return NULL;
+  }
+  node->parent = parent;
+  node->mode = st->st_mode;
+  node->size = st->st_size;
+  node->mtime = st->st_mtim;
+  node->ino = st->st_ino;
+  node->dev = st->st_dev;
+  return node;
+}
+
+static int addChild(struct pathNode* dir, struct pathNode* child) {
+
+  if (dir->numChildren == dir->capChildren) {
+    int newCap = dir->capChildren ? dir->capChildren * 2 : INITIAL_CHILDREN;
+    struct pathNode** grown = realloc(dir->children, newCap * sizeof(struct pathNode*));
+    if (grown == NULL) {
+      return -1;
+    }
+    dir->children = grown;
+    dir->capChildren = newCap;
+  }
+  dir->children[dir->numChildren++] = child;
+  return 0;
+}
+
+static int compareNodes(const void* a, const void* b) {
+  const struct pathNode* left = *(const struct pathNode**)a;
+  const struct pathNode* right = *(const struct pathNode**)b;
+  return strcmp(left->name, right->name);
+}
+
+/*
+* Reads every entry of the directory open on dirFd into dir's child array
+* Only regular files and directories are indexed; symlinks and devices are skipped
+*/
+
+static int readChildren(struct pathTrie* trie, struct pathNode* dir, int dirFd) {
+
+  DIR *dir_p;               // Pointer to the directory handle
+  struct dirent *entry_p;   // Pointer to the directory entry
+  struct stat entryStat;    // stat info for the directory entry
+  int listFd;
+
+  // fdopendir() takes ownership of the descriptor, so hand it a copy
+  if ((listFd = dup(dirFd)) == -1) {
+    return -1;
+  }
+  if ((dir_p = fdopendir(listFd)) == NULL) {
+    close(listFd);
+    return -1;
+  }
+
+  while ((entry_p = readdir(dir_p)) != NULL) {
+
+    if (strcmp(entry_p->d_name, ".") == 0 || strcmp(entry_p->d_name, "..") == 0) {
+      continue;
+    }
+    if (fstatat(dirFd, entry_p->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) == -1) {
+      continue;
+    }
+    if (!S_ISREG(entryStat.st_mode) && !S_ISDIR(entryStat.st_mode)) {
+      continue;
+    }
+
+    struct pathNode* child = newNode(entry_p->d_name, dir, &entryStat);
+    if (child == NULL || addChild(dir, child) == -1) {
+      closedir(dir_p);
+      return -1;
+    }
+    trie->numNodes++;
+  }
+  closedir(dir_p);
+
+  if (dir->numChildren > 1) {
+    qsort(dir->children, dir->numChildren, sizeof(struct pathNode*), compareNodes);
+  }
+  return 0;
+}
+
+/*
+* Opens node by walking its components down from the root descriptor
+* Intermediate directories are opened O_PATH|O_NOFOLLOW, the last one with flags
+*/
+
+static int walkFromRoot(struct pathTrie* trie, struct pathNode* node, int flags) {
+
+  struct pathNode** chain;
+  struct pathNode* p;
+  int depth = 0;
+  int i;
+  int fd, nextFd;
+
+  for (p = node; p->parent != NULL; p = p->parent) {
+    depth++;
+  }
+  if (depth == 0) {
+    return openat(trie->rootFd, ".", flags | O_CLOEXEC);
+  }
+
+  if ((chain = malloc(depth * sizeof(struct pathNode*))) == NULL) {
+    return -1;
+  }
+  i = depth;
+  for (p = node; p->parent != NULL; p = p->parent) {
+    chain[--i] = p;
+  }
+
+  fd = trie->rootFd;
+  for (i = 0; i < depth; i++) {
+    int stepFlags = (i == depth - 1) ? flags : (O_PATH | O_DIRECTORY);
+    nextFd = openat(fd, chain[i]->name, stepFlags | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != trie->rootFd) {
+      close(fd);
+    }
+    if (nextFd == -1) {
+      free(chain);
+      return -1;
+    }
+    fd = nextFd;
+  }
+
+  free(chain);
+  return fd;
+}
+
+/*
+* Builds the trie for rootPath
+* Returns 0 on success, -1 on error
+*/
+
+int pathTrieBuild(struct pathTrie* trie, const char* rootPath) {
+
+  struct stat rootStat;
+  struct pathNode* node;
+  int* cursors = NULL;      // Next child index to visit, one per level of the walk
+  size_t depth = 0;
+  size_t capCursors = 0;
+  int fd, nextFd;
+
+  memset(trie, 0, sizeof(struct pathTrie));
+  trie->rootFd = -1;
+
+  if ((trie->rootPath = strdup(rootPath)) == NULL) {
+    return -1;
+  }
+  if ((trie->rootFd = open(rootPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    perror("pathTrieBuild: open root");
+    pathTrieFree(trie);
+    return -1;
+  }
+  if (fstat(trie->rootFd, &rootStat) == -1 || (trie->root = newNode("", NULL, &rootStat)) == NULL) {
+    pathTrieFree(trie);
+    return -1;
+  }
+  trie->numNodes = 1;
+
+  // Depth-first walk holding only the current directory open.
+  // We descend with openat(name) and climb back out with openat("..")
+  if ((fd = openat(trie->rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    pathTrieFree(trie);
+    return -1;
+  }
+  node = trie->root;
+  if (readChildren(trie, node, fd) == -1) {
+    goto fail;
+  }
+
+  capCursors = 64;
+  if ((cursors = malloc(capCursors * sizeof(int))) == NULL) {
+    goto fail;
+  }
+  cursors[depth++] = 0;
+
+  while (depth > 0) {
+
+    struct pathNode* next = NULL;
+    int* cursor = &cursors[depth - 1];
+
+    while (*cursor < node->numChildren) {
+      struct pathNode* child = node->children[(*cursor)++];
+      if (S_ISDIR(child->mode)) {
+        next = child;
+        break;
+      }
+    }
+
+    if (next != NULL) {
+      // Descend.  If the directory vanished or is unreadable, index it as empty
+      nextFd = openat(fd, next->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (nextFd == -1) {
+        continue;
+      }
+      close(fd);
+      fd = nextFd;
+      node = next;
+      if (readChildren(trie, node, fd) == -1) {
+        goto fail;
+      }
+
+      if (depth == capCursors) {
+        int* grown = realloc(cursors, capCursors * 2 * sizeof(int));
+        if (grown == NULL) {
+          goto fail;
+        }
+        cursors = grown;
+        capCursors *= 2;
+      }
+      cursors[depth++] = 0;
+      continue;
+    }
+
+    // Done with this directory, climb back out
+    depth--;
+    if (depth == 0) {
+      break;
+    }
+
+    struct stat parentStat;
+    nextFd = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    node = node->parent;
+
+    // If something was renamed underneath us, ".." may no longer be our parent.
+    // Re-open it the long way from the root instead.
+    if (nextFd == -1 || fstat(nextFd, &parentStat) == -1 ||
+        parentStat.st_ino != node->ino || parentStat.st_dev != node->dev) {
+      if (nextFd != -1) {
+        close(nextFd);
+      }
+      nextFd = walkFromRoot(trie, node, O_RDONLY | O_DIRECTORY);
+      if (nextFd == -1) {
+        goto fail;
+      }
+    }
+    close(fd);
+    fd = nextFd;
+  }
+
+  close(fd);
+  free(cursors);
+
+  if (DEBUG) {
+    printf("pathTrieBuild(): indexed %zu nodes under %s\n", trie->numNodes, rootPath);
+  }
+  return 0;
+
+fail:
+  close(fd);
+  free(cursors);
+  pathTrieFree(trie);
+  return -1;
+}
+
+/*
+* Releases every node and the root descriptor
+* Walks the tree without recursion, consuming each child array as it goes
+*/
+
+void pathTrieFree(struct pathTrie* trie) {
+
+  struct pathNode* node = trie->root;
+
+  while (node != NULL) {
+    if (node->numChildren > 0) {
+      node = node->children[--node->numChildren];
+      continue;
+    }
+    struct pathNode* parent = node->parent;
+    free(node->bySize);
+    free(node->byMtime);
+    free(node->children);
+    free(node->name);
+    free(node);
+    node = parent;
+  }
+
+  if (trie->rootFd != -1) {
+    close(trie->rootFd);
+  }
+  free(trie->rootPath);
+  memset(trie, 0, sizeof(struct pathTrie));
+  trie->rootFd = -1;
+}
+
+/*
+* Binary search for a child named by the first nameLen bytes of name
+*/
+
+struct pathNode* pathTrieFindChild(struct pathNode* dir, const char* name, size_t nameLen) {
+
+  int low = 0;
+  int high = dir->numChildren - 1;
+
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    const char* candidate = dir->children[mid]->name;
+    int cmp = strncmp(candidate, name, nameLen);
+    if (cmp == 0 && candidate[nameLen] != '\0') {
+      cmp = 1;   // candidate is longer, so it sorts after name
+    }
+    if (cmp == 0) {
+      return dir->children[mid];
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return NULL;
+}
+
+/*
+* Resolves a client-supplied path relative to the root
+* Empty and "." components are ignored; ".." is rejected outright
+* Returns NULL if the path isn't in the index
+*/
+
+struct pathNode* pathTrieLookup(struct pathTrie* trie, const char* path) {
+
+  struct pathNode* node = trie->root;
+  const char* p = path;
+
+  while (node != NULL && *p != '\0') {
+
+    const char* end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+
+    if (len == 2 && p[0] == '.' && p[1] == '.') {
+      return NULL;
+    }
+    if (len > 0 && !(len == 1 && p[0] == '.')) {
+      if (!S_ISDIR(node->mode)) {
+        return NULL;
+      }
+      node = pathTrieFindChild(node, p, len);
+    }
+    p += len;
+    if (*p == '/') {
+      p++;
+    }
+  }
+  return node;
+}
+
+/*
+* Writes node's path relative to the root into *buf, growing it as needed
+* Returns the length of the path, or -1 on allocation failure
+*/
+
+int pathTrieNodePath(struct pathNode* node, char** buf, size_t* cap) {
+  return pathTrieRelativePath(node, NULL, buf, cap);
+}
+
+/*
+* Writes node's path relative to its ancestor root (NULL for the trie's
+* root) into *buf, growing it as needed
+* Returns the length of the path, or -1 on allocation failure
+*/
+
+int pathTrieRelativePath(struct pathNode* node, struct pathNode* root, char** buf, size_t* cap) {
+
+  struct pathNode* p;
+  size_t len = 0;
+  size_t pos;
+
+  for (p = node; p != root && p->parent != NULL; p = p->parent) {
+    len += strlen(p->name) + 1;
+  }
+  if (len == 0) {
+    len = 1;
+  }
+
+  if (*cap < len) {
+    char* grown = realloc(*buf, len);
+    if (grown == NULL) {
+      return -1;
+    }
+    *buf = grown;
+    *cap = len;
+  }
+
+  // Fill from the end backwards, separators between components
+  pos = len - 1;
+  (*buf)[pos] = '\0';
+  for (p = node; p != root && p->parent != NULL; p = p->parent) {
+    size_t nameLen = strlen(p->name);
+    pos -= nameLen;
+    memcpy(*buf + pos, p->name, nameLen);
+    if (pos > 0) {
+      (*buf)[--pos] = '/';
+    }
+  }
+  return (int)strlen(*buf);
+}
+
+/*
+* Opens an indexed node without letting the resolution leave the root
+* Returns a descriptor, or -1 with errno set
+*/
+
+int pathTrieOpen(struct pathTrie* trie, struct pathNode* node, int flags) {
+
+#ifdef SYS_openat2
+  char* path = NULL;
+  size_t cap = 0;
+  struct open_how how;
+  int fd;
+
+  if (node->parent != NULL && pathTrieNodePath(node, &path, &cap) != -1) {
+    memset(&how, 0, sizeof how);
+    how.flags = flags | O_CLOEXEC | O_NOFOLLOW;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+    fd = syscall(SYS_openat2, trie->rootFd, path, &how, sizeof how);
+    free(path);
+
+    // Old kernels lack openat2, and very deep paths exceed PATH_MAX.
+    // Both cases fall through to the manual walk.
+    if (fd >= 0 || (errno != ENOSYS && errno != ENAMETOOLONG)) {
+      return fd;
+    }
+  } else {
+    free(path);
+  }
+#endif
+
+  return walkFromRoot(trie, node, flags);
+}
@@ -0,0 +1,44 @@
+#ifndef PATHTRIE_H_ /* Include Guard */
+#define PATHTRIE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+// One node per path component under the served root
+// Children are kept sorted by name so lookups are a binary search per level
+struct pathNode {
+  char* name;                    // Component name (root is "")
+  struct pathNode* parent;       // NULL for the root
+  struct pathNode** children;    // Sorted by strcmp(name)
+  int numChildren;
+  int capChildren;
+  mode_t mode;                   // S_IFDIR or S_IFREG plus permissions
+  off_t size;
+  struct timespec mtime;
+  ino_t ino;
+  dev_t dev;
+  uint64_t hash;                 // Merkle hash (content hash for files), see merkle.c
+  int* bySize;                   // Child indexes ordered by size, see buildListingIndexes()
+  int* byMtime;                  // Child indexes ordered by mtime
+};
+
+// In-memory index of the whole served tree
+struct pathTrie {
+  int rootFd;                    // O_DIRECTORY descriptor all opens are relative to
+  char* rootPath;
+  struct pathNode* root;
+  size_t numNodes;
+  int hashed;                    // Every node's hash is filled in (merkleBuild())
+};
+
+int pathTrieBuild(struct pathTrie* trie, const char* rootPath);
+void pathTrieFree(struct pathTrie* trie);
+struct pathNode* pathTrieLookup(struct pathTrie* trie, const char* path);
+struct pathNode* pathTrieFindChild(struct pathNode* dir, const char* name, size_t nameLen);
+int pathTrieOpen(struct pathTrie* trie, struct pathNode* node, int flags);
+int pathTrieNodePath(struct pathNode* node, char** buf, size_t* cap);
+int pathTrieRelativePath(struct pathNode* node, struct pathNode* root, char** buf, size_t* cap);
+
+#endif // PATHTRIE_H_
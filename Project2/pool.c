@@ -0,0 +1,290 @@
+/**
+* pool.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Session memory: size-classed I/O buffers from one shared slab, under a
+* global budget
+* - Every session is its own process, so a buffer each one malloc()s is
+*   private memory: a thousand sessions listing directories held a thousand
+*   64KB buffers, busy or not.  Instead, the I/O buffers (listings, hashing,
+*   SYNC records) come from a slab mapped MAP_SHARED before the first fork().
+*   A buffer one session gives back is the next session's, so the pages
+*   stay the same ones: memory follows the data in flight, not the session
+*   count.
+* - The slab is -b megabytes, split evenly between POOL_CLASSES size
+*   classes.  poolGet() takes the class that fits, or a smaller one (no
+*   smaller than the caller can live with), or a bigger one.  If the
+*   whole pool is dry it falls back to a private malloc() of the minimum,
+*   so a session never fails for lack of a buffer.
+* - The accept loop asks poolAdmit() before forking a session.  While less
+*   than POOL_ADMIT_BYTES is free, new clients wait in the listen backlog
+*   instead of piling on.
+* - A session's command buffers come from a small arena, itself one pool
+*   buffer, that's reset between commands and handed back at the end.
+*
+* Free lists are lock-free stacks with a generation count against ABA.
+* Each buffer records the pid holding it, so poolReclaim() can take back
+* what a session that died was holding.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "pool.h"
+
+#define DEBUG 0
+
+static struct poolState* gPool = NULL;   // Shared free lists and counters
+static uint32_t* gNext = NULL;           // Per buffer: index + 1 of the next free one
+static int32_t* gOwner = NULL;           // Per buffer: pid holding it, 0 = free
+static char* gSlab = NULL;
+
+/*
+* Maps the shared slab and carves it into size classes
+* Must be called before the first fork() so every session shares it
+* Returns 0 on success, -1 on error
+*/
+
+int poolInit(size_t budget) {
+
+  size_t perClass = budget / POOL_CLASSES;
+  size_t numBuffers = 0, headerBytes, offset = 0;
+  long pageSize = sysconf(_SC_PAGESIZE);
+  void* mapping;
+  int c;
+  uint32_t i;
+
+  for (c = 0; c < POOL_CLASSES; c++) {
+    numBuffers += perClass >> (POOL_MIN_SHIFT + c * POOL_CLASS_SHIFT);
+  }
+  headerBytes = sizeof(struct poolState) + numBuffers * (sizeof(uint32_t) + sizeof(int32_t));
+  headerBytes = (headerBytes + pageSize - 1) / pageSize * pageSize;
+
+  // Nothing is committed until it's touched
+  mapping = mmap(NULL, headerBytes + budget, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    perror("poolInit: mmap");
+    return -1;
+  }
+  gPool = mapping;
+  gNext = (uint32_t*)(gPool + 1);
+  gOwner = (int32_t*)(gNext + numBuffers);
+  gSlab = (char*)mapping + headerBytes;
+  gPool->numBuffers = numBuffers;
+
+  numBuffers = 0;
+  for (c = 0; c < POOL_CLASSES; c++) {
+    struct poolClass* cls = &gPool->classes[c];
+
+    cls->size = (uint64_t)1 << (POOL_MIN_SHIFT + c * POOL_CLASS_SHIFT);
+    cls->count = perClass / cls->size;
+    cls->first = numBuffers;
+    cls->offset = offset;
+
+    // Chain them all onto the free list, in address order
+    for (i = 0; i < cls->count; i++) {
+      gNext[cls->first + i] = (i + 1 < cls->count) ? cls->first + i + 2 : 0;
+    }
+    cls->head = cls->count ? cls->first + 1 : 0;
+
+    numBuffers += cls->count;
+    offset += cls->count * cls->size;
+    gPool->budget += cls->count * cls->size;
+  }
+  gPool->freeBytes = gPool->budget;
+
+  if (DEBUG) {
+    printf("poolInit(): %llu bytes in %u buffers\n", (unsigned long long)gPool->budget, gPool->numBuffers);
+  }
+  return 0;
+}
+
+// Takes a buffer off class c's free list; returns its index, or -1 if it's empty
+static int64_t popClass(int c) {
+
+  struct poolClass* cls = &gPool->classes[c];
+  uint64_t head = __atomic_load_n(&cls->head, __ATOMIC_ACQUIRE);
+
+  while ((uint32_t)head != 0) {
+    uint32_t index = (uint32_t)head - 1;
+    uint64_t next = __atomic_load_n(&gNext[index], __ATOMIC_RELAXED);
+    uint64_t replacement = (((head >> 32) + 1) << 32) | next;
+
+    if (__atomic_compare_exchange_n(&cls->head, &head, replacement, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&gOwner[index], (int32_t)getpid(), __ATOMIC_RELAXED);
+      __atomic_sub_fetch(&gPool->freeBytes, cls->size, __ATOMIC_RELAXED);
+      return index;
+    }
+  }
+  return -1;
+}
+
+static void pushClass(int c, uint32_t index) {
+
+  struct poolClass* cls = &gPool->classes[c];
+  uint64_t head = __atomic_load_n(&cls->head, __ATOMIC_ACQUIRE);
+  uint64_t replacement;
+
+  __atomic_store_n(&gOwner[index], 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&gPool->freeBytes, cls->size, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&gNext[index], (uint32_t)head, __ATOMIC_RELAXED);
+    replacement = (((head >> 32) + 1) << 32) | (index + 1);
+  } while (!__atomic_compare_exchange_n(&cls->head, &head, replacement, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static char* bufferAt(int c, uint32_t index) {
+  struct poolClass* cls = &gPool->classes[c];
+  return gSlab + cls->offset + (index - cls->first) * cls->size;
+}
+
+/*
+* Gets a buffer of about want bytes, and never less than min
+* The class that fits want is tried first, then smaller ones down to min,
+* then bigger ones.  *got is set to the buffer's actual size.
+* Returns the buffer, or NULL if even a malloc() of min failed
+*/
+
+void* poolGet(size_t want, size_t min, size_t* got) {
+
+  int fit = 0, c;
+  int64_t index;
+  void* buf;
+
+  if (gPool != NULL) {
+    while (fit < POOL_CLASSES - 1 && gPool->classes[fit].size < want) {
+      fit++;
+    }
+    for (c = fit; c >= 0 && gPool->classes[c].size >= min; c--) {
+      if ((index = popClass(c)) != -1) {
+        *got = gPool->classes[c].size;
+        return bufferAt(c, index);
+      }
+    }
+    for (c = fit + 1; c < POOL_CLASSES; c++) {
+      if ((index = popClass(c)) != -1) {
+        *got = gPool->classes[c].size;
+        return bufferAt(c, index);
+      }
+    }
+    __atomic_add_fetch(&gPool->fallbacks, 1, __ATOMIC_RELAXED);
+    want = min;
+  }
+
+  // No pool, or it's dry: a private buffer, as small as will do
+  buf = malloc(want);
+  *got = buf != NULL ? want : 0;
+  return buf;
+}
+
+/*
+* Gives back a buffer from poolGet()
+*/
+
+void poolPut(void* buf) {
+
+  char* p = buf;
+  int c;
+
+  if (gPool == NULL || p < gSlab || p >= gSlab + gPool->budget) {
+    free(buf);
+    return;
+  }
+  for (c = POOL_CLASSES - 1; c > 0 && p < gSlab + gPool->classes[c].offset; c--);
+  pushClass(c, gPool->classes[c].first + (p - gSlab - gPool->classes[c].offset) / gPool->classes[c].size);
+}
+
+/*
+* Whether there's room for another session
+*/
+
+int poolAdmit(void) {
+  return gPool == NULL || __atomic_load_n(&gPool->freeBytes, __ATOMIC_RELAXED) >= POOL_ADMIT_BYTES;
+}
+
+/*
+* Takes back the buffers held by sessions that have exited without
+* returning them (killed, or gone through an error exit)
+* Returns the number of bytes reclaimed
+*/
+
+size_t poolReclaim(void) {
+
+  size_t reclaimed = 0;
+  uint32_t index;
+  int c = 0;
+
+  if (gPool == NULL) {
+    return 0;
+  }
+  for (index = 0; index < gPool->numBuffers; index++) {
+    int32_t owner = __atomic_load_n(&gOwner[index], __ATOMIC_RELAXED);
+
+    while (c < POOL_CLASSES - 1 && index >= gPool->classes[c + 1].first) {
+      c++;
+    }
+    if (owner <= 0 || kill(owner, 0) == 0 || errno != ESRCH) {
+      continue;
+    }
+    // Only one reclaimer gets it
+    if (__atomic_compare_exchange_n(&gOwner[index], &owner, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      pushClass(c, index);
+      reclaimed += gPool->classes[c].size;
+    }
+  }
+
+  if (DEBUG && reclaimed > 0) {
+    printf("poolReclaim(): %zu bytes back from exited sessions\n", reclaimed);
+  }
+  return reclaimed;
+}
+
+/*
+* Takes a pool buffer of cap bytes to allocate from
+* Returns 0 on success, -1 on error
+*/
+
+int arenaInit(struct poolArena* arena, size_t cap) {
+
+  arena->used = 0;
+  arena->base = poolGet(cap, cap, &arena->cap);
+  return arena->base != NULL ? 0 : -1;
+}
+
+/*
+* Hands out len bytes, 16-byte aligned
+* Returns NULL if the arena is full
+*/
+
+void* arenaAlloc(struct poolArena* arena, size_t len) {
+
+  size_t start = (arena->used + 15) & ~(size_t)15;
+
+  if (arena->base == NULL || start + len > arena->cap) {
+    return NULL;
+  }
+  arena->used = start + len;
+  return arena->base + start;
+}
+
+void arenaReset(struct poolArena* arena) {
+  arena->used = 0;
+}
+
+void arenaRelease(struct poolArena* arena) {
+  if (arena->base != NULL) {
+    poolPut(arena->base);
+  }
+  arena->base = NULL;
+  arena->used = 0;
+  arena->cap = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef POOL_H_ /* Include Guard */
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_CLASSES 5                  // 4KB, 16KB, 64KB, 256KB, 1MB
+#define POOL_MIN_SHIFT 12               // The smallest class is 1 << this bytes
+#define POOL_CLASS_SHIFT 2              // Each class is 1 << this times the one before
+#define POOL_MIN_BYTES (1 << POOL_MIN_SHIFT)
+#define POOL_DEFAULT_BUDGET (64LL << 20) // Bytes every session's buffers share (-b)
+#define POOL_MAX_BUDGET_MB (64 << 10)  // Largest -b, in MB
+#define POOL_ADMIT_BYTES (64 << 10)     // Free pool memory a new session needs to be admitted
+#define POOL_WAIT_MS 10                 // How long admission waits before looking again
+#define SESSION_ARENA_BYTES (16 << 10)  // Scratch space for a session's command
+
+// One size class: a free list of equal buffers carved out of the slab
+struct poolClass {
+  uint64_t head;                // Generation << 32 | (index + 1) of the first free buffer, 0 = empty
+  uint32_t first;               // Index of the class's first buffer
+  uint32_t count;               // Buffers in the class
+  uint64_t size;                // Bytes per buffer
+  uint64_t offset;              // Where the class's buffers start in the slab
+};
+
+// Shared between every session through an anonymous MAP_SHARED mapping,
+// followed by the per-buffer links and owners, then the slab itself
+struct poolState {
+  uint64_t budget;              // Bytes in the slab
+  uint64_t freeBytes;           // Bytes on the free lists
+  uint64_t fallbacks;           // Buffers malloc()ed because the pool was dry
+  uint32_t numBuffers;
+  uint32_t reserved;
+  struct poolClass classes[POOL_CLASSES];
+};
+
+// Bump allocator over one pool buffer.  A session takes one, and resets it
+// rather than freeing what it handed out.
+struct poolArena {
+  char* base;
+  size_t used;
+  size_t cap;
+};
+
+int poolInit(size_t budget);
+void* poolGet(size_t want, size_t min, size_t* got);
+void poolPut(void* buf);
+int poolAdmit(void);
+size_t poolReclaim(void);
+
+int arenaInit(struct poolArena* arena, size_t cap);
+void* arenaAlloc(struct poolArena* arena, size_t len);
+void arenaReset(struct poolArena* arena);
+void arenaRelease(struct poolArena* arena);
+
+#endif // POOL_H_
@@ -0,0 +1,246 @@
+/**
+* prefetch.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Popularity tracking and background prefetch
+* - Every -g records a hit against the requested path in a table shared by
+*   all forked sessions
+* - A prefetcher process wakes every PREFETCH_INTERVAL seconds, halves every
+*   count (so popularity tracks recent demand) and issues WILLNEED for the
+*   hottest files, so the next request for them is served from the page cache
+* - sendFile() asks prefetchIsHot() before dropping a finished file with
+*   DONTNEED, so one-off transfers don't evict the files everyone wants
+*
+* The table is lossy by design: sessions only claim empty slots and only the
+* prefetcher clears them, so no locking is needed.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "pathtrie.h"
+#include "prefetch.h"
+
+#define DEBUG 0
+
+static struct popularSlot* gSlots = NULL;   // Shared popularity table
+static pid_t gPrefetchPid = -1;             // Background prefetcher, if running
+
+static uint64_t hashPath(const char* path) {
+
+  // FNV-1a, 64-bit
+  uint64_t hash = 14695981039346656037ULL;
+  while (*path) {
+    hash ^= (unsigned char)*path++;
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+/*
+* Maps the shared popularity table
+* Must be called before the first fork() so every session shares it
+* Returns 0 on success, -1 on error
+*/
+
+int prefetchInit(void) {
+
+  gSlots = mmap(NULL, PREFETCH_SLOTS * sizeof(struct popularSlot),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (gSlots == MAP_FAILED) {
+    perror("prefetchInit: mmap");
+    gSlots = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static struct popularSlot* findSlot(const char* path, uint64_t key, int claim) {
+
+  int i;
+
+  for (i = 0; i < PREFETCH_PROBES; i++) {
+    struct popularSlot* slot = &gSlots[(key + i) % PREFETCH_SLOTS];
+    uint64_t current = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+    if (current == key) {
+      return slot;
+    }
+    if (current == 0 && claim) {
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        strcpy(slot->path, path);
+        slot->prefetchedAt = 0;
+        __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+        return slot;
+      }
+      if (expected == key) {
+        return slot;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+* Counts one request for path
+*/
+
+void prefetchRecordHit(const char* path) {
+
+  struct popularSlot* slot;
+
+  if (gSlots == NULL || strlen(path) >= PREFETCH_PATH_LENGTH) {
+    return;
+  }
+  if ((slot = findSlot(path, hashPath(path), 1)) != NULL) {
+    __atomic_add_fetch(&slot->hits, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+* Returns 1 if path is currently popular enough to keep in the page cache
+*/
+
+int prefetchIsHot(const char* path) {
+
+  struct popularSlot* slot;
+
+  if (gSlots == NULL || strlen(path) >= PREFETCH_PATH_LENGTH) {
+    return 0;
+  }
+  slot = findSlot(path, hashPath(path), 0);
+  return slot != NULL && __atomic_load_n(&slot->hits, __ATOMIC_RELAXED) >= PREFETCH_HOT_HITS;
+}
+
+static int compareSlotsByHits(const void* a, const void* b) {
+  const struct popularSlot* left = *(struct popularSlot* const*)a;
+  const struct popularSlot* right = *(struct popularSlot* const*)b;
+  return (right->hits > left->hits) - (right->hits < left->hits);
+}
+
+/*
+* One prefetcher pass: decay every count, then warm the hottest files
+*/
+
+static void prefetchPass(struct pathTrie* trie) {
+
+  struct popularSlot* hot[PREFETCH_SLOTS];
+  int numHot = 0;
+  long long budget = PREFETCH_BUDGET;
+  int64_t now = time(NULL);
+  int i;
+
+  for (i = 0; i < PREFETCH_SLOTS; i++) {
+    struct popularSlot* slot = &gSlots[i];
+    uint32_t hits;
+
+    if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    hits = __atomic_load_n(&slot->hits, __ATOMIC_RELAXED) / 2;
+    __atomic_store_n(&slot->hits, hits, __ATOMIC_RELAXED);
+
+    // Cold files give their slot back
+    if (hits == 0) {
+      __atomic_store_n(&slot->ready, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (hits >= PREFETCH_HOT_HITS && now - slot->prefetchedAt >= PREFETCH_REFRESH) {
+      hot[numHot++] = slot;
+    }
+  }
+
+  qsort(hot, numHot, sizeof(struct popularSlot*), compareSlotsByHits);
+
+  for (i = 0; i < numHot && budget > 0; i++) {
+    struct pathNode* node = pathTrieLookup(trie, hot[i]->path);
+    off_t length;
+    int fd;
+
+    if (node == NULL || !S_ISREG(node->mode)) {
+      continue;
+    }
+    if ((fd = pathTrieOpen(trie, node, O_RDONLY)) == -1) {
+      continue;
+    }
+    length = node->size < PREFETCH_MAX_FILE ? node->size : PREFETCH_MAX_FILE;
+    if (length > budget) {
+      length = budget;
+    }
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+    close(fd);
+
+    hot[i]->prefetchedAt = now;
+    budget -= length;
+
+    if (DEBUG) {
+      printf("prefetchPass(): warmed %lld bytes of %s\n", (long long)length, hot[i]->path);
+    }
+  }
+}
+
+/*
+* Forks the background prefetcher
+* It works from the copy of trie it inherits, so restart it after a re-index.
+* The child closes the numFds descriptors in fds (the listeners), so a
+* connection can't be left waiting on one that nobody accepts on, and it
+* dies with the server.
+* Returns the child's pid, or -1 on error
+*/
+
+pid_t prefetchStart(struct pathTrie* trie, const int* fds, int numFds) {
+
+  pid_t parent = getpid();
+  pid_t pid;
+  int i;
+
+  if (gSlots == NULL) {
+    return -1;
+  }
+  prefetchStop();
+
+  if ((pid = fork()) != 0) {
+    gPrefetchPid = pid;
+    return pid;
+  }
+
+  // CHILD PROCESS BEGIN
+  for (i = 0; i < numFds; i++) {
+    if (fds[i] != -1) {
+      close(fds[i]);
+    }
+  }
+  signal(SIGHUP, SIG_IGN);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  while (getppid() == parent) {
+    sleep(PREFETCH_INTERVAL);
+    prefetchPass(trie);
+  }
+  exit(0);
+  // CHILD PROCESS END
+}
+
+/*
+* Stops the background prefetcher, if one is running
+*/
+
+void prefetchStop(void) {
+
+  if (gPrefetchPid > 0) {
+    kill(gPrefetchPid, SIGTERM);
+    gPrefetchPid = -1;
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef PREFETCH_H_ /* Include Guard */
+#define PREFETCH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct pathTrie;
+
+#define PREFETCH_SLOTS 1024         // Files the popularity table can track
+#define PREFETCH_PATH_LENGTH 496    // Longer paths aren't tracked
+#define PREFETCH_PROBES 8           // Open-addressing probe limit
+#define PREFETCH_INTERVAL 2         // Seconds between prefetcher passes
+#define PREFETCH_REFRESH 30         // Seconds before a warmed file is warmed again
+#define PREFETCH_HOT_HITS 4         // Decayed hit count that makes a file "hot"
+#define PREFETCH_BUDGET (512LL << 20)   // Bytes warmed per pass
+#define PREFETCH_MAX_FILE (128LL << 20) // Bytes warmed per file
+
+// One tracked file, shared between every session through an anonymous
+// MAP_SHARED mapping created before the first fork()
+struct popularSlot {
+  uint64_t key;             // FNV-1a of the path, 0 = empty
+  uint32_t hits;            // Request count, halved every pass
+  uint32_t ready;           // path[] has been fully written
+  int64_t prefetchedAt;     // When the prefetcher last warmed this file
+  char path[PREFETCH_PATH_LENGTH];
+};
+
+int prefetchInit(void);
+void prefetchRecordHit(const char* path);
+int prefetchIsHot(const char* path);
+pid_t prefetchStart(struct pathTrie* trie, const int* fds, int numFds);
+void prefetchStop(void);
+
+#endif // PREFETCH_H_
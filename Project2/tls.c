@@ -0,0 +1,365 @@
+/**
+* tls.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Encrypted control and data connections, with the bulk data still sent by
+* sendfile()
+* - The handshake is done in user space by OpenSSL.  With SSL_OP_ENABLE_KTLS
+*   OpenSSL then hands the session's keys to the kernel (the "tls" TCP ULP),
+*   and from there on the socket encrypts whatever is written to it, so
+*   netSendfile() is still a sendfile() and file contents still never pass
+*   through user space.
+* - Where the kernel has no TLS (module not loaded, cipher it can't do), or
+*   with -U, the connection stays in user space: netSendfile() reads the
+*   file into a pooled buffer and SSL_write()s it.
+* - Every socket read and write in ftserver goes through netSend()/netRecv().
+*   A descriptor that has had tlsStart() is looked up in a small table and
+*   goes through its SSL; any other is a plain send()/recv().  With TLS off
+*   the table is empty and nothing changes.
+*
+* TLS roles don't follow TCP roles: ftserver is the TLS server on the data
+* connections it connects back on, too, so only it needs a certificate.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "pool.h"
+#include "tls.h"
+
+#define DEBUG 0
+
+// One TLS connection: the socket and the session on it
+struct tlsConn {
+  int fd;                       // -1 = free slot
+  SSL* ssl;
+  int kernelSend;               // Records are written by the kernel
+  int kernelRecv;               // ... and read by it
+};
+
+static SSL_CTX* gTlsContext = NULL;
+static int gTlsServer = 0;
+static struct tlsConn gConns[TLS_MAX_CONNS];
+
+static struct tlsConn* findConn(int fd) {
+
+  int i;
+
+  if (gTlsContext == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < TLS_MAX_CONNS; i++) {
+    if (gConns[i].fd == fd) {
+      return &gConns[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+* Sets up TLS for every connection this process makes from now on
+* A server needs certFile and keyFile.  A client verifies the server against
+* caFile, or the system's CAs if it's NULL.  kernel asks for kTLS.
+* Returns 0 on success, -1 on error
+*/
+
+int tlsInit(int server, const char* certFile, const char* keyFile, const char* caFile, int kernel) {
+
+  SSL_CTX* ctx;
+  int i;
+
+  ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if (ctx == NULL) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+
+  // kTLS does TLS 1.3 with AES-GCM (and ChaCha20 on newer kernels) only
+  SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+  SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERSUITES);
+  if (kernel) {
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  }
+
+  if (server) {
+    // Sessions are one command long and never resumed
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+      ERR_print_errors_fp(stderr);
+      SSL_CTX_free(ctx);
+      return -1;
+    }
+  } else {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if ((caFile != NULL ? SSL_CTX_load_verify_locations(ctx, caFile, NULL)
+                        : SSL_CTX_set_default_verify_paths(ctx)) != 1) {
+      ERR_print_errors_fp(stderr);
+      SSL_CTX_free(ctx);
+      return -1;
+    }
+  }
+
+  // OpenSSL writes with write(), which has no MSG_NOSIGNAL
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < TLS_MAX_CONNS; i++) {
+    gConns[i].fd = -1;
+  }
+  gTlsContext = ctx;
+  gTlsServer = server;
+  return 0;
+}
+
+int tlsEnabled(void) {
+  return gTlsContext != NULL;
+}
+
+/*
+* Runs the handshake on fd, in the role tlsInit() was given
+* A client checks the server's certificate is for host.  A peer that never
+* answers (a cleartext client waiting for HELLO, say) is dropped after
+* TLS_HANDSHAKE_TIMEOUT_MS.
+* Does nothing if TLS is off.
+* Returns 0 on success, -1 on error
+*/
+
+int tlsStart(int fd, const char* host) {
+
+  struct tlsConn* conn;
+  struct timeval timeout = { TLS_HANDSHAKE_TIMEOUT_MS / 1000, (TLS_HANDSHAKE_TIMEOUT_MS % 1000) * 1000 };
+  struct timeval forever = { 0, 0 };
+  SSL* ssl;
+  int status;
+
+  if (gTlsContext == NULL) {
+    return 0;
+  }
+  if ((conn = findConn(-1)) == NULL || (ssl = SSL_new(gTlsContext)) == NULL) {
+    fprintf(stderr, "tlsStart: no room for another connection\n");
+    return -1;
+  }
+  SSL_set_fd(ssl, fd);
+  if (!gTlsServer && host != NULL) {
+    SSL_set_tlsext_host_name(ssl, host);
+    SSL_set1_host(ssl, host);
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+  status = gTlsServer ? SSL_accept(ssl) : SSL_connect(ssl);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof forever);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &forever, sizeof forever);
+  if (status != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    return -1;
+  }
+
+  conn->fd = fd;
+  conn->ssl = ssl;
+  conn->kernelSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+  conn->kernelRecv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+  if (DEBUG) {
+    printf("tlsStart(): %s %s, kernel send %d recv %d\n", SSL_get_version(ssl),
+           SSL_get_cipher_name(ssl), conn->kernelSend, conn->kernelRecv);
+  }
+  return 0;
+}
+
+/*
+* Whether what's written to fd is encrypted by the kernel
+* (so sendfile() and splice() work on it as on a plain socket)
+*/
+
+int tlsKernelSend(int fd) {
+  struct tlsConn* conn = findConn(fd);
+  return conn != NULL && conn->kernelSend;
+}
+
+/*
+* Whether fd can be read around OpenSSL right now: the kernel decrypts it,
+* and OpenSSL isn't holding any of it already
+*/
+
+int tlsKernelRecv(int fd) {
+  struct tlsConn* conn = findConn(fd);
+  return conn != NULL && conn->kernelRecv && SSL_pending(conn->ssl) == 0 && !SSL_has_pending(conn->ssl);
+}
+
+// Turns a failed SSL_read()/SSL_write() into -1 and errno, or 0 for a clean close
+static ssize_t sslResult(SSL* ssl, int ret) {
+
+  switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      return -1;
+    case SSL_ERROR_SYSCALL:
+      if (errno == 0) {
+        errno = ECONNRESET;     // EOF without close_notify
+      }
+      return -1;
+    default:
+      errno = EPROTO;
+      return -1;
+  }
+}
+
+/*
+* send() that goes through fd's TLS session, if it has one
+* Returns the number of bytes sent, or -1 on error
+*/
+
+ssize_t netSend(int fd, const void* buf, size_t len, int flags) {
+
+  struct tlsConn* conn = findConn(fd);
+  size_t written;
+
+  if (conn == NULL) {
+    return send(fd, buf, len, flags);
+  }
+  ERR_clear_error();
+  errno = 0;
+  if (SSL_write_ex(conn->ssl, buf, len, &written) != 1) {
+    return sslResult(conn->ssl, 0);
+  }
+  return written;
+}
+
+/*
+* recv() that goes through fd's TLS session, if it has one
+* Only MSG_PEEK is honoured on a TLS connection.
+* Returns the number of bytes received, 0 at the end, or -1 on error
+*/
+
+ssize_t netRecv(int fd, void* buf, size_t len, int flags) {
+
+  struct tlsConn* conn = findConn(fd);
+  size_t got;
+  int ok;
+
+  if (conn == NULL) {
+    return recv(fd, buf, len, flags);
+  }
+  ERR_clear_error();
+  errno = 0;
+  ok = (flags & MSG_PEEK) ? SSL_peek_ex(conn->ssl, buf, len, &got)
+                          : SSL_read_ex(conn->ssl, buf, len, &got);
+  if (ok != 1) {
+    return sslResult(conn->ssl, 0);
+  }
+  return got;
+}
+
+/*
+* sendfile() that goes through fd's TLS session, if it has one
+* With kTLS it's a real sendfile(); otherwise up to count bytes are read
+* into a pool buffer and written with SSL_write().
+* Returns the number of bytes sent, or -1 on error
+*/
+
+ssize_t netSendfile(int fd, int fileFd, off_t* offset, size_t count) {
+
+  struct tlsConn* conn = findConn(fd);
+  size_t cap, written;
+  ssize_t got;
+  char* buf;
+
+  if (conn == NULL) {
+    return sendfile(fd, fileFd, offset, count);
+  }
+  if (conn->kernelSend) {
+    ossl_ssize_t sent;
+    ERR_clear_error();
+    errno = 0;
+    if ((sent = SSL_sendfile(conn->ssl, fileFd, *offset, count, 0)) < 0) {
+      if (errno == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    *offset += sent;
+    return sent;
+  }
+
+  if ((buf = poolGet(TLS_COPY_BYTES, POOL_MIN_BYTES, &cap)) == NULL) {
+    return -1;
+  }
+  got = pread(fileFd, buf, count < cap ? count : cap, *offset);
+  if (got > 0) {
+    ERR_clear_error();
+    errno = 0;
+    if (SSL_write_ex(conn->ssl, buf, got, &written) != 1) {
+      got = sslResult(conn->ssl, 0);
+    } else {
+      *offset += written;
+      got = written;
+    }
+  }
+  poolPut(buf);
+  return got;
+}
+
+static ssize_t cookieWrite(void* cookie, const char* buf, size_t len) {
+
+  int fd = (int)(intptr_t)cookie;
+  size_t offset = 0;
+
+  while (offset < len) {
+    ssize_t sent = netSend(fd, buf + offset, len - offset, MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 1) {
+      return offset > 0 ? (ssize_t)offset : -1;
+    }
+    offset += sent;
+  }
+  return len;
+}
+
+/*
+* A stdio stream that writes to fd through netSend()
+* fclose() flushes it, and leaves fd open
+*/
+
+FILE* netFdopen(int fd) {
+
+  cookie_io_functions_t functions = { NULL, cookieWrite, NULL, NULL };
+  return fopencookie((void*)(intptr_t)fd, "w", functions);
+}
+
+/*
+* Ends fd's TLS session, if it has one, with a close_notify, and closes fd
+*/
+
+void netClose(int fd) {
+
+  struct tlsConn* conn = findConn(fd);
+
+  if (conn != NULL) {
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->fd = -1;
+    conn->ssl = NULL;
+  }
+  close(fd);
+}
@@ -0,0 +1,27 @@
+#ifndef TLS_H_ /* Include Guard */
+#define TLS_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define TLS_MAX_CONNS 32                // Connections one process may have open at once
+#define TLS_COPY_BYTES (256 << 10)      // Read per SSL_write() where sendfile() can't be used
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000  // A peer that doesn't speak TLS is given up on after this
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+
+#define TLS_SERVER 1                    // tlsInit() roles
+#define TLS_CLIENT 0
+
+int tlsInit(int server, const char* certFile, const char* keyFile, const char* caFile, int kernel);
+int tlsEnabled(void);
+int tlsStart(int fd, const char* host);
+int tlsKernelSend(int fd);
+int tlsKernelRecv(int fd);
+
+ssize_t netSend(int fd, const void* buf, size_t len, int flags);
+ssize_t netRecv(int fd, void* buf, size_t len, int flags);
+ssize_t netSendfile(int fd, int fileFd, off_t* offset, size_t count);
+FILE* netFdopen(int fd);
+void netClose(int fd);
+
+#endif // TLS_H_
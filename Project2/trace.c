@@ -0,0 +1,249 @@
+/**
+* trace.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Per-session tracing
+* - Each traced session claims one of TRACE_RINGS rings in a table shared by
+*   all forked sessions, and records a timestamped span for every phase
+*   (HELLO, DATA_PORT, the lookup, the transfer, ...) into it.  The ring
+*   keeps the last TRACE_RING_EVENTS spans written to it, so a busy minute
+*   is still there after the sessions that wrote it have exited.
+* - Tracing is off until switched on (-x at startup, SIGUSR1 or "-T on").
+*   With sampling, only one session in sampleEvery is traced.  When a session
+*   isn't traced, every probe is a single test of a NULL pointer.
+* - traceDump() writes every ring out as Chrome trace-event JSON, which
+*   chrome://tracing or Perfetto load directly.  Each session is its own
+*   row (tid = the session's pid).  The server dumps on SIGUSR2 and on "-T dump".
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define DEBUG 0
+
+static struct traceState* gTrace = NULL;    // Shared rings and switches
+static struct traceRing* gRing = NULL;      // This session's ring, if it's being traced
+static int64_t gSessionStart = 0;
+static pid_t gServerPid = 0;
+
+static int64_t nowNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+* Maps the shared trace rings, with tracing off
+* Must be called before the first fork() so every session shares them
+* Returns 0 on success, -1 on error
+*/
+
+int traceInit(void) {
+
+  gTrace = mmap(NULL, sizeof(struct traceState), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (gTrace == MAP_FAILED) {
+    perror("traceInit: mmap");
+    gTrace = NULL;
+    return -1;
+  }
+  gTrace->sampleEvery = 1;
+  gServerPid = getpid();
+  return 0;
+}
+
+/*
+* Switches tracing on (tracing one session in sampleEvery) or off
+* Safe to call from a signal handler or any session
+*/
+
+void traceSetEnabled(int enabled, unsigned sampleEvery) {
+
+  if (gTrace == NULL) {
+    return;
+  }
+  if (sampleEvery > 0) {
+    __atomic_store_n(&gTrace->sampleEvery, sampleEvery, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&gTrace->enabled, enabled ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+int traceIsEnabled(void) {
+  return gTrace != NULL && __atomic_load_n(&gTrace->enabled, __ATOMIC_ACQUIRE);
+}
+
+/*
+* Decides whether this session is traced, and if it is, claims a ring
+* A ring whose owner has died without giving it back is taken over.
+* Call once in the session's process, right after fork()
+*/
+
+void traceSessionBegin(void) {
+
+  uint64_t n;
+  uint32_t every, pid = getpid();
+  int i;
+
+  gRing = NULL;
+  if (!traceIsEnabled()) {
+    return;
+  }
+  n = __atomic_fetch_add(&gTrace->sessions, 1, __ATOMIC_RELAXED);
+  every = __atomic_load_n(&gTrace->sampleEvery, __ATOMIC_RELAXED);
+  if (every > 1 && n % every != 0) {
+    return;
+  }
+
+  // A ring is free, or was held by a session that exited without
+  // traceSessionEnd() (exit() on a bad command, a kill)
+  for (i = 0; i < TRACE_RINGS; i++) {
+    struct traceRing* ring = &gTrace->rings[(pid + i) % TRACE_RINGS];
+    uint32_t expected = __atomic_load_n(&ring->owner, __ATOMIC_RELAXED);
+    if (expected != 0 && (kill((pid_t)expected, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&ring->owner, &expected, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      gRing = ring;
+      gSessionStart = nowNanos();
+      return;
+    }
+  }
+  __atomic_add_fetch(&gTrace->dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Records the whole-session span and gives the ring back
+*/
+
+void traceSessionEnd(void) {
+
+  struct traceRing* ring = gRing;
+
+  if (ring == NULL) {
+    return;
+  }
+  traceEnd("session", gSessionStart, 0);
+  gRing = NULL;
+  __atomic_store_n(&ring->owner, 0, __ATOMIC_RELEASE);
+}
+
+/*
+* Starts a span: returns the time to hand to traceEnd(), or 0 when this
+* session isn't traced (so untraced sessions don't even read the clock)
+*/
+
+int64_t traceStart(void) {
+  return gRing != NULL ? nowNanos() : 0;
+}
+
+/*
+* Records the span from start (a traceStart() value) until now
+*/
+
+void traceEnd(const char* name, int64_t start, int64_t arg) {
+
+  struct traceEvent* event;
+  uint64_t head;
+
+  if (gRing == NULL || start == 0) {
+    return;
+  }
+  head = gRing->head;
+  event = &gRing->events[head % TRACE_RING_EVENTS];
+  event->start = start;
+  event->duration = nowNanos() - start;
+  event->arg = arg;
+  event->pid = getpid();
+  strncpy(event->name, name, TRACE_NAME_LENGTH - 1);
+  event->name[TRACE_NAME_LENGTH - 1] = '\0';
+
+  // Publish only once the event is complete, so a dump never sees half of it
+  __atomic_store_n(&gRing->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Writes every ring to out as Chrome trace-event JSON
+* Rings may be written to while we read them; spans overwritten during the
+* copy are left out rather than printed torn.
+* Returns the number of spans written, or -1 on error
+*/
+
+int traceDump(FILE* out) {
+
+  struct traceEvent* copy;
+  int written = 0, r;
+
+  if (gTrace == NULL || (copy = malloc(sizeof(struct traceEvent) * TRACE_RING_EVENTS)) == NULL) {
+    return -1;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"sessions\":%llu,\"dropped\":%llu},\"traceEvents\":[",
+          (unsigned long long)__atomic_load_n(&gTrace->sessions, __ATOMIC_RELAXED),
+          (unsigned long long)__atomic_load_n(&gTrace->dropped, __ATOMIC_RELAXED));
+
+  for (r = 0; r < TRACE_RINGS; r++) {
+    struct traceRing* ring = &gTrace->rings[r];
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    uint64_t i, after;
+
+    for (i = first; i < head; i++) {
+      copy[i - first] = ring->events[i % TRACE_RING_EVENTS];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    // The writer fills index after's slot (that of after - TRACE_RING_EVENTS)
+    // before publishing after + 1, so that one may be torn too
+    if (after >= TRACE_RING_EVENTS && after - TRACE_RING_EVENTS + 1 > first) {
+      first = after - TRACE_RING_EVENTS + 1;    // The writer lapped us; skip what it overwrote
+    }
+
+    for (i = first; i < head; i++) {
+      struct traceEvent* event = &copy[i - (head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0)];
+      fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+              written ? "," : "", event->name, (int)gServerPid, (int)event->pid,
+              event->start / 1000.0, event->duration / 1000.0);
+      if (event->arg != 0) {
+        fprintf(out, ",\"args\":{\"n\":%lld}", (long long)event->arg);
+      }
+      fputc('}', out);
+      written++;
+    }
+  }
+  fprintf(out, "\n]}\n");
+  free(copy);
+
+  if (DEBUG) {
+    printf("traceDump(): %d spans\n", written);
+  }
+  return ferror(out) ? -1 : written;
+}
+
+/*
+* Dumps the rings to the file at path, replacing it
+* Returns the number of spans written, or -1 on error
+*/
+
+int traceDumpFile(const char* path) {
+
+  FILE* out = fopen(path, "w");
+  int written;
+
+  if (out == NULL) {
+    perror("traceDumpFile: fopen");
+    return -1;
+  }
+  written = traceDump(out);
+  if (fclose(out) != 0) {
+    return -1;
+  }
+  return written;
+}
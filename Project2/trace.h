@@ -0,0 +1,49 @@
+#ifndef TRACE_H_ /* Include Guard */
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_RINGS 32              // Sessions that can be traced at once
+#define TRACE_RING_EVENTS 2048      // Spans each ring keeps before overwriting the oldest
+#define TRACE_NAME_LENGTH 16        // Span names longer than this are cut short
+#define TRACE_DEFAULT_FILE "ftserver-trace.json"
+
+// One timed span, as a Chrome trace-event "complete" (ph "X") event
+struct traceEvent {
+  int64_t start;                    // CLOCK_MONOTONIC nanoseconds
+  int64_t duration;
+  int64_t arg;                      // Bytes, entries, ...; 0 = none
+  int32_t pid;                      // Session that recorded it
+  char name[TRACE_NAME_LENGTH];
+};
+
+// One worker's ring.  A session claims a free ring for its lifetime and is
+// the only writer, so recording a span takes no locks.
+struct traceRing {
+  uint32_t owner;                   // pid of the session writing it, 0 = free
+  uint32_t reserved;
+  uint64_t head;                    // Spans ever written; the newest is at (head - 1) % TRACE_RING_EVENTS
+  struct traceEvent events[TRACE_RING_EVENTS];
+};
+
+// Shared between every session through an anonymous MAP_SHARED mapping
+struct traceState {
+  uint32_t enabled;
+  uint32_t sampleEvery;             // Trace one session in this many
+  uint64_t sessions;                // Sessions started while enabled
+  uint64_t dropped;                 // Sampled sessions that found no free ring
+  struct traceRing rings[TRACE_RINGS];
+};
+
+int traceInit(void);
+void traceSetEnabled(int enabled, unsigned sampleEvery);
+int traceIsEnabled(void);
+void traceSessionBegin(void);
+void traceSessionEnd(void);
+int64_t traceStart(void);
+void traceEnd(const char* name, int64_t start, int64_t arg);
+int traceDump(FILE* out);
+int traceDumpFile(const char* path);
+
+#endif // TRACE_H_
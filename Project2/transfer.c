@@ -0,0 +1,163 @@
+/**
+* transfer.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* File transfer engine
+* - Streams a byte range of a file to the data socket with sendfile(), so the
+*   contents never pass through user space
+* - Tells the kernel the access is sequential, and keeps a WILLNEED window
+*   ahead of the send position.  The window starts at READAHEAD_MIN and doubles
+*   each time the sender catches up with it, up to READAHEAD_MAX, so cold
+*   large files are read from disk in big requests while small ones don't
+*   trigger large reads.
+* - Sparse files can be sent as just their data extents, found with
+*   SEEK_DATA/SEEK_HOLE, so the holes never cross the wire (streamSparse())
+*/
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "tls.h"
+#include "transfer.h"
+
+#define DEBUG 0
+
+/*
+* Sends length bytes of fileFd, starting at start, to dataFd
+* Returns the number of bytes sent, or -1 on error
+*/
+
+off_t streamFile(int dataFd, int fileFd, off_t start, off_t length) {
+
+  off_t offset = start;
+  off_t end = start + length;
+  off_t advisedEnd = start;         // Everything before this has had WILLNEED
+  off_t window = READAHEAD_MIN;
+
+  posix_fadvise(fileFd, start, length, POSIX_FADV_SEQUENTIAL);
+
+  while (offset < end) {
+
+    // Once we're halfway through the advised window, advise the next one
+    // and grow it: we're consuming as fast as the disk delivers
+    if (advisedEnd < end && offset + window / 2 >= advisedEnd) {
+      off_t advise = advisedEnd + window < end ? window : end - advisedEnd;
+      posix_fadvise(fileFd, advisedEnd, advise, POSIX_FADV_WILLNEED);
+      advisedEnd += advise;
+      if (window < READAHEAD_MAX) {
+        window *= 2;
+      }
+    }
+
+    size_t chunk = end - offset < SEND_CHUNK ? (size_t)(end - offset) : SEND_CHUNK;
+    ssize_t bytesSent = netSendfile(dataFd, fileFd, &offset, chunk);
+
+    if (bytesSent == -1) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      perror("streamFile: sendfile");
+      return -1;
+    }
+    if (bytesSent == 0) {
+      break;    // File shrank underneath us
+    }
+  }
+
+  if (DEBUG) {
+    printf("streamFile(): sent %lld bytes, final window %lld\n",
+           (long long)(offset - start), (long long)window);
+  }
+  return offset - start;
+}
+
+/*
+* Sends one extent header: where the extent starts and how long it is
+*/
+
+static int sendExtentHeader(int dataFd, off_t offset, off_t length) {
+
+  uint64_t header[2];
+  size_t sent = 0;
+
+  header[0] = htobe64((uint64_t)offset);
+  header[1] = htobe64((uint64_t)length);
+
+  // MSG_MORE lets the header share a segment with the data that follows
+  while (sent < EXTENT_HEADER_LENGTH) {
+    ssize_t bytesSent = netSend(dataFd, (char*)header + sent, EXTENT_HEADER_LENGTH - sent,
+                             length > 0 ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL);
+    if (bytesSent == -1 && errno == EINTR) {
+      continue;
+    }
+    if (bytesSent < 1) {
+      return -1;
+    }
+    sent += bytesSent;
+  }
+  return 0;
+}
+
+/*
+* Sends length bytes of fileFd, starting at start, as a series of data extents
+* Each extent is a header (u64 offset, u64 length, big-endian) followed by
+* that many bytes of the file.  Holes are skipped.  A final header with the
+* end of the range as its offset and a length of 0 ends the stream.  For a
+* whole file that's the file's length, which tells the receiver how long to
+* make the file so trailing holes survive.
+* Filesystems that can't report holes get the whole file as one extent.
+* Returns the number of data bytes sent, or -1 on error
+*/
+
+off_t streamSparse(int dataFd, int fileFd, off_t start, off_t length) {
+
+  off_t position = start;
+  off_t end = start + length;
+  off_t dataSent = 0;
+
+  while (position < end) {
+    off_t dataStart = lseek(fileFd, position, SEEK_DATA);
+    off_t dataEnd;
+
+    if (dataStart == -1 && errno == ENXIO) {
+      break;                                // Nothing but hole from here on
+    }
+    if (dataStart == -1) {
+      dataStart = position;                 // No SEEK_DATA here: send it all
+      dataEnd = end;
+    } else if ((dataEnd = lseek(fileFd, dataStart, SEEK_HOLE)) == -1) {
+      dataEnd = end;
+    }
+    if (dataStart >= end) {
+      break;
+    }
+    if (dataEnd > end) {
+      dataEnd = end;                        // The rest is another range's (or the file grew)
+    }
+
+    if (sendExtentHeader(dataFd, dataStart, dataEnd - dataStart) == -1 ||
+        streamFile(dataFd, fileFd, dataStart, dataEnd - dataStart) != dataEnd - dataStart) {
+      return -1;
+    }
+    dataSent += dataEnd - dataStart;
+    position = dataEnd;
+  }
+
+  if (sendExtentHeader(dataFd, end, 0) == -1) {
+    return -1;
+  }
+
+  if (DEBUG) {
+    printf("streamSparse(): sent %lld of %lld bytes\n", (long long)dataSent, (long long)length);
+  }
+  return dataSent;
+}
@@ -0,0 +1,14 @@
+#ifndef TRANSFER_H_ /* Include Guard */
+#define TRANSFER_H_
+
+#include <sys/types.h>
+
+#define READAHEAD_MIN (256 << 10)   // First read-ahead window
+#define READAHEAD_MAX (16 << 20)    // Largest read-ahead window
+#define SEND_CHUNK (1 << 20)        // Bytes handed to sendfile() per call
+#define EXTENT_HEADER_LENGTH 16     // u64 offset, u64 length before each sparse extent
+
+off_t streamFile(int dataFd, int fileFd, off_t start, off_t length);
+off_t streamSparse(int dataFd, int fileFd, off_t start, off_t length);
+
+#endif // TRANSFER_H_
@@ -0,0 +1,279 @@
+/**
+* validator.c
+* Project 2
+* cs372_400_w2017
+* Jeromie Clark <clarkje@oregonstate.edu>
+*
+* Conditional -g
+* - A client that already holds a file sends "-g <path> IF ..." with either
+*   the size and mtime of its copy or the content hash an earlier OK gave it.
+*   If the file still matches, the server answers NOT_MODIFIED on the control
+*   connection and never opens the data connection.
+* - Size and mtime are compared against fstat(), which costs no disk I/O.
+* - Content hashes are remembered per file, keyed by device, inode, size and
+*   mtime, in a table shared by all forked sessions.  A file is only read to
+*   hash it the first time it's asked about after a change; every check after
+*   that is answered from the table.
+*
+* The hash is a 64-bit multiply-rotate hash over 8-byte words.  It tells a
+* changed file from an unchanged one; it is not meant to stand up to someone
+* crafting collisions.
+*
+* Slots are direct-mapped by inode and guarded by a sequence count, so readers
+* never block and a writer that finds a slot busy just doesn't cache.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "pool.h"
+#include "validator.h"
+
+#define DEBUG 0
+
+#define HASH_PRIME1 0x9E3779B97F4A7C15ULL
+#define HASH_PRIME2 0x87C37B91114253D5ULL
+
+static struct validatorSlot* gSlots = NULL;   // Shared hash table
+
+/*
+* Maps the shared validator table
+* Must be called before the first fork() so every session shares it
+* Returns 0 on success, -1 on error
+*/
+
+int validatorInit(void) {
+
+  gSlots = mmap(NULL, VALIDATOR_SLOTS * sizeof(struct validatorSlot),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (gSlots == MAP_FAILED) {
+    perror("validatorInit: mmap");
+    gSlots = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+* Parses what follows the path in "-g <path> [IF <size> <mtime> | IF <hash> | IF -]"
+* Returns 0 on success, -1 if the condition is malformed
+*/
+
+int parseCondition(const char* in, struct getCondition* cond) {
+
+  char* end;
+  long long size, mtime;
+  unsigned long long hash;
+
+  memset(cond, 0, sizeof(struct getCondition));
+
+  while (*in == ' ' || *in == '\t') {
+    in++;
+  }
+  if (*in == '\0' || *in == '\r' || *in == '\n') {
+    return 0;                                   // Unconditional
+  }
+  if (strncmp(in, "IF ", 3) != 0) {
+    return -1;
+  }
+  in += 3;
+  while (*in == ' ') {
+    in++;
+  }
+
+  if (*in == '-') {
+    cond->kind = CONDITION_ANY;
+    return 0;
+  }
+
+  // "<size> <mtime>" has a space in it; a hash is one run of hex digits
+  size = strtoll(in, &end, 10);
+  if (end != in && *end == ' ') {
+    mtime = strtoll(end + 1, &end, 10);
+    if (size < 0 || (*end != '\0' && *end != '\r' && *end != '\n')) {
+      return -1;
+    }
+    cond->kind = CONDITION_SIZE_MTIME;
+    cond->size = size;
+    cond->mtime = mtime;
+    return 0;
+  }
+
+  hash = strtoull(in, &end, 16);
+  if (end - in != 16 || (*end != '\0' && *end != '\r' && *end != '\n' && *end != ' ')) {
+    return -1;
+  }
+  cond->kind = CONDITION_HASH;
+  cond->hash = hash;
+  return 0;
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t mixWord(uint64_t hash, uint64_t word) {
+  hash ^= rotl64(word * HASH_PRIME1, 31) * HASH_PRIME2;
+  return rotl64(hash, 27) * 5 + 0x52dce729;
+}
+
+/*
+* Mixes len bytes of data into hash as 8-byte words, the last one zero-padded
+* Only the final call for a stream may have a length that isn't a multiple of 8
+*/
+
+uint64_t hashWords(uint64_t hash, const void* data, size_t len) {
+
+  const unsigned char* p = data;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    hash = mixWord(hash, word);
+  }
+  if (i < len) {
+    uint64_t word = 0;
+    memcpy(&word, p + i, len - i);
+    hash = mixWord(hash, word);
+  }
+  return hash;
+}
+
+uint64_t hashWord(uint64_t hash, uint64_t word) {
+  return mixWord(hash, word);
+}
+
+/*
+* Final avalanche, so every input bit reaches every output bit
+*/
+
+uint64_t hashFinish(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/*
+* Hashes the whole of fd, which should be st->st_size bytes long
+* Returns 0 on success, -1 on a read error or if the size didn't match
+*/
+
+static int hashFile(int fd, const struct stat* st, uint64_t* result) {
+
+  unsigned char* buf;
+  uint64_t hash = HASH_PRIME2 ^ (uint64_t)st->st_size;
+  off_t offset = 0;
+  size_t chunk;
+
+  // Any multiple of 8 gives the same hash, so take what the pool can spare
+  if ((buf = poolGet(VALIDATOR_CHUNK, POOL_MIN_BYTES, &chunk)) == NULL) {
+    return -1;
+  }
+  posix_fadvise(fd, 0, st->st_size, POSIX_FADV_SEQUENTIAL);
+
+  while (1) {
+    size_t length = 0;
+    ssize_t bytesRead;
+
+    // Fill the whole chunk so every word but the last is complete
+    while (length < chunk) {
+      bytesRead = pread(fd, buf + length, chunk - length, offset + length);
+      if (bytesRead == -1) {
+        poolPut(buf);
+        return -1;
+      }
+      if (bytesRead == 0) {
+        break;
+      }
+      length += bytesRead;
+    }
+
+    hash = hashWords(hash, buf, length);
+    offset += length;
+
+    if (length < chunk) {
+      break;
+    }
+  }
+  poolPut(buf);
+
+  // The file changed while we were reading it; a hash of that is no use
+  if (offset != st->st_size) {
+    return -1;
+  }
+
+  *result = hashFinish(hash);
+  return 0;
+}
+
+static struct validatorSlot* slotFor(const struct stat* st) {
+  uint64_t key = ((uint64_t)st->st_ino * HASH_PRIME1) ^ ((uint64_t)st->st_dev * HASH_PRIME2);
+  return &gSlots[(key >> 32) % VALIDATOR_SLOTS];
+}
+
+static int slotMatches(struct validatorSlot* slot, const struct stat* st) {
+  return __atomic_load_n(&slot->dev, __ATOMIC_RELAXED) == (uint64_t)st->st_dev &&
+         __atomic_load_n(&slot->ino, __ATOMIC_RELAXED) == (uint64_t)st->st_ino &&
+         __atomic_load_n(&slot->size, __ATOMIC_RELAXED) == (int64_t)st->st_size &&
+         __atomic_load_n(&slot->mtimeSec, __ATOMIC_RELAXED) == (int64_t)st->st_mtim.tv_sec &&
+         __atomic_load_n(&slot->mtimeNsec, __ATOMIC_RELAXED) == (int64_t)st->st_mtim.tv_nsec;
+}
+
+/*
+* Finds the content hash of the open file fd, whose fstat() is st
+* Answered from the shared table when the file hasn't changed since it was
+* last hashed; otherwise the file is read once and the table updated.
+* Returns 0 on success, -1 on error
+*/
+
+int validatorHash(int fd, const struct stat* st, uint64_t* hash) {
+
+  struct validatorSlot* slot;
+  uint32_t seq;
+
+  if (gSlots == NULL) {
+    return hashFile(fd, st, hash);
+  }
+  slot = slotFor(st);
+
+  // Read the slot; it only counts if no writer touched it meanwhile
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if (seq != 0 && (seq & 1) == 0 && slotMatches(slot, st)) {
+    uint64_t cached = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+      *hash = cached;
+      if (DEBUG) {
+        printf("validatorHash(): hit for inode %llu\n", (unsigned long long)st->st_ino);
+      }
+      return 0;
+    }
+  }
+
+  if (hashFile(fd, st, hash) == -1) {
+    return -1;
+  }
+
+  // Claim the slot by making seq odd.  Someone else is writing it: skip.
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) == 0 &&
+      __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&slot->dev, (uint64_t)st->st_dev, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ino, (uint64_t)st->st_ino, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, (int64_t)st->st_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtimeSec, (int64_t)st->st_mtim.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtimeNsec, (int64_t)st->st_mtim.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hash, *hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef VALIDATOR_H_ /* Include Guard */
+#define VALIDATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define VALIDATOR_SLOTS 4096          // Files whose content hash is remembered
+#define VALIDATOR_CHUNK (1 << 20)     // Bytes read per pread() while hashing
+
+#define CONDITION_NONE 0              // Plain -g: always send the file
+#define CONDITION_ANY 1               // "IF -": no local copy, send the file and its validators
+#define CONDITION_SIZE_MTIME 2        // "IF <size> <mtime>": client's size and mtime in seconds
+#define CONDITION_HASH 3              // "IF <hash>": content hash from an earlier OK
+
+// What the client says it already holds, from "-g <path> IF ..."
+struct getCondition {
+  int kind;                   // CONDITION_*
+  off_t size;
+  int64_t mtime;              // Seconds
+  uint64_t hash;
+};
+
+// One remembered content hash, shared between every session through an
+// anonymous MAP_SHARED mapping created before the first fork()
+struct validatorSlot {
+  uint32_t seq;               // Odd while a writer is filling the slot in
+  uint32_t reserved;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t hash;
+};
+
+int validatorInit(void);
+int parseCondition(const char* in, struct getCondition* cond);
+int validatorHash(int fd, const struct stat* st, uint64_t* hash);
+uint64_t hashWords(uint64_t hash, const void* data, size_t len);
+uint64_t hashWord(uint64_t hash, uint64_t word);
+uint64_t hashFinish(uint64_t hash);
+
+#endif // VALIDATOR_H_
@@ -0,0 +1,191 @@
+/*
+ * netconnect.c
+ * CS372_400_W2017
+ * Jeromie Clark <clarkje@oregonstate.edu>
+ *
+ * Outbound TCP connects shared by chatclient and ftserver
+ *
+ * Trying getaddrinfo()'s results one at a time with a blocking connect()
+ * means a dead or filtered first address costs the full TCP timeout before
+ * the next one gets a chance.  connectFirst() races them instead, roughly
+ * the way RFC 8305 ("Happy Eyeballs") does:
+ *
+ * - Addresses are interleaved by family (IPv6, IPv4, IPv6, ...), starting
+ *   with whichever family getaddrinfo() put first
+ * - Each attempt is a non-blocking connect() that gets CONNECT_STAGGER_MS
+ *   to itself before the next one starts; a failure starts the next at once
+ * - Every attempt has its own timeout
+ * - The first to connect wins and the rest are closed
+ *
+ * The winning socket is handed back in blocking mode, so callers can treat it
+ * exactly like the result of an ordinary connect().
+ */
+
+#include "netconnect.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+static long nowMillis(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// orderCandidates(struct addrinfo* candidates, struct addrinfo** order)
+// Interleaves the candidates by address family, first family first
+// Returns how many were kept
+
+static int orderCandidates(struct addrinfo* candidates, struct addrinfo** order) {
+
+  struct addrinfo* first[MAX_CONNECT_ATTEMPTS];
+  struct addrinfo* other[MAX_CONNECT_ATTEMPTS];
+  struct addrinfo* p;
+  int numFirst = 0, numOther = 0, count = 0, i;
+
+  for (p = candidates; p != NULL; p = p->ai_next) {
+    if (p->ai_family == candidates->ai_family && numFirst < MAX_CONNECT_ATTEMPTS) {
+      first[numFirst++] = p;
+    } else if (p->ai_family != candidates->ai_family && numOther < MAX_CONNECT_ATTEMPTS) {
+      other[numOther++] = p;
+    }
+  }
+  for (i = 0; count < MAX_CONNECT_ATTEMPTS && (i < numFirst || i < numOther); i++) {
+    if (i < numFirst) {
+      order[count++] = first[i];
+    }
+    if (i < numOther && count < MAX_CONNECT_ATTEMPTS) {
+      order[count++] = other[i];
+    }
+  }
+  return count;
+}
+
+// connectFirst(struct addrinfo* candidates, int attemptTimeoutMs)
+// Races connects to the candidates (as returned by getaddrinfo())
+// Returns a connected, blocking socket, or -1 with errno from the last failure
+
+int connectFirst(struct addrinfo* candidates, int attemptTimeoutMs) {
+
+  struct addrinfo* order[MAX_CONNECT_ATTEMPTS];
+  struct pollfd fds[MAX_CONNECT_ATTEMPTS];
+  long startedAt[MAX_CONNECT_ATTEMPTS];
+  int numCandidates, next = 0, active = 0, winner = -1, lastError = ETIMEDOUT, i;
+  long nextStart = 0;
+
+  if (candidates == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  numCandidates = orderCandidates(candidates, order);
+
+  while (winner == -1 && (next < numCandidates || active > 0)) {
+
+    long now = nowMillis();
+    int timeout;
+
+    // Start the next attempt once the last one's head start is up (or nothing's in flight)
+    if (next < numCandidates && (active == 0 || now >= nextStart)) {
+      struct addrinfo* p = order[next++];
+      int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+
+      if (fd == -1) {
+        lastError = errno;
+        continue;
+      }
+      if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+        winner = fd;    // Loopback can finish on the spot
+        break;
+      }
+      if (errno != EINPROGRESS) {
+        lastError = errno;
+        close(fd);
+        continue;
+      }
+      fds[active].fd = fd;
+      fds[active].events = POLLOUT;
+      startedAt[active] = now;
+      active++;
+      nextStart = now + CONNECT_STAGGER_MS;
+      continue;
+    }
+
+    // Sleep until something finishes, the next start is due, or an attempt times out
+    timeout = next < numCandidates ? (int)(nextStart - now) : attemptTimeoutMs;
+    for (i = 0; i < active; i++) {
+      long left = startedAt[i] + attemptTimeoutMs - now;
+      if (left < timeout) {
+        timeout = (int)left;
+      }
+    }
+    if (poll(fds, active, timeout > 0 ? timeout : 0) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      lastError = errno;
+      break;
+    }
+
+    now = nowMillis();
+    for (i = active - 1; i >= 0 && winner == -1; i--) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+
+      if (fds[i].revents != 0) {
+        if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1) {
+          error = errno;
+        }
+        if (error == 0) {
+          winner = fds[i].fd;
+        } else {
+          lastError = error;
+          close(fds[i].fd);
+          nextStart = now;    // Don't make the next one wait out the head start
+        }
+      } else if (now - startedAt[i] >= attemptTimeoutMs) {
+        lastError = ETIMEDOUT;
+        close(fds[i].fd);
+        nextStart = now;
+      } else {
+        continue;
+      }
+      fds[i] = fds[active - 1];
+      startedAt[i] = startedAt[active - 1];
+      active--;
+    }
+  }
+
+  // Lost the race (or ran out of time)
+  for (i = 0; i < active; i++) {
+    close(fds[i].fd);
+  }
+
+  if (winner == -1) {
+    errno = lastError;
+    return -1;
+  }
+  fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+  return winner;
+}
+
+// connectAddress(const struct sockaddr* addr, socklen_t addrLength, int timeoutMs)
+// Connects to one known address, giving up after timeoutMs
+// Returns a connected, blocking socket, or -1 with errno set
+
+int connectAddress(const struct sockaddr* addr, socklen_t addrLength, int timeoutMs) {
+
+  struct addrinfo candidate;
+
+  memset(&candidate, 0, sizeof candidate);
+  candidate.ai_family = addr->sa_family;
+  candidate.ai_socktype = SOCK_STREAM;
+  candidate.ai_addr = (struct sockaddr*)addr;
+  candidate.ai_addrlen = addrLength;
+  return connectFirst(&candidate, timeoutMs);
+}
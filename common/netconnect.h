@@ -0,0 +1,15 @@
+#ifndef NETCONNECT_H_ /* Include Guard */
+#define NETCONNECT_H_
+
+#include <sys/socket.h>
+
+struct addrinfo;
+
+#define CONNECT_STAGGER_MS 250      // Head start each attempt gets before the next one begins
+#define CONNECT_TIMEOUT_MS 5000     // Default limit on a single attempt
+#define MAX_CONNECT_ATTEMPTS 16     // Candidate addresses tried
+
+int connectFirst(struct addrinfo* candidates, int attemptTimeoutMs);
+int connectAddress(const struct sockaddr* addr, socklen_t addrLength, int timeoutMs);
+
+#endif // NETCONNECT_H_